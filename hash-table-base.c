@@ -1,112 +1,355 @@
-#include "hash-table-base.h"
-
-#include <assert.h>
-#include <stdlib.h>
-#include <string.h>
-#include <sys/queue.h>
-
-struct list_entry {
-	const char *key;
-	uint32_t value;
-	SLIST_ENTRY(list_entry) pointers;
-};
-
-SLIST_HEAD(list_head, list_entry);
-
-struct hash_table_entry {
-	struct list_head list_head;
-};
-
-struct hash_table_base {
-	struct hash_table_entry entries[HASH_TABLE_CAPACITY];
-};
-
-struct hash_table_base *hash_table_base_create()
-{
-	struct hash_table_base *hash_table = calloc(1, sizeof(struct hash_table_base));
-	assert(hash_table != NULL);
-	for (size_t i = 0; i < HASH_TABLE_CAPACITY; ++i) {
-		struct hash_table_entry *entry = &hash_table->entries[i];
-		SLIST_INIT(&entry->list_head);
-	}
-	return hash_table;
-}
-
-static struct hash_table_entry *get_hash_table_entry(struct hash_table_base *hash_table,
-                                                     const char *key)
-{
-	assert(key != NULL);
-	uint32_t index = bernstein_hash(key) % HASH_TABLE_CAPACITY;
-	struct hash_table_entry *entry = &hash_table->entries[index];
-	return entry;
-}
-
-static struct list_entry *get_list_entry(struct hash_table_base *hash_table,
-                                         const char *key,
-                                         struct list_head *list_head)
-{
-	assert(key != NULL);
-
-	struct list_entry *entry = NULL;
-	
-	SLIST_FOREACH(entry, list_head, pointers) {
-	  if (strcmp(entry->key, key) == 0) {
-	    return entry;
-	  }
-	}
-	return NULL;
-}
-
-bool hash_table_base_contains(struct hash_table_base *hash_table,
-                              const char *key)
-{
-	struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, key);
-	struct list_head *list_head = &hash_table_entry->list_head;
-	struct list_entry *list_entry = get_list_entry(hash_table, key, list_head);
-	return list_entry != NULL;
-}
-
-void hash_table_base_add_entry(struct hash_table_base *hash_table,
-                               const char *key,
-                               uint32_t value)
-{
-	struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, key);
-	struct list_head *list_head = &hash_table_entry->list_head;
-	struct list_entry *list_entry = get_list_entry(hash_table, key, list_head);
-
-	/* Update the value if it already exists */
-	if (list_entry != NULL) {
-		list_entry->value = value;
-		return;
-	}
-
-	list_entry = calloc(1, sizeof(struct list_entry));
-	list_entry->key = key;
-	list_entry->value = value;
-	SLIST_INSERT_HEAD(list_head, list_entry, pointers);
-}
-
-uint32_t hash_table_base_get_value(struct hash_table_base *hash_table,
-                                   const char *key)
-{
-	struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, key);
-	struct list_head *list_head = &hash_table_entry->list_head;
-	struct list_entry *list_entry = get_list_entry(hash_table, key, list_head);
-	assert(list_entry != NULL);
-	return list_entry->value;
-}
-
-void hash_table_base_destroy(struct hash_table_base *hash_table)
-{
-	for (size_t i = 0; i < HASH_TABLE_CAPACITY; ++i) {
-		struct hash_table_entry *entry = &hash_table->entries[i];
-		struct list_head *list_head = &entry->list_head;
-		struct list_entry *list_entry = NULL;
-		while (!SLIST_EMPTY(list_head)) {
-			list_entry = SLIST_FIRST(list_head);
-			SLIST_REMOVE_HEAD(list_head, pointers);
-			free(list_entry);
-		}
-	}
-	free(hash_table);
-}
+#include "hash-table-base.h"
+#include "hash-table-index.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+
+struct list_entry {
+	const char *key;
+	uint32_t hash;
+	uint32_t value;
+	SLIST_ENTRY(list_entry) pointers;
+};
+
+SLIST_HEAD(list_head, list_entry);
+
+struct hash_table_entry {
+	struct list_head list_head;
+	uint32_t length;
+	struct hash_table_index *index;
+};
+
+/*
+ * Tables start small: the first HASH_TABLE_SMALL_CAPACITY entries live
+ * inline and are scanned linearly. The bucket array is only allocated once
+ * the table grows past that.
+ */
+struct hash_table_base {
+	struct hash_table_entry *entries;
+	size_t size;
+	uint32_t small_size;
+	const char *small_keys[HASH_TABLE_SMALL_CAPACITY];
+	uint32_t small_values[HASH_TABLE_SMALL_CAPACITY];
+	enum hash_table_chain_policy chain_policy;
+	struct ht_allocator allocator;
+};
+
+struct hash_table_base *hash_table_base_create()
+{
+	return hash_table_base_create_with_allocator(&hash_table_default_allocator);
+}
+
+struct hash_table_base *hash_table_base_create_with_allocator(const struct ht_allocator *allocator)
+{
+	struct hash_table_base *hash_table = hash_table_alloc(allocator, sizeof(struct hash_table_base));
+	hash_table->allocator = *allocator;
+	return hash_table;
+}
+
+static struct hash_table_entry *get_hash_table_entry(struct hash_table_base *hash_table,
+                                                     uint32_t hash)
+{
+	uint32_t index = hash % HASH_TABLE_CAPACITY;
+	struct hash_table_entry *entry = &hash_table->entries[index];
+	return entry;
+}
+
+/* Move a hit towards the head of its chain, previous is never NULL */
+static void reorder_list_entry(enum hash_table_chain_policy chain_policy,
+                               struct hash_table_entry *hash_table_entry,
+                               struct list_entry *entry,
+                               struct list_entry *previous,
+                               struct list_entry *before_previous)
+{
+	struct list_head *list_head = &hash_table_entry->list_head;
+	switch (chain_policy) {
+	case HASH_TABLE_CHAIN_FIXED:
+		break;
+	case HASH_TABLE_CHAIN_MOVE_TO_FRONT:
+		SLIST_NEXT(previous, pointers) = SLIST_NEXT(entry, pointers);
+		SLIST_NEXT(entry, pointers) = SLIST_FIRST(list_head);
+		SLIST_FIRST(list_head) = entry;
+		break;
+	case HASH_TABLE_CHAIN_TRANSPOSE:
+		SLIST_NEXT(previous, pointers) = SLIST_NEXT(entry, pointers);
+		SLIST_NEXT(entry, pointers) = previous;
+		if (before_previous == NULL) {
+			SLIST_FIRST(list_head) = entry;
+		}
+		else {
+			SLIST_NEXT(before_previous, pointers) = entry;
+		}
+		break;
+	}
+}
+
+static struct list_entry *get_list_entry(struct hash_table_base *hash_table,
+                                         const char *key,
+                                         uint32_t hash,
+                                         struct hash_table_entry *hash_table_entry)
+{
+	assert(key != NULL);
+
+	struct hash_table_index *index = hash_table_entry->index;
+	if (index != NULL) {
+		for (size_t i = hash_table_index_lower_bound(index, hash);
+		     i < index->size && index->hashes[i] == hash; ++i) {
+			struct list_entry *entry = index->entries[i];
+			if (strcmp(entry->key, key) == 0) {
+				return entry;
+			}
+		}
+		return NULL;
+	}
+
+	struct list_entry *entry = NULL;
+	struct list_entry *previous = NULL;
+	struct list_entry *before_previous = NULL;
+	
+	SLIST_FOREACH(entry, &hash_table_entry->list_head, pointers) {
+	  if (entry->hash == hash && strcmp(entry->key, key) == 0) {
+	    if (previous != NULL) {
+	      reorder_list_entry(hash_table->chain_policy, hash_table_entry, entry, previous, before_previous);
+	    }
+	    return entry;
+	  }
+	  before_previous = previous;
+	  previous = entry;
+	}
+	return NULL;
+}
+
+/* Link a new entry, promoting the bucket to an index once its chain is long */
+static void link_list_entry(struct hash_table_base *hash_table,
+                            struct hash_table_entry *hash_table_entry,
+                            struct list_entry *list_entry)
+{
+	SLIST_INSERT_HEAD(&hash_table_entry->list_head, list_entry, pointers);
+	++hash_table_entry->length;
+	if (hash_table_entry->index != NULL) {
+		hash_table_index_insert(hash_table_entry->index, list_entry->hash, list_entry);
+	}
+	else if (hash_table_entry->length > HASH_TABLE_INDEX_THRESHOLD) {
+		struct hash_table_index *index = hash_table_index_create(&hash_table->allocator,
+		                                                         2 * HASH_TABLE_INDEX_THRESHOLD);
+		struct list_entry *entry = NULL;
+		SLIST_FOREACH(entry, &hash_table_entry->list_head, pointers) {
+			hash_table_index_insert(index, entry->hash, entry);
+		}
+		hash_table_entry->index = index;
+	}
+}
+
+static int get_small_index(struct hash_table_base *hash_table,
+                           const char *key)
+{
+	assert(key != NULL);
+	for (uint32_t i = 0; i < hash_table->small_size; ++i) {
+		if (strcmp(hash_table->small_keys[i], key) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static void insert_list_entry(struct hash_table_base *hash_table,
+                              const char *key,
+                              uint32_t hash,
+                              uint32_t value)
+{
+	struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, hash);
+	struct list_entry *list_entry = hash_table_alloc(&hash_table->allocator, sizeof(struct list_entry));
+	list_entry->key = key;
+	list_entry->hash = hash;
+	list_entry->value = value;
+	link_list_entry(hash_table, hash_table_entry, list_entry);
+}
+
+/* Move the inline entries into a freshly allocated bucket array */
+static void promote(struct hash_table_base *hash_table)
+{
+	hash_table->entries = hash_table_alloc(&hash_table->allocator,
+	                                       HASH_TABLE_CAPACITY * sizeof(struct hash_table_entry));
+	for (size_t i = 0; i < HASH_TABLE_CAPACITY; ++i) {
+		struct hash_table_entry *entry = &hash_table->entries[i];
+		SLIST_INIT(&entry->list_head);
+	}
+	for (uint32_t i = 0; i < hash_table->small_size; ++i) {
+		const char *key = hash_table->small_keys[i];
+		insert_list_entry(hash_table, key, bernstein_hash(key), hash_table->small_values[i]);
+	}
+	hash_table->small_size = 0;
+}
+
+bool hash_table_base_contains(struct hash_table_base *hash_table,
+                              const char *key)
+{
+	if (hash_table->entries == NULL) {
+		return get_small_index(hash_table, key) >= 0;
+	}
+	uint32_t hash = bernstein_hash(key);
+	struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, hash);
+	struct list_entry *list_entry = get_list_entry(hash_table, key, hash, hash_table_entry);
+	return list_entry != NULL;
+}
+
+void hash_table_base_add_entry(struct hash_table_base *hash_table,
+                               const char *key,
+                               uint32_t value)
+{
+	if (hash_table->entries == NULL) {
+		int index = get_small_index(hash_table, key);
+		if (index >= 0) {
+			hash_table->small_values[index] = value;
+			return;
+		}
+		if (hash_table->small_size < HASH_TABLE_SMALL_CAPACITY) {
+			hash_table->small_keys[hash_table->small_size] = key;
+			hash_table->small_values[hash_table->small_size] = value;
+			++hash_table->small_size;
+			++hash_table->size;
+			return;
+		}
+		promote(hash_table);
+		insert_list_entry(hash_table, key, bernstein_hash(key), value);
+		++hash_table->size;
+		return;
+	}
+
+	uint32_t hash = bernstein_hash(key);
+	struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, hash);
+	struct list_entry *list_entry = get_list_entry(hash_table, key, hash, hash_table_entry);
+
+	/* Update the value if it already exists */
+	if (list_entry != NULL) {
+		list_entry->value = value;
+		return;
+	}
+
+	list_entry = hash_table_alloc(&hash_table->allocator, sizeof(struct list_entry));
+	list_entry->key = key;
+	list_entry->hash = hash;
+	list_entry->value = value;
+	link_list_entry(hash_table, hash_table_entry, list_entry);
+	++hash_table->size;
+}
+
+uint32_t hash_table_base_get_value(struct hash_table_base *hash_table,
+                                   const char *key)
+{
+	if (hash_table->entries == NULL) {
+		int index = get_small_index(hash_table, key);
+		assert(index >= 0);
+		return hash_table->small_values[index];
+	}
+	uint32_t hash = bernstein_hash(key);
+	struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, hash);
+	struct list_entry *list_entry = get_list_entry(hash_table, key, hash, hash_table_entry);
+	assert(list_entry != NULL);
+	return list_entry->value;
+}
+
+size_t hash_table_base_size(struct hash_table_base *hash_table)
+{
+	return hash_table->size;
+}
+
+void hash_table_base_set_chain_policy(struct hash_table_base *hash_table,
+                                      enum hash_table_chain_policy chain_policy)
+{
+	hash_table->chain_policy = chain_policy;
+}
+
+size_t hash_table_base_chain_depth(struct hash_table_base *hash_table,
+                                   const char *key)
+{
+	if (hash_table->entries == NULL) {
+		return get_small_index(hash_table, key) + 1;
+	}
+	uint32_t hash = bernstein_hash(key);
+	struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, hash);
+	size_t depth = 0;
+	struct list_entry *entry = NULL;
+	SLIST_FOREACH(entry, &hash_table_entry->list_head, pointers) {
+		++depth;
+		if (entry->hash == hash && strcmp(entry->key, key) == 0) {
+			return depth;
+		}
+	}
+	return 0;
+}
+
+struct hash_table_frozen *hash_table_base_freeze(struct hash_table_base *hash_table)
+{
+	size_t key_bytes = 0;
+	if (hash_table->entries == NULL) {
+		for (uint32_t i = 0; i < hash_table->small_size; ++i) {
+			key_bytes += strlen(hash_table->small_keys[i]) + 1;
+		}
+		struct hash_table_frozen *frozen = hash_table_frozen_create(hash_table->small_size, key_bytes);
+		for (uint32_t i = 0; i < hash_table->small_size; ++i) {
+			const char *key = hash_table->small_keys[i];
+			hash_table_frozen_insert(frozen, key, bernstein_hash(key), hash_table->small_values[i]);
+		}
+		return frozen;
+	}
+
+	struct list_entry *list_entry = NULL;
+	for (size_t i = 0; i < HASH_TABLE_CAPACITY; ++i) {
+		SLIST_FOREACH(list_entry, &hash_table->entries[i].list_head, pointers) {
+			key_bytes += strlen(list_entry->key) + 1;
+		}
+	}
+	struct hash_table_frozen *frozen = hash_table_frozen_create(hash_table->size, key_bytes);
+	for (size_t i = 0; i < HASH_TABLE_CAPACITY; ++i) {
+		SLIST_FOREACH(list_entry, &hash_table->entries[i].list_head, pointers) {
+			hash_table_frozen_insert(frozen, list_entry->key, list_entry->hash, list_entry->value);
+		}
+	}
+	return frozen;
+}
+
+static void destroy_range(void *arg, size_t begin, size_t end)
+{
+	struct hash_table_base *hash_table = arg;
+	if (hash_table->entries == NULL || hash_table->allocator.bulk_free != NULL) {
+		return;
+	}
+	for (size_t i = begin; i < end; ++i) {
+		struct hash_table_entry *entry = &hash_table->entries[i];
+		struct list_head *list_head = &entry->list_head;
+		struct list_entry *list_entry = NULL;
+		while (!SLIST_EMPTY(list_head)) {
+			list_entry = SLIST_FIRST(list_head);
+			SLIST_REMOVE_HEAD(list_head, pointers);
+			hash_table_free(&hash_table->allocator, list_entry, sizeof(struct list_entry));
+		}
+		hash_table_index_destroy(entry->index);
+	}
+}
+
+static void release(void *arg)
+{
+	struct hash_table_base *hash_table = arg;
+	struct ht_allocator allocator = hash_table->allocator;
+	if (allocator.bulk_free != NULL) {
+		allocator.bulk_free(allocator.context);
+		return;
+	}
+	hash_table_free(&allocator, hash_table->entries, HASH_TABLE_CAPACITY * sizeof(struct hash_table_entry));
+	hash_table_free(&allocator, hash_table, sizeof(struct hash_table_base));
+}
+
+void hash_table_base_destroy(struct hash_table_base *hash_table)
+{
+	destroy_range(hash_table, 0, HASH_TABLE_CAPACITY);
+	release(hash_table);
+}
+
+void hash_table_base_destroy_async(struct hash_table_base *hash_table,
+                                   uint32_t threads)
+{
+	hash_table_destroy_async(hash_table, threads, destroy_range, release);
+}
@@ -1,16 +1,28 @@
-#pragma once
-
-#include "hash-table-common.h"
-
-#include <stdbool.h>
-
-struct hash_table_base;
-struct hash_table_base *hash_table_base_create();
-void hash_table_base_add_entry(struct hash_table_base *hash_table,
-                               const char *key,
-                               uint32_t value);
-bool hash_table_base_contains(struct hash_table_base *hash_table,
-                              const char *key);
-uint32_t hash_table_base_get_value(struct hash_table_base *hash_table,
-                                   const char* key);
-void hash_table_base_destroy(struct hash_table_base *hash_table);
+#pragma once
+
+#include "hash-table-common.h"
+#include "hash-table-frozen.h"
+
+#include <stdbool.h>
+
+struct hash_table_base;
+struct hash_table_base *hash_table_base_create();
+struct hash_table_base *hash_table_base_create_with_allocator(const struct ht_allocator *allocator);
+void hash_table_base_add_entry(struct hash_table_base *hash_table,
+                               const char *key,
+                               uint32_t value);
+bool hash_table_base_contains(struct hash_table_base *hash_table,
+                              const char *key);
+uint32_t hash_table_base_get_value(struct hash_table_base *hash_table,
+                                   const char* key);
+size_t hash_table_base_size(struct hash_table_base *hash_table);
+void hash_table_base_destroy(struct hash_table_base *hash_table);
+void hash_table_base_destroy_async(struct hash_table_base *hash_table,
+                                   uint32_t threads);
+/* Copy the current contents into an immutable hash_table_frozen */
+struct hash_table_frozen *hash_table_base_freeze(struct hash_table_base *hash_table);
+/* Set before the table is shared between threads */
+void hash_table_base_set_chain_policy(struct hash_table_base *hash_table,
+                                      enum hash_table_chain_policy chain_policy);
+size_t hash_table_base_chain_depth(struct hash_table_base *hash_table,
+                                   const char *key);
@@ -1,19 +1,235 @@
-#include "hash-table-common.h"
-
-#include <stdbool.h>
-#include <stddef.h>
-
-uint32_t bernstein_hash(const char *string)
-{
-	uint32_t hash = 0;
-	size_t i = 0;
-	while (true) {
-		char c = string[i];
-		if (c == 0) {
-			break;
-		}
-		hash = (33 * hash) + c;
-		++i;
-	}
-	return hash;
-}
+#include "hash-table-common.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+static void *default_alloc(void *context, size_t size)
+{
+	(void) context;
+	return calloc(1, size);
+}
+
+static void default_free(void *context, void *pointer, size_t size)
+{
+	(void) context;
+	(void) size;
+	free(pointer);
+}
+
+const struct ht_allocator hash_table_default_allocator = {
+	.alloc = default_alloc,
+	.free = default_free,
+};
+
+void *hash_table_alloc(const struct ht_allocator *allocator, size_t size)
+{
+	void *pointer = allocator->alloc(allocator->context, size);
+	assert(pointer != NULL);
+	return pointer;
+}
+
+void hash_table_free(const struct ht_allocator *allocator,
+                     void *pointer,
+                     size_t size)
+{
+	if (pointer != NULL) {
+		allocator->free(allocator->context, pointer, size);
+	}
+}
+
+uint32_t bernstein_hash(const char *string)
+{
+	uint32_t hash = 0;
+	size_t i = 0;
+	while (true) {
+		char c = string[i];
+		if (c == 0) {
+			break;
+		}
+		hash = (33 * hash) + c;
+		++i;
+	}
+	return hash;
+}
+
+/* Bernstein's low bits are weak, spread them before using them as a prefix */
+uint32_t hash_table_mix(uint32_t hash)
+{
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6b;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35;
+	hash ^= hash >> 16;
+	return hash;
+}
+
+struct parallel_job {
+	uint32_t count;
+	_Atomic uint32_t next;
+	void (*run)(void *context, uint32_t i);
+	void *context;
+};
+
+static void *run_parallel(void *arg)
+{
+	struct parallel_job *job = arg;
+	while (true) {
+		uint32_t i = atomic_fetch_add(&job->next, 1);
+		if (i >= job->count) {
+			return NULL;
+		}
+		job->run(job->context, i);
+	}
+}
+
+void hash_table_parallel(uint32_t count,
+                         uint32_t threads,
+                         void (*run)(void *context, uint32_t i),
+                         void *context)
+{
+	struct parallel_job job = { .count = count, .run = run, .context = context };
+	if (threads == 0) {
+		threads = 1;
+	}
+	if (threads > count) {
+		threads = count;
+	}
+	pthread_t *workers = calloc(threads, sizeof(pthread_t));
+	assert(workers != NULL);
+	/* This thread is worker 0 */
+	for (uint32_t i = 1; i < threads; ++i) {
+		int error = pthread_create(&workers[i], NULL, run_parallel, &job);
+		if (error != 0) {
+			exit(error);
+		}
+	}
+	run_parallel(&job);
+	for (uint32_t i = 1; i < threads; ++i) {
+		int error = pthread_join(workers[i], NULL);
+		if (error != 0) {
+			exit(error);
+		}
+	}
+	free(workers);
+}
+
+struct destroy_job {
+	void *hash_table;
+	uint32_t threads;
+	hash_table_destroy_range_fn destroy_range;
+	hash_table_release_fn release;
+};
+
+struct destroy_range_job {
+	struct destroy_job *job;
+	size_t begin;
+	size_t end;
+};
+
+static pthread_mutex_t destroy_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t destroy_cond = PTHREAD_COND_INITIALIZER;
+static size_t destroy_pending = 0;
+
+static void *run_destroy_range(void *arg)
+{
+	struct destroy_range_job *range = arg;
+	range->job->destroy_range(range->job->hash_table, range->begin, range->end);
+	return NULL;
+}
+
+static void *run_destroy_job(void *arg)
+{
+	struct destroy_job *job = arg;
+	pthread_t *workers = calloc(job->threads, sizeof(pthread_t));
+	struct destroy_range_job *ranges = calloc(job->threads, sizeof(struct destroy_range_job));
+	assert(workers != NULL && ranges != NULL);
+
+	/* Split the buckets evenly, this thread takes the first range itself */
+	size_t step = HASH_TABLE_CAPACITY / job->threads;
+	for (uint32_t i = 0; i < job->threads; ++i) {
+		ranges[i].job = job;
+		ranges[i].begin = i * step;
+		ranges[i].end = (i == job->threads - 1) ? HASH_TABLE_CAPACITY : (i + 1) * step;
+	}
+	for (uint32_t i = 1; i < job->threads; ++i) {
+		int error = pthread_create(&workers[i], NULL, run_destroy_range, &ranges[i]);
+		if (error != 0) {
+			exit(error);
+		}
+	}
+	run_destroy_range(&ranges[0]);
+	for (uint32_t i = 1; i < job->threads; ++i) {
+		int error = pthread_join(workers[i], NULL);
+		if (error != 0) {
+			exit(error);
+		}
+	}
+	job->release(job->hash_table);
+	free(ranges);
+	free(workers);
+	free(job);
+
+	int error = pthread_mutex_lock(&destroy_mutex);
+	if (error != 0) {
+		exit(error);
+	}
+	--destroy_pending;
+	pthread_cond_broadcast(&destroy_cond);
+	error = pthread_mutex_unlock(&destroy_mutex);
+	if (error != 0) {
+		exit(error);
+	}
+	return NULL;
+}
+
+void hash_table_destroy_async(void *hash_table,
+                              uint32_t threads,
+                              hash_table_destroy_range_fn destroy_range,
+                              hash_table_release_fn release)
+{
+	struct destroy_job *job = calloc(1, sizeof(struct destroy_job));
+	assert(job != NULL);
+	job->hash_table = hash_table;
+	job->threads = (threads == 0) ? 1 : threads;
+	if (job->threads > HASH_TABLE_CAPACITY) {
+		job->threads = HASH_TABLE_CAPACITY;
+	}
+	job->destroy_range = destroy_range;
+	job->release = release;
+
+	int error = pthread_mutex_lock(&destroy_mutex);
+	if (error != 0) {
+		exit(error);
+	}
+	++destroy_pending;
+	error = pthread_mutex_unlock(&destroy_mutex);
+	if (error != 0) {
+		exit(error);
+	}
+
+	pthread_t thread;
+	error = pthread_create(&thread, NULL, run_destroy_job, job);
+	if (error != 0) {
+		exit(error);
+	}
+	pthread_detach(thread);
+}
+
+void hash_table_destroy_wait(void)
+{
+	int error = pthread_mutex_lock(&destroy_mutex);
+	if (error != 0) {
+		exit(error);
+	}
+	while (destroy_pending > 0) {
+		pthread_cond_wait(&destroy_cond, &destroy_mutex);
+	}
+	error = pthread_mutex_unlock(&destroy_mutex);
+	if (error != 0) {
+		exit(error);
+	}
+}
@@ -1,7 +1,60 @@
-#pragma once
-
-#include <stdint.h>
-
-#define HASH_TABLE_CAPACITY 4096
-
-uint32_t bernstein_hash(const char *string);
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HASH_TABLE_CAPACITY 4096
+#define HASH_TABLE_SMALL_CAPACITY 12
+
+/* How a chain reorders itself when a lookup hits */
+enum hash_table_chain_policy {
+	HASH_TABLE_CHAIN_FIXED,
+	HASH_TABLE_CHAIN_MOVE_TO_FRONT,
+	HASH_TABLE_CHAIN_TRANSPOSE,
+};
+
+/*
+ * Where a table gets its memory from. alloc returns zeroed memory aligned for
+ * any type, or NULL, and free is handed back the size that was asked for. If
+ * bulk_free is set, destroy never frees piece by piece: it makes one
+ * bulk_free call for everything the table allocated.
+ */
+struct ht_allocator {
+	void *(*alloc)(void *context, size_t size);
+	void (*free)(void *context, void *pointer, size_t size);
+	void (*bulk_free)(void *context);
+	void *context;
+};
+
+/* calloc and free */
+extern const struct ht_allocator hash_table_default_allocator;
+
+void *hash_table_alloc(const struct ht_allocator *allocator, size_t size);
+void hash_table_free(const struct ht_allocator *allocator,
+                     void *pointer,
+                     size_t size);
+
+uint32_t bernstein_hash(const char *string);
+uint32_t hash_table_mix(uint32_t hash);
+
+/* Calls run(context, i) for every i in [0, count), spread over threads */
+void hash_table_parallel(uint32_t count,
+                         uint32_t threads,
+                         void (*run)(void *context, uint32_t i),
+                         void *context);
+
+/*
+ * Background teardown shared by every table version. destroy_range frees the
+ * chains of buckets [begin, end) and release frees whatever is left (locks,
+ * the table itself) once every range is done.
+ */
+typedef void (*hash_table_destroy_range_fn)(void *hash_table,
+                                            size_t begin,
+                                            size_t end);
+typedef void (*hash_table_release_fn)(void *hash_table);
+
+void hash_table_destroy_async(void *hash_table,
+                              uint32_t threads,
+                              hash_table_destroy_range_fn destroy_range,
+                              hash_table_release_fn release);
+void hash_table_destroy_wait(void);
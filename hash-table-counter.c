@@ -0,0 +1,40 @@
+#include "hash-table-counter.h"
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+static _Atomic uint32_t next_shard;
+static _Thread_local int thread_shard = -1;
+
+struct hash_table_counter *hash_table_counter_create()
+{
+	struct hash_table_counter *counter = aligned_alloc(64, sizeof(struct hash_table_counter));
+	assert(counter != NULL);
+	memset(counter, 0, sizeof(struct hash_table_counter));
+	return counter;
+}
+
+int64_t hash_table_counter_add(struct hash_table_counter *counter, int64_t delta)
+{
+	if (thread_shard < 0) {
+		thread_shard = atomic_fetch_add(&next_shard, 1) % HASH_TABLE_COUNTER_SHARDS;
+	}
+	return atomic_fetch_add_explicit(&counter->shards[thread_shard].count, delta, memory_order_relaxed) + delta;
+}
+
+size_t hash_table_counter_read(struct hash_table_counter *counter)
+{
+	int64_t count = 0;
+	for (size_t i = 0; i < HASH_TABLE_COUNTER_SHARDS; ++i) {
+		count += atomic_load_explicit(&counter->shards[i].count, memory_order_relaxed);
+	}
+	/* Shards can be briefly out of step while writers are running */
+	return (count > 0) ? count : 0;
+}
+
+void hash_table_counter_destroy(struct hash_table_counter *counter)
+{
+	free(counter);
+}
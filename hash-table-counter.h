@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HASH_TABLE_COUNTER_SHARDS 64
+
+/*
+ * Entry count split into cache-line-padded shards. Each thread adds to its
+ * own shard, so inserts never share a counter line; reads sum every shard
+ * and are exact once writers are quiescent. Every *_size backed by one is
+ * therefore exact when no writer is running and approximate otherwise.
+ */
+struct hash_table_counter_shard {
+	_Atomic int64_t count;
+} __attribute__((aligned(64)));
+
+struct hash_table_counter {
+	struct hash_table_counter_shard shards[HASH_TABLE_COUNTER_SHARDS];
+};
+
+struct hash_table_counter *hash_table_counter_create();
+/* Returns the caller's shard after the add, a running count of its own */
+int64_t hash_table_counter_add(struct hash_table_counter *counter, int64_t delta);
+size_t hash_table_counter_read(struct hash_table_counter *counter);
+void hash_table_counter_destroy(struct hash_table_counter *counter);
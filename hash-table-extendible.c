@@ -0,0 +1,355 @@
+#include "hash-table-extendible.h"
+#include "hash-table-counter.h"
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+
+#include <pthread.h>
+
+/* Buckets per subtable, and the size at which a subtable splits */
+#define SUBTABLE_CAPACITY 64
+#define SUBTABLE_MAX_SIZE (4 * SUBTABLE_CAPACITY)
+#define MAX_DEPTH 24
+#define SUBTABLE_BITS 6
+
+/* Prefixes use the low MAX_DEPTH bits, buckets the top SUBTABLE_BITS */
+_Static_assert(SUBTABLE_CAPACITY == 1 << SUBTABLE_BITS, "SUBTABLE_BITS must match SUBTABLE_CAPACITY");
+_Static_assert(MAX_DEPTH + SUBTABLE_BITS <= 32, "bucket bits must never be prefix bits");
+
+struct list_entry {
+	const char *key;
+	uint32_t hash;
+	uint32_t value;
+	SLIST_ENTRY(list_entry) pointers;
+};
+
+SLIST_HEAD(list_head, list_entry);
+
+/*
+ * A subtable owns every hash whose low local_depth bits equal prefix. Both
+ * only change under its mutex, when the subtable splits.
+ */
+struct subtable {
+	pthread_mutex_t mutex;
+	uint32_t local_depth;
+	uint32_t prefix;
+	uint32_t size;
+	struct list_head buckets[SUBTABLE_CAPACITY];
+	SLIST_ENTRY(subtable) pointers;
+};
+
+SLIST_HEAD(subtable_head, subtable);
+
+/*
+ * Directories are never modified once replaced by a larger one, so readers
+ * can use whichever one they loaded without a lock. Old directories are kept
+ * until the table is destroyed.
+ */
+struct directory {
+	uint32_t global_depth;
+	struct directory *previous;
+	struct subtable *_Atomic slots[];
+};
+
+struct hash_table_extendible {
+	struct directory *_Atomic directory;
+	pthread_mutex_t directory_mutex;
+	struct subtable_head subtables;
+	struct hash_table_counter *counter;
+};
+
+static uint32_t depth_mask(uint32_t depth)
+{
+	return (depth == 0) ? 0 : (UINT32_MAX >> (32 - depth));
+}
+
+static struct subtable *create_subtable(uint32_t local_depth,
+                                        uint32_t prefix)
+{
+	struct subtable *subtable = calloc(1, sizeof(struct subtable));
+	assert(subtable != NULL);
+	int error = pthread_mutex_init(&subtable->mutex, NULL);
+	if (error != 0) {
+		exit(error);
+	}
+	subtable->local_depth = local_depth;
+	subtable->prefix = prefix;
+	for (size_t i = 0; i < SUBTABLE_CAPACITY; ++i) {
+		SLIST_INIT(&subtable->buckets[i]);
+	}
+	return subtable;
+}
+
+static struct directory *create_directory(uint32_t global_depth)
+{
+	size_t slots = (size_t) 1 << global_depth;
+	struct directory *directory = calloc(1, sizeof(struct directory) + slots * sizeof(struct subtable *));
+	assert(directory != NULL);
+	directory->global_depth = global_depth;
+	return directory;
+}
+
+struct hash_table_extendible *hash_table_extendible_create()
+{
+	struct hash_table_extendible *hash_table = calloc(1, sizeof(struct hash_table_extendible));
+	assert(hash_table != NULL);
+	int error = pthread_mutex_init(&hash_table->directory_mutex, NULL);
+	if (error != 0) {
+		exit(error);
+	}
+	SLIST_INIT(&hash_table->subtables);
+	hash_table->counter = hash_table_counter_create();
+	struct directory *directory = create_directory(0);
+	struct subtable *subtable = create_subtable(0, 0);
+	SLIST_INSERT_HEAD(&hash_table->subtables, subtable, pointers);
+	directory->slots[0] = subtable;
+	atomic_store(&hash_table->directory, directory);
+	return hash_table;
+}
+
+static struct list_head *get_bucket(struct subtable *subtable, uint32_t hash)
+{
+	/*
+	 * The low bits pick the subtable, so take the bucket from the top bits,
+	 * which no prefix reaches however deep the subtable gets.
+	 */
+	return &subtable->buckets[hash >> (32 - SUBTABLE_BITS)];
+}
+
+/*
+ * Returns the subtable that owns hash, with its mutex held. A concurrent
+ * split can move hash to a new sibling between reading the directory and
+ * taking the lock, in which case the directory is read again.
+ */
+static struct subtable *lock_subtable(struct hash_table_extendible *hash_table,
+                                      uint32_t hash)
+{
+	while (true) {
+		struct directory *directory = atomic_load_explicit(&hash_table->directory, memory_order_acquire);
+		uint32_t slot = hash & depth_mask(directory->global_depth);
+		struct subtable *subtable = atomic_load_explicit(&directory->slots[slot], memory_order_acquire);
+		int error = pthread_mutex_lock(&subtable->mutex);
+		if (error != 0) {
+			exit(error);
+		}
+		if ((hash & depth_mask(subtable->local_depth)) == subtable->prefix) {
+			return subtable;
+		}
+		error = pthread_mutex_unlock(&subtable->mutex);
+		if (error != 0) {
+			exit(error);
+		}
+	}
+}
+
+static void unlock_subtable(struct subtable *subtable)
+{
+	int error = pthread_mutex_unlock(&subtable->mutex);
+	if (error != 0) {
+		exit(error);
+	}
+}
+
+static struct list_entry *get_list_entry(struct subtable *subtable,
+                                         const char *key,
+                                         uint32_t hash)
+{
+	assert(key != NULL);
+
+	struct list_entry *entry = NULL;
+	SLIST_FOREACH(entry, get_bucket(subtable, hash), pointers) {
+		if (entry->hash == hash && strcmp(entry->key, key) == 0) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Called with the subtable's mutex held. Moves the entries whose next hash
+ * bit is set into a new sibling, then points the matching directory slots at
+ * it, doubling the directory first if the subtable was already at the
+ * global depth. Only the split subtable's entries are touched, and the
+ * directory mutex is only held to publish the sibling.
+ */
+static void split_subtable(struct hash_table_extendible *hash_table,
+                           struct subtable *subtable)
+{
+	uint32_t local_depth = subtable->local_depth;
+	uint32_t bit = (uint32_t) 1 << local_depth;
+
+	struct subtable *sibling = create_subtable(local_depth + 1, subtable->prefix | bit);
+	for (size_t i = 0; i < SUBTABLE_CAPACITY; ++i) {
+		struct list_head *bucket = &subtable->buckets[i];
+		struct list_entry *entry = SLIST_FIRST(bucket);
+		SLIST_INIT(bucket);
+		while (entry != NULL) {
+			struct list_entry *next = SLIST_NEXT(entry, pointers);
+			if (entry->hash & bit) {
+				SLIST_INSERT_HEAD(&sibling->buckets[i], entry, pointers);
+				--subtable->size;
+				++sibling->size;
+			}
+			else {
+				SLIST_INSERT_HEAD(bucket, entry, pointers);
+			}
+			entry = next;
+		}
+	}
+	subtable->local_depth = local_depth + 1;
+
+	int error = pthread_mutex_lock(&hash_table->directory_mutex);
+	if (error != 0) {
+		exit(error);
+	}
+	SLIST_INSERT_HEAD(&hash_table->subtables, sibling, pointers);
+
+	struct directory *directory = atomic_load_explicit(&hash_table->directory, memory_order_relaxed);
+	if (local_depth == directory->global_depth) {
+		struct directory *larger = create_directory(directory->global_depth + 1);
+		size_t slots = (size_t) 1 << directory->global_depth;
+		for (size_t i = 0; i < slots; ++i) {
+			struct subtable *slot = atomic_load_explicit(&directory->slots[i], memory_order_relaxed);
+			atomic_init(&larger->slots[i], slot);
+			atomic_init(&larger->slots[i + slots], slot);
+		}
+		larger->previous = directory;
+		directory = larger;
+	}
+	size_t slots = (size_t) 1 << directory->global_depth;
+	for (size_t i = sibling->prefix; i < slots; i += (size_t) bit << 1) {
+		atomic_store_explicit(&directory->slots[i], sibling, memory_order_release);
+	}
+	atomic_store_explicit(&hash_table->directory, directory, memory_order_release);
+
+	error = pthread_mutex_unlock(&hash_table->directory_mutex);
+	if (error != 0) {
+		exit(error);
+	}
+}
+
+bool hash_table_extendible_contains(struct hash_table_extendible *hash_table,
+                                    const char *key)
+{
+	uint32_t hash = hash_table_mix(bernstein_hash(key));
+	struct subtable *subtable = lock_subtable(hash_table, hash);
+	struct list_entry *list_entry = get_list_entry(subtable, key, hash);
+	unlock_subtable(subtable);
+	return list_entry != NULL;
+}
+
+void hash_table_extendible_add_entry(struct hash_table_extendible *hash_table,
+                                     const char *key,
+                                     uint32_t value)
+{
+	uint32_t hash = hash_table_mix(bernstein_hash(key));
+	struct subtable *subtable = lock_subtable(hash_table, hash);
+	struct list_entry *list_entry = get_list_entry(subtable, key, hash);
+
+	/* Update the value if it already exists */
+	if (list_entry != NULL) {
+		list_entry->value = value;
+		unlock_subtable(subtable);
+		return;
+	}
+
+	list_entry = calloc(1, sizeof(struct list_entry));
+	list_entry->key = key;
+	list_entry->hash = hash;
+	list_entry->value = value;
+	SLIST_INSERT_HEAD(get_bucket(subtable, hash), list_entry, pointers);
+	++subtable->size;
+
+	if (subtable->size > SUBTABLE_MAX_SIZE && subtable->local_depth < MAX_DEPTH) {
+		split_subtable(hash_table, subtable);
+	}
+	unlock_subtable(subtable);
+	hash_table_counter_add(hash_table->counter, 1);
+}
+
+uint32_t hash_table_extendible_get_value(struct hash_table_extendible *hash_table,
+                                         const char *key)
+{
+	uint32_t hash = hash_table_mix(bernstein_hash(key));
+	struct subtable *subtable = lock_subtable(hash_table, hash);
+	struct list_entry *list_entry = get_list_entry(subtable, key, hash);
+	assert(list_entry != NULL);
+	uint32_t value = list_entry->value;
+	unlock_subtable(subtable);
+	return value;
+}
+
+size_t hash_table_extendible_size(struct hash_table_extendible *hash_table)
+{
+	return hash_table_counter_read(hash_table->counter);
+}
+
+/*
+ * Walks the subtable list without locks: a split links its sibling in
+ * while holding only the directory mutex, so a writer could change the
+ * list under us.
+ */
+struct hash_table_frozen *hash_table_extendible_freeze(struct hash_table_extendible *hash_table)
+{
+	size_t size = 0;
+	size_t key_bytes = 0;
+	struct subtable *subtable = NULL;
+	struct list_entry *list_entry = NULL;
+	SLIST_FOREACH(subtable, &hash_table->subtables, pointers) {
+		size += subtable->size;
+		for (size_t i = 0; i < SUBTABLE_CAPACITY; ++i) {
+			SLIST_FOREACH(list_entry, &subtable->buckets[i], pointers) {
+				key_bytes += strlen(list_entry->key) + 1;
+			}
+		}
+	}
+	struct hash_table_frozen *frozen = hash_table_frozen_create(size, key_bytes);
+	SLIST_FOREACH(subtable, &hash_table->subtables, pointers) {
+		for (size_t i = 0; i < SUBTABLE_CAPACITY; ++i) {
+			SLIST_FOREACH(list_entry, &subtable->buckets[i], pointers) {
+				/* The stored hash is mixed, the frozen table wants the raw one */
+				hash_table_frozen_insert(frozen, list_entry->key, bernstein_hash(list_entry->key), list_entry->value);
+			}
+		}
+	}
+	return frozen;
+}
+
+void hash_table_extendible_destroy(struct hash_table_extendible *hash_table)
+{
+	while (!SLIST_EMPTY(&hash_table->subtables)) {
+		struct subtable *subtable = SLIST_FIRST(&hash_table->subtables);
+		SLIST_REMOVE_HEAD(&hash_table->subtables, pointers);
+		for (size_t i = 0; i < SUBTABLE_CAPACITY; ++i) {
+			struct list_head *list_head = &subtable->buckets[i];
+			struct list_entry *list_entry = NULL;
+			while (!SLIST_EMPTY(list_head)) {
+				list_entry = SLIST_FIRST(list_head);
+				SLIST_REMOVE_HEAD(list_head, pointers);
+				free(list_entry);
+			}
+		}
+		int error = pthread_mutex_destroy(&subtable->mutex);
+		if (error != 0) {
+			exit(error);
+		}
+		free(subtable);
+	}
+
+	struct directory *directory = atomic_load(&hash_table->directory);
+	while (directory != NULL) {
+		struct directory *previous = directory->previous;
+		free(directory);
+		directory = previous;
+	}
+
+	hash_table_counter_destroy(hash_table->counter);
+	int error = pthread_mutex_destroy(&hash_table->directory_mutex);
+	if (error != 0) {
+		exit(error);
+	}
+	free(hash_table);
+}
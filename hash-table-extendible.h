@@ -0,0 +1,20 @@
+#pragma once
+
+#include "hash-table-common.h"
+#include "hash-table-frozen.h"
+
+#include <stdbool.h>
+
+struct hash_table_extendible;
+struct hash_table_extendible *hash_table_extendible_create();
+void hash_table_extendible_add_entry(struct hash_table_extendible *hash_table,
+                                     const char *key,
+                                     uint32_t value);
+bool hash_table_extendible_contains(struct hash_table_extendible *hash_table,
+                                    const char *key);
+uint32_t hash_table_extendible_get_value(struct hash_table_extendible *hash_table,
+                                         const char* key);
+size_t hash_table_extendible_size(struct hash_table_extendible *hash_table);
+/* Copy the contents into an immutable hash_table_frozen, with no writer running */
+struct hash_table_frozen *hash_table_extendible_freeze(struct hash_table_extendible *hash_table);
+void hash_table_extendible_destroy(struct hash_table_extendible *hash_table);
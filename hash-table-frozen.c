@@ -0,0 +1,204 @@
+#include "hash-table-frozen.h"
+#include "hash-table-common.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FROZEN_MAGIC 0x31305a4f52465448ULL /* "HTFROZ01" */
+
+/* key_offset 0 marks an empty slot, the arena's first byte is never used */
+struct hash_table_frozen_slot {
+	uint32_t hash;
+	uint32_t value;
+	uint64_t key_offset;
+};
+
+/*
+ * The whole table is this one block, and it holds no pointers, so
+ * hash_table_frozen_save writes it out as is and hash_table_frozen_open
+ * maps it back without touching a byte.
+ */
+struct hash_table_frozen {
+	uint64_t magic;
+	uint64_t size;
+	uint64_t mask;
+	uint64_t key_end;
+	uint64_t key_bytes;
+	struct hash_table_frozen_slot slots[];
+};
+
+static char *get_keys(const struct hash_table_frozen *hash_table)
+{
+	return (char *) &hash_table->slots[hash_table->mask + 1];
+}
+
+static size_t get_length(const struct hash_table_frozen *hash_table)
+{
+	return sizeof(struct hash_table_frozen)
+	       + (hash_table->mask + 1) * sizeof(struct hash_table_frozen_slot)
+	       + hash_table->key_bytes;
+}
+
+struct hash_table_frozen *hash_table_frozen_create(size_t size,
+                                                   size_t key_bytes)
+{
+	/* At most half full keeps the expected probe within the first slot's line */
+	size_t capacity = 16;
+	while (capacity < 2 * size) {
+		capacity *= 2;
+	}
+	++key_bytes;
+	struct hash_table_frozen *hash_table = malloc(sizeof(struct hash_table_frozen)
+	                                              + capacity * sizeof(struct hash_table_frozen_slot)
+	                                              + key_bytes);
+	assert(hash_table != NULL);
+	hash_table->magic = FROZEN_MAGIC;
+	hash_table->size = 0;
+	hash_table->mask = capacity - 1;
+	hash_table->key_end = 1;
+	hash_table->key_bytes = key_bytes;
+	memset(hash_table->slots, 0, capacity * sizeof(struct hash_table_frozen_slot));
+	return hash_table;
+}
+
+void hash_table_frozen_insert(struct hash_table_frozen *hash_table,
+                              const char *key,
+                              uint32_t hash,
+                              uint32_t value)
+{
+	size_t length = strlen(key);
+	assert(hash_table->key_end + length + 1 <= hash_table->key_bytes);
+	char *keys = get_keys(hash_table);
+	memcpy(&keys[hash_table->key_end], key, length + 1);
+
+	uint64_t i = hash_table_mix(hash) & hash_table->mask;
+	while (hash_table->slots[i].key_offset != 0) {
+		i = (i + 1) & hash_table->mask;
+	}
+	struct hash_table_frozen_slot *slot = &hash_table->slots[i];
+	slot->hash = hash;
+	slot->value = value;
+	slot->key_offset = hash_table->key_end;
+	hash_table->key_end += length + 1;
+	++hash_table->size;
+}
+
+static const struct hash_table_frozen_slot *get_slot(const struct hash_table_frozen *hash_table,
+                                                     const char *key)
+{
+	assert(key != NULL);
+	uint32_t hash = bernstein_hash(key);
+	const char *keys = get_keys(hash_table);
+	for (uint64_t i = hash_table_mix(hash) & hash_table->mask;; i = (i + 1) & hash_table->mask) {
+		const struct hash_table_frozen_slot *slot = &hash_table->slots[i];
+		if (slot->key_offset == 0) {
+			return NULL;
+		}
+		if (slot->hash == hash && strcmp(&keys[slot->key_offset], key) == 0) {
+			return slot;
+		}
+	}
+}
+
+bool hash_table_frozen_contains(const struct hash_table_frozen *hash_table,
+                                const char *key)
+{
+	return get_slot(hash_table, key) != NULL;
+}
+
+uint32_t hash_table_frozen_get_value(const struct hash_table_frozen *hash_table,
+                                     const char *key)
+{
+	const struct hash_table_frozen_slot *slot = get_slot(hash_table, key);
+	assert(slot != NULL);
+	return slot->value;
+}
+
+size_t hash_table_frozen_size(const struct hash_table_frozen *hash_table)
+{
+	return hash_table->size;
+}
+
+void hash_table_frozen_destroy(struct hash_table_frozen *hash_table)
+{
+	free(hash_table);
+}
+
+int hash_table_frozen_save(const struct hash_table_frozen *hash_table,
+                           const char *path)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		return errno;
+	}
+	const char *bytes = (const char *) hash_table;
+	size_t length = get_length(hash_table);
+	int error = 0;
+	while (length > 0) {
+		ssize_t written = write(fd, bytes, length);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			error = errno;
+			break;
+		}
+		bytes += written;
+		length -= written;
+	}
+	if (close(fd) != 0 && error == 0) {
+		error = errno;
+	}
+	return error;
+}
+
+const struct hash_table_frozen *hash_table_frozen_open(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+	struct stat status;
+	if (fstat(fd, &status) != 0) {
+		int error = errno;
+		close(fd);
+		errno = error;
+		return NULL;
+	}
+	if ((size_t) status.st_size < sizeof(struct hash_table_frozen)) {
+		close(fd);
+		errno = EBADMSG;
+		return NULL;
+	}
+	void *mapping = mmap(NULL, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	int error = errno;
+	close(fd);
+	if (mapping == MAP_FAILED) {
+		errno = error;
+		return NULL;
+	}
+	/* Lookups jump around, readahead would only pull in pages nobody asked for */
+	madvise(mapping, status.st_size, MADV_RANDOM);
+
+	const struct hash_table_frozen *hash_table = mapping;
+	if (hash_table->magic != FROZEN_MAGIC
+	    || (hash_table->mask & (hash_table->mask + 1)) != 0
+	    || hash_table->mask >= status.st_size / sizeof(struct hash_table_frozen_slot)
+	    || get_length(hash_table) != (size_t) status.st_size) {
+		munmap(mapping, status.st_size);
+		errno = EBADMSG;
+		return NULL;
+	}
+	return hash_table;
+}
+
+void hash_table_frozen_close(const struct hash_table_frozen *hash_table)
+{
+	munmap((void *) hash_table, get_length(hash_table));
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Immutable, read-optimized copy of a table made by *_freeze. One
+ * allocation holds a flat open-addressed slot array followed by an arena
+ * of the keys; slots refer to keys by offset, so there are no pointers to
+ * chase and lookups take no locks or atomics. A lookup touches the slot
+ * line and then the key, two cache misses when the probe stays in one line.
+ *
+ * Having no pointers also makes the block its own file format:
+ * hash_table_frozen_save writes it out and hash_table_frozen_open maps it
+ * back read-only, so opening costs one mmap whatever the size, pages are
+ * faulted in as lookups reach them, and processes mapping the same file
+ * share them through the page cache. Files are in native byte order and
+ * trusted: open checks the header, not every offset.
+ */
+struct hash_table_frozen;
+
+/* Builder used by *_freeze: room for size keys totalling key_bytes with NULs */
+struct hash_table_frozen *hash_table_frozen_create(size_t size,
+                                                   size_t key_bytes);
+/* Keys must be unique, the builder does not check */
+void hash_table_frozen_insert(struct hash_table_frozen *hash_table,
+                              const char *key,
+                              uint32_t hash,
+                              uint32_t value);
+
+bool hash_table_frozen_contains(const struct hash_table_frozen *hash_table,
+                                const char *key);
+uint32_t hash_table_frozen_get_value(const struct hash_table_frozen *hash_table,
+                                     const char *key);
+size_t hash_table_frozen_size(const struct hash_table_frozen *hash_table);
+void hash_table_frozen_destroy(struct hash_table_frozen *hash_table);
+
+/* Returns 0 or an errno value */
+int hash_table_frozen_save(const struct hash_table_frozen *hash_table,
+                           const char *path);
+/* Returns NULL with errno set, EBADMSG if path is not a frozen table */
+const struct hash_table_frozen *hash_table_frozen_open(const char *path);
+/* Unmaps a table from hash_table_frozen_open, use destroy for the rest */
+void hash_table_frozen_close(const struct hash_table_frozen *hash_table);
@@ -0,0 +1,696 @@
+#include "hash-table-hlog.h"
+#include "hash-table-base.h"
+#include "hash-table-counter.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define PAGE_BITS 16
+#define PAGE_BYTES ((uint64_t) 1 << PAGE_BITS)
+#define MIN_FRAMES 4
+/* The share of the in-memory pages that take updates in place */
+#define MUTABLE_PERCENT 90
+#define INDEX_BUCKETS (1 << 16)
+#define BUCKET_ENTRIES 7
+#define CACHE_LINE_SIZE 64
+
+/* An index entry is a tentative bit, a 15 bit tag and a 48 bit address */
+#define ADDRESS_MASK (((uint64_t) 1 << 48) - 1)
+#define TAG_SHIFT 48
+#define TAG_COUNT 0x7fff
+#define TENTATIVE ((uint64_t) 1 << 63)
+
+/* A log record: this header, then the key and its NUL, padded to 8 */
+struct hlog_record {
+	uint64_t previous;
+	_Atomic uint32_t value;
+	uint32_t key_length;
+	char key[];
+};
+
+/*
+ * An entry is 0 while free. A thread claiming one for a new tag marks it
+ * tentative first and backs off if the tag shows up anywhere else in the
+ * bucket, so a tag never has two entries; lookups skip tentative ones.
+ */
+struct index_bucket {
+	_Atomic uint64_t entries[BUCKET_ENTRIES];
+	struct index_bucket *_Atomic overflow;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/* The epoch a thread started its operation at plus one, zero meaning free */
+struct epoch_slot {
+	_Atomic uint64_t epoch;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/*
+ * Records at or past read_only are mutable. safe_read_only trails it until
+ * no thread that saw the old read_only is still running; an update that
+ * falls between the two waits instead of copying, as another thread may
+ * still be adding to the record in place. Records before head are only in
+ * the file. log_mutex guards tail, flushed and the pending read_only move.
+ */
+struct hash_table_hlog {
+	int fd;
+	char *frames;
+	uint64_t frame_count;
+	uint64_t mutable_pages;
+	pthread_mutex_t log_mutex;
+	uint64_t tail;
+	uint64_t flushed;
+	uint64_t pending_read_only;
+	uint64_t pending_epoch;
+	_Atomic uint64_t read_only;
+	_Atomic uint64_t safe_read_only;
+	_Atomic uint64_t head;
+	_Atomic uint64_t epoch;
+	struct epoch_slot slots[HASH_TABLE_HLOG_MAX_THREADS];
+	struct hash_table_counter *counter;
+	struct hash_table_counter *in_place;
+	struct hash_table_counter *copied;
+	struct hash_table_counter *retries;
+	struct hash_table_counter *disk_reads;
+	struct index_bucket buckets[INDEX_BUCKETS];
+};
+
+static void lock(pthread_mutex_t *mutex)
+{
+	int error = pthread_mutex_lock(mutex);
+	if (error != 0) {
+		exit(error);
+	}
+}
+
+static void unlock(pthread_mutex_t *mutex)
+{
+	int error = pthread_mutex_unlock(mutex);
+	if (error != 0) {
+		exit(error);
+	}
+}
+
+static uint32_t record_bytes(size_t key_length)
+{
+	size_t bytes = sizeof(struct hlog_record) + key_length + 1;
+	assert(bytes <= PAGE_BYTES);
+	return (bytes + 7) & ~(size_t) 7;
+}
+
+/* The frame a page lives in is its number modulo the frame count */
+static struct hlog_record *get_record(struct hash_table_hlog *hash_table,
+                                      uint64_t address)
+{
+	uint64_t frame = (address >> PAGE_BITS) % hash_table->frame_count;
+	return (struct hlog_record *) (hash_table->frames + frame * PAGE_BYTES
+	                               + (address & (PAGE_BYTES - 1)));
+}
+
+/* Announces the current epoch in a free slot and returns the slot */
+static uint32_t protect(struct hash_table_hlog *hash_table)
+{
+	static _Atomic uint32_t next_thread;
+	static _Thread_local int thread_slot = -1;
+
+	if (thread_slot < 0) {
+		thread_slot = atomic_fetch_add(&next_thread, 1) % HASH_TABLE_HLOG_MAX_THREADS;
+	}
+	for (uint32_t i = thread_slot, tried = 1; ; i = (i + 1) % HASH_TABLE_HLOG_MAX_THREADS, ++tried) {
+		uint64_t expected = 0;
+		uint64_t epoch = atomic_load(&hash_table->epoch);
+		if (atomic_compare_exchange_strong(&hash_table->slots[i].epoch, &expected, epoch + 1)) {
+			return i;
+		}
+		/* Every slot is taken, wait for an operation to finish */
+		if (tried % HASH_TABLE_HLOG_MAX_THREADS == 0) {
+			sched_yield();
+		}
+	}
+}
+
+static void unprotect(struct hash_table_hlog *hash_table, uint32_t slot)
+{
+	atomic_store(&hash_table->slots[slot].epoch, 0);
+}
+
+static uint64_t oldest_epoch(struct hash_table_hlog *hash_table)
+{
+	uint64_t oldest = UINT64_MAX;
+	for (size_t i = 0; i < HASH_TABLE_HLOG_MAX_THREADS; ++i) {
+		uint64_t epoch = atomic_load(&hash_table->slots[i].epoch);
+		if (epoch != 0 && epoch - 1 < oldest) {
+			oldest = epoch - 1;
+		}
+	}
+	return oldest;
+}
+
+/*
+ * Waits until every operation that started at or before epoch is done.
+ * The caller holds no slot, and no thread waits for log_mutex holding one.
+ */
+static void wait_epoch(struct hash_table_hlog *hash_table, uint64_t epoch)
+{
+	while (oldest_epoch(hash_table) <= epoch) {
+		sched_yield();
+	}
+}
+
+/* Called with log_mutex held: publishes the last read_only move once safe */
+static void drain(struct hash_table_hlog *hash_table)
+{
+	if (hash_table->pending_read_only > atomic_load(&hash_table->safe_read_only)
+	    && oldest_epoch(hash_table) > hash_table->pending_epoch) {
+		atomic_store(&hash_table->safe_read_only, hash_table->pending_read_only);
+	}
+}
+
+/* Called with log_mutex held: writes the pages before until to the file */
+static void flush(struct hash_table_hlog *hash_table, uint64_t until)
+{
+	for (; hash_table->flushed < until; hash_table->flushed += PAGE_BYTES) {
+		const char *frame = (const char *) get_record(hash_table, hash_table->flushed);
+		for (uint64_t written = 0; written < PAGE_BYTES; ) {
+			ssize_t result = pwrite(hash_table->fd, frame + written, PAGE_BYTES - written,
+			                        hash_table->flushed + written);
+			if (result < 0) {
+				exit(errno);
+			}
+			written += result;
+		}
+	}
+}
+
+/*
+ * Called with log_mutex held before the tail moves onto page. The oldest
+ * mutable page turns read-only, and the page whose frame this one takes
+ * over is flushed and evicted once no thread can still update or read it.
+ */
+static void open_page(struct hash_table_hlog *hash_table, uint64_t page)
+{
+	if (page >= hash_table->mutable_pages) {
+		uint64_t read_only = (page + 1 - hash_table->mutable_pages) << PAGE_BITS;
+		atomic_store(&hash_table->read_only, read_only);
+		hash_table->pending_read_only = read_only;
+		hash_table->pending_epoch = atomic_fetch_add(&hash_table->epoch, 1);
+	}
+	if (page >= hash_table->frame_count) {
+		uint64_t head = (page + 1 - hash_table->frame_count) << PAGE_BITS;
+		while (atomic_load(&hash_table->safe_read_only) < head) {
+			drain(hash_table);
+			sched_yield();
+		}
+		flush(hash_table, head);
+		atomic_store(&hash_table->head, head);
+		wait_epoch(hash_table, atomic_fetch_add(&hash_table->epoch, 1));
+	}
+}
+
+/*
+ * Reserves bytes at the tail. The caller's slot is given up while it
+ * waits for log_mutex, since opening a page may wait on every slot, and a
+ * new one is taken before the mutex is dropped, so the space cannot be
+ * flushed before the caller has filled it in.
+ */
+static uint64_t append(struct hash_table_hlog *hash_table,
+                       uint32_t bytes,
+                       uint32_t *slot)
+{
+	unprotect(hash_table, *slot);
+	lock(&hash_table->log_mutex);
+	if ((hash_table->tail & (PAGE_BYTES - 1)) + bytes > PAGE_BYTES) {
+		uint64_t page = (hash_table->tail >> PAGE_BITS) + 1;
+		open_page(hash_table, page);
+		hash_table->tail = page << PAGE_BITS;
+	}
+	uint64_t address = hash_table->tail;
+	hash_table->tail += bytes;
+	*slot = protect(hash_table);
+	unlock(&hash_table->log_mutex);
+	return address;
+}
+
+/*
+ * Reads a flushed record far enough to compare it with key. Returns
+ * whether it matches, setting *previous either way and *value on a match.
+ */
+static bool read_flushed(struct hash_table_hlog *hash_table,
+                         uint64_t address,
+                         const char *key,
+                         uint32_t key_length,
+                         uint64_t *previous,
+                         uint32_t *value)
+{
+	char buffer[256];
+	size_t bytes = sizeof(struct hlog_record) + key_length;
+	char *data = bytes <= sizeof(buffer) ? buffer : malloc(bytes);
+	assert(data != NULL);
+	size_t done = 0;
+	while (done < bytes) {
+		/* A shorter record can end the file before bytes */
+		ssize_t result = pread(hash_table->fd, data + done, bytes - done, address + done);
+		if (result < 0) {
+			exit(errno);
+		}
+		if (result == 0) {
+			break;
+		}
+		done += result;
+	}
+	assert(done >= sizeof(struct hlog_record));
+	uint32_t length;
+	memcpy(previous, data + offsetof(struct hlog_record, previous), sizeof(*previous));
+	memcpy(&length, data + offsetof(struct hlog_record, key_length), sizeof(length));
+	bool match = length == key_length && done == bytes
+	             && memcmp(data + sizeof(struct hlog_record), key, key_length) == 0;
+	if (match) {
+		memcpy(value, data + offsetof(struct hlog_record, value), sizeof(*value));
+	}
+	if (data != buffer) {
+		free(data);
+	}
+	hash_table_counter_add(hash_table->disk_reads, 1);
+	return match;
+}
+
+/*
+ * Called holding a slot: walks a tag's chain from address to key's newest
+ * record and returns its address, 0 if it has none. *value is set on a
+ * match, and *record too if the record is still in memory.
+ */
+static uint64_t find_record(struct hash_table_hlog *hash_table,
+                            uint64_t address,
+                            const char *key,
+                            uint32_t key_length,
+                            struct hlog_record **record,
+                            uint32_t *value)
+{
+	uint64_t head = atomic_load(&hash_table->head);
+	*record = NULL;
+	while (address != 0) {
+		if (address < head) {
+			uint64_t previous;
+			if (read_flushed(hash_table, address, key, key_length, &previous, value)) {
+				return address;
+			}
+			address = previous;
+			continue;
+		}
+		struct hlog_record *candidate = get_record(hash_table, address);
+		if (candidate->key_length == key_length
+		    && memcmp(candidate->key, key, key_length) == 0) {
+			*record = candidate;
+			*value = atomic_load(&candidate->value);
+			return address;
+		}
+		address = candidate->previous;
+	}
+	return 0;
+}
+
+static struct index_bucket *get_bucket(struct hash_table_hlog *hash_table,
+                                       uint32_t hash)
+{
+	return &hash_table->buckets[hash % INDEX_BUCKETS];
+}
+
+/* Tags are never 0, so a claimed entry is never mistaken for a free one */
+static uint64_t get_tag(uint32_t hash)
+{
+	return (uint64_t) (1 + hash / INDEX_BUCKETS % TAG_COUNT) << TAG_SHIFT;
+}
+
+static _Atomic uint64_t *find_entry(struct index_bucket *bucket, uint64_t tag)
+{
+	for (; bucket != NULL; bucket = atomic_load(&bucket->overflow)) {
+		for (size_t i = 0; i < BUCKET_ENTRIES; ++i) {
+			if ((atomic_load(&bucket->entries[i]) & ~ADDRESS_MASK) == tag) {
+				return &bucket->entries[i];
+			}
+		}
+	}
+	return NULL;
+}
+
+/* Whether an entry other than skip has tag, tentative or not */
+static bool tag_elsewhere(struct index_bucket *bucket,
+                          uint64_t tag,
+                          _Atomic uint64_t *skip)
+{
+	for (; bucket != NULL; bucket = atomic_load(&bucket->overflow)) {
+		for (size_t i = 0; i < BUCKET_ENTRIES; ++i) {
+			uint64_t entry = atomic_load(&bucket->entries[i]);
+			if (&bucket->entries[i] != skip && entry != 0
+			    && (entry & ~ADDRESS_MASK & ~TENTATIVE) == tag) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+/* The first free entry, chaining on an overflow bucket if there is none */
+static _Atomic uint64_t *free_entry(struct index_bucket *bucket)
+{
+	for (;;) {
+		for (size_t i = 0; i < BUCKET_ENTRIES; ++i) {
+			if (atomic_load(&bucket->entries[i]) == 0) {
+				return &bucket->entries[i];
+			}
+		}
+		struct index_bucket *overflow = atomic_load(&bucket->overflow);
+		if (overflow == NULL) {
+			struct index_bucket *fresh = aligned_alloc(CACHE_LINE_SIZE, sizeof(struct index_bucket));
+			assert(fresh != NULL);
+			memset(fresh, 0, sizeof(struct index_bucket));
+			if (atomic_compare_exchange_strong(&bucket->overflow, &overflow, fresh)) {
+				overflow = fresh;
+			}
+			else {
+				free(fresh);
+			}
+		}
+		bucket = overflow;
+	}
+}
+
+/* Finds tag's entry in bucket, claiming a free one for it if it has none */
+static _Atomic uint64_t *claim_entry(struct index_bucket *bucket, uint64_t tag)
+{
+	for (;;) {
+		_Atomic uint64_t *entry = find_entry(bucket, tag);
+		if (entry != NULL) {
+			return entry;
+		}
+		entry = free_entry(bucket);
+		uint64_t expected = 0;
+		if (!atomic_compare_exchange_strong(entry, &expected, tag | TENTATIVE)) {
+			continue;
+		}
+		if (tag_elsewhere(bucket, tag, entry)) {
+			atomic_store(entry, 0);
+			sched_yield();
+			continue;
+		}
+		atomic_store(entry, tag);
+		return entry;
+	}
+}
+
+struct hash_table_hlog *hash_table_hlog_create(const char *directory,
+                                               size_t memory_bytes)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/hash-table-hlog-XXXXXX", directory);
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		return NULL;
+	}
+	unlink(path);
+	uint64_t frame_count = memory_bytes / PAGE_BYTES;
+	if (frame_count < MIN_FRAMES) {
+		frame_count = MIN_FRAMES;
+	}
+	char *frames = mmap(NULL, frame_count * PAGE_BYTES, PROT_READ | PROT_WRITE,
+	                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (frames == MAP_FAILED) {
+		int error = errno;
+		close(fd);
+		errno = error;
+		return NULL;
+	}
+	struct hash_table_hlog *hash_table = aligned_alloc(CACHE_LINE_SIZE, sizeof(struct hash_table_hlog));
+	assert(hash_table != NULL);
+	memset(hash_table, 0, sizeof(struct hash_table_hlog));
+	hash_table->fd = fd;
+	hash_table->frames = frames;
+	hash_table->frame_count = frame_count;
+	hash_table->mutable_pages = frame_count * MUTABLE_PERCENT / 100;
+	if (hash_table->mutable_pages == 0) {
+		hash_table->mutable_pages = 1;
+	}
+	if (hash_table->mutable_pages >= frame_count) {
+		hash_table->mutable_pages = frame_count - 1;
+	}
+	/* Address 0 ends a chain, so the log starts just past it */
+	hash_table->tail = sizeof(uint64_t);
+	atomic_store(&hash_table->epoch, 1);
+	hash_table->counter = hash_table_counter_create();
+	hash_table->in_place = hash_table_counter_create();
+	hash_table->copied = hash_table_counter_create();
+	hash_table->retries = hash_table_counter_create();
+	hash_table->disk_reads = hash_table_counter_create();
+	int error = pthread_mutex_init(&hash_table->log_mutex, NULL);
+	if (error != 0) {
+		exit(error);
+	}
+	return hash_table;
+}
+
+/*
+ * Sets key's value, or adds to it when add is set. A record in the mutable
+ * region is updated in place. Otherwise a new record is filled in at the
+ * tail, chained to the tag's current newest record and swapped into the
+ * index entry; if another record was swapped in first, the walk starts
+ * over and reuses the new record while it is still mutable.
+ */
+static void update(struct hash_table_hlog *hash_table,
+                   const char *key,
+                   uint32_t value,
+                   bool add)
+{
+	uint32_t key_length = strlen(key);
+	uint32_t hash = hash_table_mix(bernstein_hash(key));
+	_Atomic uint64_t *entry = claim_entry(get_bucket(hash_table, hash), get_tag(hash));
+	uint32_t bytes = record_bytes(key_length);
+	uint64_t fresh = 0;
+	uint32_t slot = protect(hash_table);
+	for (;;) {
+		uint64_t word = atomic_load(entry);
+		struct hlog_record *record;
+		uint32_t old = 0;
+		uint64_t address = find_record(hash_table, word & ADDRESS_MASK, key, key_length, &record, &old);
+		if (address != 0 && address >= atomic_load(&hash_table->read_only)) {
+			if (add) {
+				atomic_fetch_add(&record->value, value);
+			}
+			else {
+				atomic_store(&record->value, value);
+			}
+			hash_table_counter_add(hash_table->in_place, 1);
+			break;
+		}
+		/* A blind write needs no old value, so only an add has to wait */
+		if (address != 0 && add && address >= atomic_load(&hash_table->safe_read_only)) {
+			hash_table_counter_add(hash_table->retries, 1);
+			unprotect(hash_table, slot);
+			lock(&hash_table->log_mutex);
+			drain(hash_table);
+			unlock(&hash_table->log_mutex);
+			sched_yield();
+			slot = protect(hash_table);
+			continue;
+		}
+		if (fresh == 0 || fresh < atomic_load(&hash_table->read_only)) {
+			fresh = append(hash_table, bytes, &slot);
+			continue;
+		}
+		struct hlog_record *copy = get_record(hash_table, fresh);
+		copy->previous = word & ADDRESS_MASK;
+		copy->key_length = key_length;
+		memcpy(copy->key, key, key_length + 1);
+		atomic_store(&copy->value, add ? old + value : value);
+		if (atomic_compare_exchange_strong(entry, &word, (word & ~ADDRESS_MASK) | fresh)) {
+			hash_table_counter_add(address == 0 ? hash_table->counter : hash_table->copied, 1);
+			break;
+		}
+	}
+	unprotect(hash_table, slot);
+}
+
+void hash_table_hlog_add_entry(struct hash_table_hlog *hash_table,
+                               const char *key,
+                               uint32_t value)
+{
+	update(hash_table, key, value, false);
+}
+
+void hash_table_hlog_add_count(struct hash_table_hlog *hash_table,
+                               const char *key,
+                               uint32_t delta)
+{
+	update(hash_table, key, delta, true);
+}
+
+static bool lookup(struct hash_table_hlog *hash_table,
+                   const char *key,
+                   uint32_t *value)
+{
+	uint32_t hash = hash_table_mix(bernstein_hash(key));
+	_Atomic uint64_t *entry = find_entry(get_bucket(hash_table, hash), get_tag(hash));
+	if (entry == NULL) {
+		return false;
+	}
+	uint32_t slot = protect(hash_table);
+	struct hlog_record *record;
+	uint64_t address = find_record(hash_table, atomic_load(entry) & ADDRESS_MASK,
+	                               key, strlen(key), &record, value);
+	unprotect(hash_table, slot);
+	return address != 0;
+}
+
+bool hash_table_hlog_contains(struct hash_table_hlog *hash_table,
+                              const char *key)
+{
+	uint32_t value;
+	return lookup(hash_table, key, &value);
+}
+
+uint32_t hash_table_hlog_get_value(struct hash_table_hlog *hash_table,
+                                   const char *key)
+{
+	uint32_t value = 0;
+	bool found = lookup(hash_table, key, &value);
+	assert(found);
+	(void) found;
+	return value;
+}
+
+size_t hash_table_hlog_size(struct hash_table_hlog *hash_table)
+{
+	return hash_table_counter_read(hash_table->counter);
+}
+
+static void read_file(struct hash_table_hlog *hash_table,
+                      void *buffer,
+                      size_t bytes,
+                      uint64_t address)
+{
+	for (size_t done = 0; done < bytes; ) {
+		ssize_t result = pread(hash_table->fd, (char *) buffer + done, bytes - done, address + done);
+		if (result < 0) {
+			exit(errno);
+		}
+		/* Only whole pages are flushed, so a record never ends the file early */
+		assert(result > 0);
+		done += result;
+	}
+}
+
+/* Returns a copy of the key of the record at address, from memory or the file */
+static char *copy_record(struct hash_table_hlog *hash_table,
+                         uint64_t address,
+                         uint64_t *previous,
+                         uint32_t *value)
+{
+	if (address >= atomic_load(&hash_table->head)) {
+		struct hlog_record *record = get_record(hash_table, address);
+		*previous = record->previous;
+		*value = atomic_load(&record->value);
+		char *key = strdup(record->key);
+		assert(key != NULL);
+		return key;
+	}
+	char header[sizeof(struct hlog_record)];
+	read_file(hash_table, header, sizeof(header), address);
+	uint32_t key_length;
+	memcpy(previous, header + offsetof(struct hlog_record, previous), sizeof(*previous));
+	memcpy(value, header + offsetof(struct hlog_record, value), sizeof(*value));
+	memcpy(&key_length, header + offsetof(struct hlog_record, key_length), sizeof(key_length));
+	char *key = malloc(key_length + 1);
+	assert(key != NULL);
+	read_file(hash_table, key, key_length + 1, address + sizeof(header));
+	return key;
+}
+
+/*
+ * Every tag's chain runs newest first, so the first record seen for a key
+ * holds its value and the rest are older copies. A base table of key
+ * copies weeds those out before it is frozen in turn.
+ */
+struct hash_table_frozen *hash_table_hlog_freeze(struct hash_table_hlog *hash_table)
+{
+	struct hash_table_base *newest = hash_table_base_create();
+	size_t capacity = 1024;
+	size_t count = 0;
+	char **keys = malloc(capacity * sizeof(char *));
+	assert(keys != NULL);
+	for (size_t i = 0; i < INDEX_BUCKETS; ++i) {
+		struct index_bucket *bucket = &hash_table->buckets[i];
+		for (; bucket != NULL; bucket = atomic_load(&bucket->overflow)) {
+			for (size_t j = 0; j < BUCKET_ENTRIES; ++j) {
+				uint64_t entry = atomic_load(&bucket->entries[j]);
+				if (entry & TENTATIVE) {
+					continue;
+				}
+				uint64_t address = entry & ADDRESS_MASK;
+				while (address != 0) {
+					uint32_t value;
+					char *key = copy_record(hash_table, address, &address, &value);
+					if (hash_table_base_contains(newest, key)) {
+						free(key);
+						continue;
+					}
+					if (count == capacity) {
+						capacity *= 2;
+						keys = realloc(keys, capacity * sizeof(char *));
+						assert(keys != NULL);
+					}
+					keys[count++] = key;
+					hash_table_base_add_entry(newest, key, value);
+				}
+			}
+		}
+	}
+	struct hash_table_frozen *frozen = hash_table_base_freeze(newest);
+	hash_table_base_destroy(newest);
+	for (size_t i = 0; i < count; ++i) {
+		free(keys[i]);
+	}
+	free(keys);
+	return frozen;
+}
+
+void hash_table_hlog_stats(struct hash_table_hlog *hash_table,
+                           struct hash_table_hlog_stats *stats)
+{
+	lock(&hash_table->log_mutex);
+	stats->log_bytes = hash_table->tail;
+	stats->memory_bytes = hash_table->tail - atomic_load(&hash_table->head);
+	stats->flushed_bytes = hash_table->flushed;
+	unlock(&hash_table->log_mutex);
+	stats->in_place = hash_table_counter_read(hash_table->in_place);
+	stats->copied = hash_table_counter_read(hash_table->copied);
+	stats->retries = hash_table_counter_read(hash_table->retries);
+	stats->disk_reads = hash_table_counter_read(hash_table->disk_reads);
+}
+
+void hash_table_hlog_destroy(struct hash_table_hlog *hash_table)
+{
+	for (size_t i = 0; i < INDEX_BUCKETS; ++i) {
+		struct index_bucket *overflow = atomic_load(&hash_table->buckets[i].overflow);
+		while (overflow != NULL) {
+			struct index_bucket *next = atomic_load(&overflow->overflow);
+			free(overflow);
+			overflow = next;
+		}
+	}
+	munmap(hash_table->frames, hash_table->frame_count * PAGE_BYTES);
+	close(hash_table->fd);
+	hash_table_counter_destroy(hash_table->counter);
+	hash_table_counter_destroy(hash_table->in_place);
+	hash_table_counter_destroy(hash_table->copied);
+	hash_table_counter_destroy(hash_table->retries);
+	hash_table_counter_destroy(hash_table->disk_reads);
+	pthread_mutex_destroy(&hash_table->log_mutex);
+	free(hash_table);
+}
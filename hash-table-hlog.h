@@ -0,0 +1,70 @@
+#pragma once
+
+#include "hash-table-common.h"
+#include "hash-table-frozen.h"
+
+#include <stdbool.h>
+
+/*
+ * A record store in the style of FASTER, built for counters that are
+ * updated far more often than they are inserted. Every record lives in a
+ * hybrid log addressed by a growing 48 bit offset: the newest pages are a
+ * mutable region whose values are updated in place with atomics, the
+ * pages before it are a read-only region still in memory, and everything
+ * older has been written to a file and evicted. The in-memory pages are a
+ * fixed ring of frames, so memory stays at memory_bytes however large the
+ * log grows. An update to a record that is no longer mutable copies it to
+ * the tail with the new value (read-copy-update).
+ *
+ * The index takes no locks. A bucket is a cache line of tagged entries,
+ * each holding a few hash bits and the address of the newest record whose
+ * key has that tag; records of the same tag are chained through the log.
+ * Threads announce the epoch they started an operation in, and the log
+ * only treats a page as read-only, or reuses its frame, once every
+ * operation that could still see the old state is done.
+ *
+ * Keys are copied into the log. The log file is created in directory and
+ * unlinked at once, so it never outlives the table.
+ */
+struct hash_table_hlog;
+
+/*
+ * Operations that can run at once. Each holds an epoch slot while it runs,
+ * and one started while every slot is held waits for one to free up.
+ */
+#define HASH_TABLE_HLOG_MAX_THREADS 64
+
+struct hash_table_hlog_stats {
+	size_t in_place;
+	size_t copied;
+	size_t retries;
+	size_t disk_reads;
+	size_t log_bytes;
+	size_t memory_bytes;
+	size_t flushed_bytes;
+};
+
+/* Returns NULL with errno set if directory cannot hold the log file */
+struct hash_table_hlog *hash_table_hlog_create(const char *directory,
+                                               size_t memory_bytes);
+void hash_table_hlog_add_entry(struct hash_table_hlog *hash_table,
+                               const char *key,
+                               uint32_t value);
+/* Adds delta to key's value, inserting key with delta if it is missing */
+void hash_table_hlog_add_count(struct hash_table_hlog *hash_table,
+                               const char *key,
+                               uint32_t delta);
+bool hash_table_hlog_contains(struct hash_table_hlog *hash_table,
+                              const char *key);
+uint32_t hash_table_hlog_get_value(struct hash_table_hlog *hash_table,
+                                   const char *key);
+size_t hash_table_hlog_size(struct hash_table_hlog *hash_table);
+/*
+ * Copy the newest value of every key into an immutable hash_table_frozen,
+ * with no writer running. Records already evicted are read from the file.
+ */
+struct hash_table_frozen *hash_table_hlog_freeze(struct hash_table_hlog *hash_table);
+/* retries counts updates that waited for a page to settle as read-only */
+void hash_table_hlog_stats(struct hash_table_hlog *hash_table,
+                           struct hash_table_hlog_stats *stats);
+void hash_table_hlog_destroy(struct hash_table_hlog *hash_table);
@@ -0,0 +1,65 @@
+#include "hash-table-index.h"
+
+#include <string.h>
+
+struct hash_table_index *hash_table_index_create(const struct ht_allocator *allocator,
+                                                 uint32_t capacity)
+{
+	struct hash_table_index *index = hash_table_alloc(allocator, sizeof(struct hash_table_index));
+	index->allocator = allocator;
+	index->capacity = capacity;
+	index->hashes = hash_table_alloc(allocator, capacity * sizeof(uint32_t));
+	index->entries = hash_table_alloc(allocator, capacity * sizeof(void *));
+	return index;
+}
+
+size_t hash_table_index_lower_bound(const struct hash_table_index *index,
+                                    uint32_t hash)
+{
+	size_t low = 0;
+	size_t high = index->size;
+	while (low < high) {
+		size_t middle = low + (high - low) / 2;
+		if (index->hashes[middle] < hash) {
+			low = middle + 1;
+		}
+		else {
+			high = middle;
+		}
+	}
+	return low;
+}
+
+void hash_table_index_insert(struct hash_table_index *index,
+                             uint32_t hash,
+                             void *entry)
+{
+	if (index->size == index->capacity) {
+		uint32_t *hashes = hash_table_alloc(index->allocator, 2 * index->capacity * sizeof(uint32_t));
+		void **entries = hash_table_alloc(index->allocator, 2 * index->capacity * sizeof(void *));
+		memcpy(hashes, index->hashes, index->size * sizeof(uint32_t));
+		memcpy(entries, index->entries, index->size * sizeof(void *));
+		hash_table_free(index->allocator, index->hashes, index->capacity * sizeof(uint32_t));
+		hash_table_free(index->allocator, index->entries, index->capacity * sizeof(void *));
+		index->hashes = hashes;
+		index->entries = entries;
+		index->capacity *= 2;
+	}
+	size_t position = hash_table_index_lower_bound(index, hash);
+	size_t count = index->size - position;
+	memmove(&index->hashes[position + 1], &index->hashes[position], count * sizeof(uint32_t));
+	memmove(&index->entries[position + 1], &index->entries[position], count * sizeof(void *));
+	index->hashes[position] = hash;
+	index->entries[position] = entry;
+	++index->size;
+}
+
+void hash_table_index_destroy(struct hash_table_index *index)
+{
+	if (index == NULL) {
+		return;
+	}
+	hash_table_free(index->allocator, index->hashes, index->capacity * sizeof(uint32_t));
+	hash_table_free(index->allocator, index->entries, index->capacity * sizeof(void *));
+	hash_table_free(index->allocator, index, sizeof(struct hash_table_index));
+}
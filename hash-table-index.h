@@ -0,0 +1,31 @@
+#pragma once
+
+#include "hash-table-common.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Chains longer than this get a sorted fingerprint index */
+#define HASH_TABLE_INDEX_THRESHOLD 32
+
+/*
+ * Sorted array of (hash, entry) pairs kept beside a long chain. The hashes
+ * are stored apart from the entries so the binary search only touches the
+ * packed 4-byte fingerprints.
+ */
+struct hash_table_index {
+	const struct ht_allocator *allocator;
+	uint32_t size;
+	uint32_t capacity;
+	uint32_t *hashes;
+	void **entries;
+};
+
+struct hash_table_index *hash_table_index_create(const struct ht_allocator *allocator,
+                                                 uint32_t capacity);
+void hash_table_index_insert(struct hash_table_index *index,
+                             uint32_t hash,
+                             void *entry);
+size_t hash_table_index_lower_bound(const struct hash_table_index *index,
+                                    uint32_t hash);
+void hash_table_index_destroy(struct hash_table_index *index);
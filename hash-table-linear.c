@@ -0,0 +1,406 @@
+#include "hash-table-linear.h"
+#include "hash-table-counter.h"
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+
+#include <pthread.h>
+
+/*
+ * Buckets live in fixed-size segments so growing never moves a bucket.
+ * The directory of segments starts with INITIAL_DIRECTORY slots and
+ * doubles when full. INITIAL_BUCKETS must be a power of two.
+ */
+#define INITIAL_BUCKETS 256
+#define SEGMENT_CAPACITY 1024
+#define INITIAL_DIRECTORY 8
+#define LOAD_FACTOR 4
+
+/*
+ * The entry count is sharded, so each thread only sums it every
+ * SIZE_CHECK_INTERVAL inserts into the table, counted by its own shard,
+ * and then catches up with that many splits.
+ */
+#define SIZE_CHECK_INTERVAL 32
+
+struct list_entry {
+	const char *key;
+	uint32_t hash;
+	uint32_t value;
+	SLIST_ENTRY(list_entry) pointers;
+};
+
+SLIST_HEAD(list_head, list_entry);
+
+struct hash_table_entry {
+	struct list_head list_head;
+	pthread_mutex_t mutex;
+};
+
+/*
+ * Readers may still hold a directory after it was outgrown, so each one
+ * keeps the one it replaced and they are all freed with the table.
+ */
+struct segment_directory {
+	size_t capacity;
+	struct segment_directory *previous;
+	struct hash_table_entry *_Atomic segments[];
+};
+
+/*
+ * state packs the level in the high half and the split pointer in the low
+ * half so both are always read together. Buckets below the split pointer
+ * have already been split this round and use one more hash bit.
+ */
+struct hash_table_linear {
+	_Atomic uint64_t state;
+	struct hash_table_counter *counter;
+	pthread_mutex_t split_mutex;
+	struct segment_directory *_Atomic directory;
+};
+
+static uint32_t state_level(uint64_t state)
+{
+	return state >> 32;
+}
+
+static uint32_t state_split(uint64_t state)
+{
+	return (uint32_t) state;
+}
+
+static size_t bucket_count(uint64_t state)
+{
+	return ((size_t) INITIAL_BUCKETS << state_level(state)) + state_split(state);
+}
+
+static size_t get_index(uint64_t state, uint32_t hash)
+{
+	size_t round = (size_t) INITIAL_BUCKETS << state_level(state);
+	size_t index = hash & (round - 1);
+	if (index < state_split(state)) {
+		index = hash & ((round << 1) - 1);
+	}
+	return index;
+}
+
+static struct hash_table_entry *get_bucket(struct hash_table_linear *hash_table,
+                                           size_t index)
+{
+	struct segment_directory *directory = atomic_load_explicit(&hash_table->directory,
+	                                                           memory_order_acquire);
+	struct hash_table_entry *segment = atomic_load_explicit(&directory->segments[index / SEGMENT_CAPACITY],
+	                                                        memory_order_acquire);
+	return &segment[index % SEGMENT_CAPACITY];
+}
+
+static struct segment_directory *create_directory(size_t capacity)
+{
+	struct segment_directory *directory = calloc(1, sizeof(struct segment_directory)
+	                                                + capacity * sizeof(struct hash_table_entry *));
+	assert(directory != NULL);
+	directory->capacity = capacity;
+	return directory;
+}
+
+/*
+ * Called with split_mutex held, or from create. The directory is published
+ * before the segment, and both before the state that makes them reachable.
+ */
+static void add_segment(struct hash_table_linear *hash_table,
+                        size_t segment_index)
+{
+	struct segment_directory *directory = atomic_load_explicit(&hash_table->directory,
+	                                                           memory_order_relaxed);
+	if (segment_index == directory->capacity) {
+		struct segment_directory *grown = create_directory(directory->capacity * 2);
+		for (size_t i = 0; i < directory->capacity; ++i) {
+			atomic_init(&grown->segments[i], atomic_load_explicit(&directory->segments[i],
+			                                                      memory_order_relaxed));
+		}
+		grown->previous = directory;
+		atomic_store_explicit(&hash_table->directory, grown, memory_order_release);
+		directory = grown;
+	}
+	struct hash_table_entry *segment = calloc(SEGMENT_CAPACITY, sizeof(struct hash_table_entry));
+	assert(segment != NULL);
+	for (size_t i = 0; i < SEGMENT_CAPACITY; ++i) {
+		SLIST_INIT(&segment[i].list_head);
+		int error = pthread_mutex_init(&segment[i].mutex, NULL);
+		if (error != 0) {
+			exit(error);
+		}
+	}
+	atomic_store_explicit(&directory->segments[segment_index], segment, memory_order_release);
+}
+
+struct hash_table_linear *hash_table_linear_create()
+{
+	struct hash_table_linear *hash_table = calloc(1, sizeof(struct hash_table_linear));
+	assert(hash_table != NULL);
+	int error = pthread_mutex_init(&hash_table->split_mutex, NULL);
+	if (error != 0) {
+		exit(error);
+	}
+	hash_table->counter = hash_table_counter_create();
+	hash_table->directory = create_directory(INITIAL_DIRECTORY);
+	for (size_t i = 0; i < INITIAL_BUCKETS; i += SEGMENT_CAPACITY) {
+		add_segment(hash_table, i / SEGMENT_CAPACITY);
+	}
+	return hash_table;
+}
+
+static void lock_bucket(struct hash_table_entry *bucket)
+{
+	int error = pthread_mutex_lock(&bucket->mutex);
+	if (error != 0) {
+		exit(error);
+	}
+}
+
+static void unlock_bucket(struct hash_table_entry *bucket)
+{
+	int error = pthread_mutex_unlock(&bucket->mutex);
+	if (error != 0) {
+		exit(error);
+	}
+}
+
+/*
+ * Returns the bucket for hash with its mutex held. A split that moved hash
+ * out of the bucket publishes the new state before releasing the bucket, so
+ * recomputing the index under the lock tells us whether to retry.
+ */
+static struct hash_table_entry *lock_hash(struct hash_table_linear *hash_table,
+                                          uint32_t hash)
+{
+	uint64_t state = atomic_load_explicit(&hash_table->state, memory_order_acquire);
+	while (true) {
+		size_t index = get_index(state, hash);
+		struct hash_table_entry *bucket = get_bucket(hash_table, index);
+		lock_bucket(bucket);
+		state = atomic_load_explicit(&hash_table->state, memory_order_acquire);
+		if (get_index(state, hash) == index) {
+			return bucket;
+		}
+		unlock_bucket(bucket);
+	}
+}
+
+static struct list_entry *get_list_entry(struct hash_table_entry *bucket,
+                                         const char *key,
+                                         uint32_t hash)
+{
+	assert(key != NULL);
+
+	struct list_entry *entry = NULL;
+	SLIST_FOREACH(entry, &bucket->list_head, pointers) {
+		if (entry->hash == hash && strcmp(entry->key, key) == 0) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Split the bucket at the split pointer into itself and its image one round
+ * up, until the load factor is met or SIZE_CHECK_INTERVAL buckets were split.
+ * Splits are serialised by split_mutex and each one only holds the two
+ * bucket locks involved.
+ */
+static void split_buckets(struct hash_table_linear *hash_table,
+                          size_t size)
+{
+	if (pthread_mutex_trylock(&hash_table->split_mutex) != 0) {
+		/* Someone else is already growing the table */
+		return;
+	}
+
+	uint64_t state = atomic_load_explicit(&hash_table->state, memory_order_relaxed);
+	for (size_t i = 0; i < SIZE_CHECK_INTERVAL && size > LOAD_FACTOR * bucket_count(state); ++i) {
+		uint32_t level = state_level(state);
+		uint32_t split = state_split(state);
+		size_t round = (size_t) INITIAL_BUCKETS << level;
+		if (round > UINT32_MAX) {
+			/* Every hash bit already picks a bucket, more would stay empty */
+			break;
+		}
+		size_t image_index = round + split;
+		if (image_index % SEGMENT_CAPACITY == 0) {
+			add_segment(hash_table, image_index / SEGMENT_CAPACITY);
+		}
+
+		struct hash_table_entry *bucket = get_bucket(hash_table, split);
+		struct hash_table_entry *image = get_bucket(hash_table, image_index);
+		lock_bucket(bucket);
+		lock_bucket(image);
+
+		struct list_entry *entry = SLIST_FIRST(&bucket->list_head);
+		SLIST_INIT(&bucket->list_head);
+		while (entry != NULL) {
+			struct list_entry *next = SLIST_NEXT(entry, pointers);
+			if (entry->hash & round) {
+				SLIST_INSERT_HEAD(&image->list_head, entry, pointers);
+			}
+			else {
+				SLIST_INSERT_HEAD(&bucket->list_head, entry, pointers);
+			}
+			entry = next;
+		}
+
+		++split;
+		if (split == round) {
+			++level;
+			split = 0;
+		}
+		state = ((uint64_t) level << 32) | split;
+		atomic_store_explicit(&hash_table->state, state, memory_order_release);
+
+		unlock_bucket(image);
+		unlock_bucket(bucket);
+	}
+
+	int error = pthread_mutex_unlock(&hash_table->split_mutex);
+	if (error != 0) {
+		exit(error);
+	}
+}
+
+bool hash_table_linear_contains(struct hash_table_linear *hash_table,
+                                const char *key)
+{
+	uint32_t hash = hash_table_mix(bernstein_hash(key));
+	struct hash_table_entry *bucket = lock_hash(hash_table, hash);
+	struct list_entry *list_entry = get_list_entry(bucket, key, hash);
+	unlock_bucket(bucket);
+	return list_entry != NULL;
+}
+
+void hash_table_linear_add_entry(struct hash_table_linear *hash_table,
+                                 const char *key,
+                                 uint32_t value)
+{
+	uint32_t hash = hash_table_mix(bernstein_hash(key));
+	struct hash_table_entry *bucket = lock_hash(hash_table, hash);
+	struct list_entry *list_entry = get_list_entry(bucket, key, hash);
+
+	/* Update the value if it already exists */
+	if (list_entry != NULL) {
+		list_entry->value = value;
+		unlock_bucket(bucket);
+		return;
+	}
+
+	list_entry = calloc(1, sizeof(struct list_entry));
+	list_entry->key = key;
+	list_entry->hash = hash;
+	list_entry->value = value;
+	SLIST_INSERT_HEAD(&bucket->list_head, list_entry, pointers);
+	unlock_bucket(bucket);
+
+	if (hash_table_counter_add(hash_table->counter, 1) % SIZE_CHECK_INTERVAL != 0) {
+		return;
+	}
+	size_t size = hash_table_counter_read(hash_table->counter);
+	uint64_t state = atomic_load_explicit(&hash_table->state, memory_order_relaxed);
+	if (size > LOAD_FACTOR * bucket_count(state)) {
+		split_buckets(hash_table, size);
+	}
+}
+
+uint32_t hash_table_linear_get_value(struct hash_table_linear *hash_table,
+                                     const char *key)
+{
+	uint32_t hash = hash_table_mix(bernstein_hash(key));
+	struct hash_table_entry *bucket = lock_hash(hash_table, hash);
+	struct list_entry *list_entry = get_list_entry(bucket, key, hash);
+	assert(list_entry != NULL);
+	uint32_t value = list_entry->value;
+	unlock_bucket(bucket);
+	return value;
+}
+
+size_t hash_table_linear_size(struct hash_table_linear *hash_table)
+{
+	return hash_table_counter_read(hash_table->counter);
+}
+
+/*
+ * Holding split_mutex fixes the bucket count, and every bucket lock is
+ * held between the two passes so the copy is of one moment.
+ */
+struct hash_table_frozen *hash_table_linear_freeze(struct hash_table_linear *hash_table)
+{
+	int error = pthread_mutex_lock(&hash_table->split_mutex);
+	if (error != 0) {
+		exit(error);
+	}
+	size_t buckets = bucket_count(atomic_load_explicit(&hash_table->state, memory_order_acquire));
+	size_t size = 0;
+	size_t key_bytes = 0;
+	struct list_entry *list_entry = NULL;
+	for (size_t i = 0; i < buckets; ++i) {
+		struct hash_table_entry *bucket = get_bucket(hash_table, i);
+		lock_bucket(bucket);
+		SLIST_FOREACH(list_entry, &bucket->list_head, pointers) {
+			++size;
+			key_bytes += strlen(list_entry->key) + 1;
+		}
+	}
+	struct hash_table_frozen *frozen = hash_table_frozen_create(size, key_bytes);
+	for (size_t i = 0; i < buckets; ++i) {
+		struct hash_table_entry *bucket = get_bucket(hash_table, i);
+		SLIST_FOREACH(list_entry, &bucket->list_head, pointers) {
+			/* The stored hash is mixed, the frozen table wants the raw one */
+			hash_table_frozen_insert(frozen, list_entry->key, bernstein_hash(list_entry->key), list_entry->value);
+		}
+		unlock_bucket(bucket);
+	}
+	error = pthread_mutex_unlock(&hash_table->split_mutex);
+	if (error != 0) {
+		exit(error);
+	}
+	return frozen;
+}
+
+void hash_table_linear_destroy(struct hash_table_linear *hash_table)
+{
+	size_t buckets = bucket_count(atomic_load(&hash_table->state));
+	for (size_t i = 0; i < buckets; ++i) {
+		struct hash_table_entry *bucket = get_bucket(hash_table, i);
+		struct list_entry *list_entry = NULL;
+		while (!SLIST_EMPTY(&bucket->list_head)) {
+			list_entry = SLIST_FIRST(&bucket->list_head);
+			SLIST_REMOVE_HEAD(&bucket->list_head, pointers);
+			free(list_entry);
+		}
+	}
+	struct segment_directory *directory = atomic_load(&hash_table->directory);
+	for (size_t i = 0; i < directory->capacity; ++i) {
+		struct hash_table_entry *segment = atomic_load(&directory->segments[i]);
+		if (segment == NULL) {
+			break;
+		}
+		for (size_t j = 0; j < SEGMENT_CAPACITY; ++j) {
+			int error = pthread_mutex_destroy(&segment[j].mutex);
+			if (error != 0) {
+				exit(error);
+			}
+		}
+		free(segment);
+	}
+	while (directory != NULL) {
+		struct segment_directory *previous = directory->previous;
+		free(directory);
+		directory = previous;
+	}
+	hash_table_counter_destroy(hash_table->counter);
+	int error = pthread_mutex_destroy(&hash_table->split_mutex);
+	if (error != 0) {
+		exit(error);
+	}
+	free(hash_table);
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "hash-table-common.h"
+#include "hash-table-frozen.h"
+
+#include <stdbool.h>
+
+struct hash_table_linear;
+struct hash_table_linear *hash_table_linear_create();
+void hash_table_linear_add_entry(struct hash_table_linear *hash_table,
+                                 const char *key,
+                                 uint32_t value);
+bool hash_table_linear_contains(struct hash_table_linear *hash_table,
+                                const char *key);
+uint32_t hash_table_linear_get_value(struct hash_table_linear *hash_table,
+                                     const char* key);
+size_t hash_table_linear_size(struct hash_table_linear *hash_table);
+/* Copy the current contents into an immutable hash_table_frozen */
+struct hash_table_frozen *hash_table_linear_freeze(struct hash_table_linear *hash_table);
+void hash_table_linear_destroy(struct hash_table_linear *hash_table);
@@ -0,0 +1,337 @@
+#include "hash-table-mphf.h"
+#include "hash-table-base.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_LEVELS 32
+/* Bits per remaining key at each level, 1 gives the smallest function */
+#define GAMMA 1
+/* One cumulative rank per this many words */
+#define RANK_WORDS 8
+#define BUILD_CHUNK 65536
+
+struct level {
+	uint64_t bits;
+	uint64_t *words;
+	/* Set bits before each group of RANK_WORDS words, counting earlier levels */
+	uint64_t *ranks;
+};
+
+struct slot {
+	const char *key;
+	uint32_t value;
+};
+
+/* Keys that collide on every level map to their slot through a plain table */
+struct hash_table_mphf {
+	size_t size;
+	uint32_t levels;
+	struct level level[MAX_LEVELS];
+	struct hash_table_base *fallback;
+	size_t fallback_size;
+	struct slot *slots;
+};
+
+/* 64-bit FNV-1a, then a finalizer; Bernstein's 32 bits collide too often here */
+static uint64_t hash_key(const char *key)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (; *key != '\0'; ++key) {
+		hash = (hash ^ (unsigned char) *key) * 0x100000001b3ULL;
+	}
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+static uint64_t get_position(uint64_t hash, uint32_t level, uint64_t bits)
+{
+	uint64_t x = hash + (level + 1) * 0x9e3779b97f4a7c15ULL;
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return ((unsigned __int128) x * bits) >> 64;
+}
+
+struct build_job {
+	const char **keys;
+	const uint64_t *hashes;
+	uint32_t *remaining;
+	size_t remaining_size;
+	uint32_t *next;
+	size_t *chunk_counts;
+	uint32_t level;
+	uint64_t bits;
+	uint64_t *words;
+	uint64_t *collisions;
+	struct hash_table_mphf *hash_table;
+	const uint32_t *values;
+};
+
+static void hash_keys(void *context, uint32_t chunk)
+{
+	struct build_job *job = context;
+	size_t end = (chunk + 1) * (size_t) BUILD_CHUNK;
+	uint64_t *hashes = (uint64_t *) job->hashes;
+	for (size_t i = chunk * (size_t) BUILD_CHUNK; i < end && i < job->hash_table->size; ++i) {
+		hashes[i] = hash_key(job->keys[i]);
+	}
+}
+
+/* First pass of a level: set each key's bit, recording bits hit twice */
+static void mark_keys(void *context, uint32_t chunk)
+{
+	struct build_job *job = context;
+	size_t end = (chunk + 1) * (size_t) BUILD_CHUNK;
+	for (size_t i = chunk * (size_t) BUILD_CHUNK; i < end && i < job->remaining_size; ++i) {
+		uint64_t position = get_position(job->hashes[job->remaining[i]], job->level, job->bits);
+		uint64_t bit = 1ULL << (position % 64);
+		uint64_t old = __atomic_fetch_or(&job->words[position / 64], bit, __ATOMIC_RELAXED);
+		if (old & bit) {
+			__atomic_fetch_or(&job->collisions[position / 64], bit, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+static bool collided(struct build_job *job, uint32_t key)
+{
+	uint64_t position = get_position(job->hashes[key], job->level, job->bits);
+	return job->collisions[position / 64] & (1ULL << (position % 64));
+}
+
+/* Second pass: count, then copy, the keys that move on to the next level */
+static void count_collided(void *context, uint32_t chunk)
+{
+	struct build_job *job = context;
+	size_t end = (chunk + 1) * (size_t) BUILD_CHUNK;
+	size_t count = 0;
+	for (size_t i = chunk * (size_t) BUILD_CHUNK; i < end && i < job->remaining_size; ++i) {
+		count += collided(job, job->remaining[i]);
+	}
+	job->chunk_counts[chunk] = count;
+}
+
+static void copy_collided(void *context, uint32_t chunk)
+{
+	struct build_job *job = context;
+	size_t end = (chunk + 1) * (size_t) BUILD_CHUNK;
+	size_t out = job->chunk_counts[chunk];
+	for (size_t i = chunk * (size_t) BUILD_CHUNK; i < end && i < job->remaining_size; ++i) {
+		if (collided(job, job->remaining[i])) {
+			job->next[out++] = job->remaining[i];
+		}
+	}
+}
+
+static bool find_slot(const struct hash_table_mphf *hash_table,
+                      const char *key,
+                      uint64_t hash,
+                      size_t *slot)
+{
+	for (uint32_t i = 0; i < hash_table->levels; ++i) {
+		const struct level *level = &hash_table->level[i];
+		uint64_t position = get_position(hash, i, level->bits);
+		uint64_t word = position / 64;
+		uint64_t bit = 1ULL << (position % 64);
+		if ((level->words[word] & bit) == 0) {
+			continue;
+		}
+		uint64_t rank = level->ranks[word / RANK_WORDS];
+		for (uint64_t j = word - word % RANK_WORDS; j < word; ++j) {
+			rank += __builtin_popcountll(level->words[j]);
+		}
+		*slot = rank + __builtin_popcountll(level->words[word] & (bit - 1));
+		return true;
+	}
+	if (hash_table->fallback != NULL && hash_table_base_contains(hash_table->fallback, key)) {
+		*slot = hash_table_base_get_value(hash_table->fallback, key);
+		return true;
+	}
+	return false;
+}
+
+static void fill_slots(void *context, uint32_t chunk)
+{
+	struct build_job *job = context;
+	struct hash_table_mphf *hash_table = job->hash_table;
+	size_t end = (chunk + 1) * (size_t) BUILD_CHUNK;
+	for (size_t i = chunk * (size_t) BUILD_CHUNK; i < end && i < hash_table->size; ++i) {
+		size_t slot = 0;
+		bool found = find_slot(hash_table, job->keys[i], job->hashes[i], &slot);
+		assert(found && slot < hash_table->size);
+		hash_table->slots[slot].key = job->keys[i];
+		hash_table->slots[slot].value = job->values[i];
+	}
+}
+
+static uint32_t get_chunks(size_t size)
+{
+	return (size + BUILD_CHUNK - 1) / BUILD_CHUNK;
+}
+
+struct hash_table_mphf *hash_table_mphf_create(const char **keys,
+                                               const uint32_t *values,
+                                               size_t size,
+                                               uint32_t threads)
+{
+	assert(size <= UINT32_MAX);
+	struct hash_table_mphf *hash_table = calloc(1, sizeof(struct hash_table_mphf));
+	assert(hash_table != NULL);
+	hash_table->size = size;
+
+	struct build_job job = {
+		.keys = keys,
+		.values = values,
+		.hash_table = hash_table,
+		.hashes = malloc(size * sizeof(uint64_t) + 1),
+		.remaining = malloc(size * sizeof(uint32_t) + 1),
+		.next = malloc(size * sizeof(uint32_t) + 1),
+		.chunk_counts = malloc(get_chunks(size) * sizeof(size_t) + 1),
+	};
+	assert(job.hashes != NULL && job.remaining != NULL && job.next != NULL && job.chunk_counts != NULL);
+	hash_table_parallel(get_chunks(size), threads, hash_keys, &job);
+	for (size_t i = 0; i < size; ++i) {
+		job.remaining[i] = i;
+	}
+	job.remaining_size = size;
+
+	uint64_t placed = 0;
+	while (job.remaining_size > 0 && hash_table->levels < MAX_LEVELS) {
+		struct level *level = &hash_table->level[hash_table->levels];
+		uint64_t words = (job.remaining_size * GAMMA + 63) / 64;
+		words = (words + RANK_WORDS - 1) / RANK_WORDS * RANK_WORDS;
+		level->bits = words * 64;
+		level->words = calloc(words, sizeof(uint64_t));
+		level->ranks = malloc(words / RANK_WORDS * sizeof(uint64_t));
+		job.collisions = calloc(words, sizeof(uint64_t));
+		assert(level->words != NULL && level->ranks != NULL && job.collisions != NULL);
+		job.level = hash_table->levels;
+		job.bits = level->bits;
+		job.words = level->words;
+
+		uint32_t chunks = get_chunks(job.remaining_size);
+		hash_table_parallel(chunks, threads, mark_keys, &job);
+		hash_table_parallel(chunks, threads, count_collided, &job);
+		size_t next_size = 0;
+		for (uint32_t i = 0; i < chunks; ++i) {
+			size_t count = job.chunk_counts[i];
+			job.chunk_counts[i] = next_size;
+			next_size += count;
+		}
+		hash_table_parallel(chunks, threads, copy_collided, &job);
+
+		/* Only bits hit exactly once keep a key */
+		for (uint64_t i = 0; i < words; ++i) {
+			level->words[i] &= ~job.collisions[i];
+			if (i % RANK_WORDS == 0) {
+				level->ranks[i / RANK_WORDS] = placed;
+			}
+			placed += __builtin_popcountll(level->words[i]);
+		}
+		free(job.collisions);
+
+		uint32_t *swap = job.remaining;
+		job.remaining = job.next;
+		job.next = swap;
+		job.remaining_size = next_size;
+		++hash_table->levels;
+	}
+
+	if (job.remaining_size > 0) {
+		hash_table->fallback = hash_table_base_create();
+		hash_table->fallback_size = job.remaining_size;
+		for (size_t i = 0; i < job.remaining_size; ++i) {
+			hash_table_base_add_entry(hash_table->fallback, keys[job.remaining[i]], placed + i);
+		}
+	}
+
+	hash_table->slots = malloc(size * sizeof(struct slot) + 1);
+	assert(hash_table->slots != NULL);
+	hash_table_parallel(get_chunks(size), threads, fill_slots, &job);
+
+	free((void *) job.hashes);
+	free(job.remaining);
+	free(job.next);
+	free(job.chunk_counts);
+	return hash_table;
+}
+
+static const struct slot *get_slot(const struct hash_table_mphf *hash_table,
+                                   const char *key)
+{
+	assert(key != NULL);
+	size_t slot = 0;
+	if (!find_slot(hash_table, key, hash_key(key), &slot)
+	    || strcmp(hash_table->slots[slot].key, key) != 0) {
+		return NULL;
+	}
+	return &hash_table->slots[slot];
+}
+
+bool hash_table_mphf_contains(const struct hash_table_mphf *hash_table,
+                              const char *key)
+{
+	return get_slot(hash_table, key) != NULL;
+}
+
+uint32_t hash_table_mphf_get_value(const struct hash_table_mphf *hash_table,
+                                   const char *key)
+{
+	const struct slot *slot = get_slot(hash_table, key);
+	assert(slot != NULL);
+	return slot->value;
+}
+
+size_t hash_table_mphf_size(const struct hash_table_mphf *hash_table)
+{
+	return hash_table->size;
+}
+
+struct hash_table_frozen *hash_table_mphf_freeze(const struct hash_table_mphf *hash_table)
+{
+	size_t key_bytes = 0;
+	for (size_t i = 0; i < hash_table->size; ++i) {
+		key_bytes += strlen(hash_table->slots[i].key) + 1;
+	}
+	struct hash_table_frozen *frozen = hash_table_frozen_create(hash_table->size, key_bytes);
+	for (size_t i = 0; i < hash_table->size; ++i) {
+		const struct slot *slot = &hash_table->slots[i];
+		hash_table_frozen_insert(frozen, slot->key, bernstein_hash(slot->key), slot->value);
+	}
+	return frozen;
+}
+
+size_t hash_table_mphf_function_bytes(const struct hash_table_mphf *hash_table)
+{
+	size_t bytes = 0;
+	for (uint32_t i = 0; i < hash_table->levels; ++i) {
+		uint64_t words = hash_table->level[i].bits / 64;
+		bytes += words * sizeof(uint64_t) + words / RANK_WORDS * sizeof(uint64_t);
+	}
+	return bytes;
+}
+
+size_t hash_table_mphf_bytes(const struct hash_table_mphf *hash_table)
+{
+	return sizeof(struct hash_table_mphf)
+	       + hash_table_mphf_function_bytes(hash_table)
+	       + hash_table->size * sizeof(struct slot);
+}
+
+void hash_table_mphf_destroy(struct hash_table_mphf *hash_table)
+{
+	for (uint32_t i = 0; i < hash_table->levels; ++i) {
+		free(hash_table->level[i].words);
+		free(hash_table->level[i].ranks);
+	}
+	if (hash_table->fallback != NULL) {
+		hash_table_base_destroy(hash_table->fallback);
+	}
+	free(hash_table->slots);
+	free(hash_table);
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "hash-table-common.h"
+#include "hash-table-frozen.h"
+
+#include <stdbool.h>
+
+/*
+ * Static table over a fixed key set, built on a minimal perfect hash
+ * function in the style of BBHash: a cascade of bit arrays, one per level,
+ * where each key lands at the first level its hash does not collide on.
+ * The rank of that bit among all set bits is the key's slot, so there are
+ * exactly size slots and the function itself costs about 3 bits per key.
+ * A lookup hashes the key once, tests one bit per level until one is set
+ * (fewer than three on average), then reads one slot and compares the key.
+ */
+struct hash_table_mphf;
+
+/* keys must be distinct and outlive the table, like every table here */
+struct hash_table_mphf *hash_table_mphf_create(const char **keys,
+                                               const uint32_t *values,
+                                               size_t size,
+                                               uint32_t threads);
+bool hash_table_mphf_contains(const struct hash_table_mphf *hash_table,
+                              const char *key);
+uint32_t hash_table_mphf_get_value(const struct hash_table_mphf *hash_table,
+                                   const char *key);
+size_t hash_table_mphf_size(const struct hash_table_mphf *hash_table);
+/* Copy the table into a hash_table_frozen, which can be saved to a file */
+struct hash_table_frozen *hash_table_mphf_freeze(const struct hash_table_mphf *hash_table);
+/* Bytes used by the hash function alone, and by the whole table */
+size_t hash_table_mphf_function_bytes(const struct hash_table_mphf *hash_table);
+size_t hash_table_mphf_bytes(const struct hash_table_mphf *hash_table);
+void hash_table_mphf_destroy(struct hash_table_mphf *hash_table);
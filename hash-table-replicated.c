@@ -0,0 +1,209 @@
+#define _GNU_SOURCE
+
+#include "hash-table-replicated.h"
+#include "hash-table-base.h"
+
+#include <assert.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <pthread.h>
+
+#define LOG_CAPACITY 4096
+#define CACHE_LINE_SIZE 64
+
+struct operation {
+	const char *key;
+	uint32_t value;
+};
+
+/*
+ * applied is the log position this replica has replayed up to. It is only
+ * written under the replica's write lock, but the log writer reads it to
+ * know which slots it may reuse.
+ */
+struct replica {
+	pthread_rwlock_t lock;
+	_Atomic size_t applied;
+	struct hash_table_base *table;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct hash_table_replicated {
+	pthread_mutex_t log_mutex;
+	_Atomic size_t tail;
+	struct operation log[LOG_CAPACITY];
+	uint32_t replica_count;
+	struct replica *replicas;
+};
+
+struct hash_table_replicated *hash_table_replicated_create(uint32_t replicas)
+{
+	struct hash_table_replicated *hash_table = calloc(1, sizeof(struct hash_table_replicated));
+	assert(hash_table != NULL);
+	if (replicas == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		replicas = (cpus > 0) ? cpus : 1;
+	}
+	hash_table->replica_count = replicas;
+	hash_table->replicas = aligned_alloc(CACHE_LINE_SIZE, replicas * sizeof(struct replica));
+	assert(hash_table->replicas != NULL);
+	for (uint32_t i = 0; i < replicas; ++i) {
+		struct replica *replica = &hash_table->replicas[i];
+		int error = pthread_rwlock_init(&replica->lock, NULL);
+		if (error != 0) {
+			exit(error);
+		}
+		atomic_init(&replica->applied, 0);
+		replica->table = hash_table_base_create();
+	}
+	int error = pthread_mutex_init(&hash_table->log_mutex, NULL);
+	if (error != 0) {
+		exit(error);
+	}
+	return hash_table;
+}
+
+static struct replica *local_replica(struct hash_table_replicated *hash_table)
+{
+	static _Atomic uint32_t next_thread;
+	static _Thread_local int thread_slot = -1;
+
+	int cpu = sched_getcpu();
+	if (cpu < 0) {
+		/* No CPU number available, spread threads round-robin instead */
+		if (thread_slot < 0) {
+			thread_slot = atomic_fetch_add(&next_thread, 1);
+		}
+		cpu = thread_slot;
+	}
+	return &hash_table->replicas[cpu % hash_table->replica_count];
+}
+
+/* Replay the log into replica up to at least tail */
+static void sync_replica(struct hash_table_replicated *hash_table,
+                         struct replica *replica,
+                         size_t tail)
+{
+	int error = pthread_rwlock_wrlock(&replica->lock);
+	if (error != 0) {
+		exit(error);
+	}
+	size_t applied = atomic_load_explicit(&replica->applied, memory_order_relaxed);
+	for (; applied < tail; ++applied) {
+		struct operation *operation = &hash_table->log[applied % LOG_CAPACITY];
+		hash_table_base_add_entry(replica->table, operation->key, operation->value);
+	}
+	atomic_store_explicit(&replica->applied, applied, memory_order_release);
+	error = pthread_rwlock_unlock(&replica->lock);
+	if (error != 0) {
+		exit(error);
+	}
+}
+
+/* Returns the local replica, caught up with the log and read locked */
+static struct replica *read_lock_replica(struct hash_table_replicated *hash_table)
+{
+	struct replica *replica = local_replica(hash_table);
+	size_t tail = atomic_load_explicit(&hash_table->tail, memory_order_acquire);
+	if (atomic_load_explicit(&replica->applied, memory_order_acquire) < tail) {
+		sync_replica(hash_table, replica, tail);
+	}
+	int error = pthread_rwlock_rdlock(&replica->lock);
+	if (error != 0) {
+		exit(error);
+	}
+	return replica;
+}
+
+static void read_unlock_replica(struct replica *replica)
+{
+	int error = pthread_rwlock_unlock(&replica->lock);
+	if (error != 0) {
+		exit(error);
+	}
+}
+
+void hash_table_replicated_add_entry(struct hash_table_replicated *hash_table,
+                                     const char *key,
+                                     uint32_t value)
+{
+	int error = pthread_mutex_lock(&hash_table->log_mutex);
+	if (error != 0) {
+		exit(error);
+	}
+
+	size_t tail = atomic_load_explicit(&hash_table->tail, memory_order_relaxed);
+	/* The log is full, catch the lagging replicas up so their slots can be reused */
+	for (uint32_t i = 0; i < hash_table->replica_count; ++i) {
+		struct replica *replica = &hash_table->replicas[i];
+		if (tail - atomic_load_explicit(&replica->applied, memory_order_acquire) >= LOG_CAPACITY) {
+			sync_replica(hash_table, replica, tail);
+		}
+	}
+
+	struct operation *operation = &hash_table->log[tail % LOG_CAPACITY];
+	operation->key = key;
+	operation->value = value;
+	atomic_store_explicit(&hash_table->tail, tail + 1, memory_order_release);
+
+	error = pthread_mutex_unlock(&hash_table->log_mutex);
+	if (error != 0) {
+		exit(error);
+	}
+
+	sync_replica(hash_table, local_replica(hash_table), tail + 1);
+}
+
+bool hash_table_replicated_contains(struct hash_table_replicated *hash_table,
+                                    const char *key)
+{
+	struct replica *replica = read_lock_replica(hash_table);
+	bool found = hash_table_base_contains(replica->table, key);
+	read_unlock_replica(replica);
+	return found;
+}
+
+uint32_t hash_table_replicated_get_value(struct hash_table_replicated *hash_table,
+                                         const char *key)
+{
+	struct replica *replica = read_lock_replica(hash_table);
+	uint32_t value = hash_table_base_get_value(replica->table, key);
+	read_unlock_replica(replica);
+	return value;
+}
+
+size_t hash_table_replicated_size(struct hash_table_replicated *hash_table)
+{
+	struct replica *replica = read_lock_replica(hash_table);
+	size_t size = hash_table_base_size(replica->table);
+	read_unlock_replica(replica);
+	return size;
+}
+
+struct hash_table_frozen *hash_table_replicated_freeze(struct hash_table_replicated *hash_table)
+{
+	struct replica *replica = read_lock_replica(hash_table);
+	struct hash_table_frozen *frozen = hash_table_base_freeze(replica->table);
+	read_unlock_replica(replica);
+	return frozen;
+}
+
+void hash_table_replicated_destroy(struct hash_table_replicated *hash_table)
+{
+	for (uint32_t i = 0; i < hash_table->replica_count; ++i) {
+		struct replica *replica = &hash_table->replicas[i];
+		hash_table_base_destroy(replica->table);
+		int error = pthread_rwlock_destroy(&replica->lock);
+		if (error != 0) {
+			exit(error);
+		}
+	}
+	free(hash_table->replicas);
+	int error = pthread_mutex_destroy(&hash_table->log_mutex);
+	if (error != 0) {
+		exit(error);
+	}
+	free(hash_table);
+}
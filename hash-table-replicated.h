@@ -0,0 +1,27 @@
+#pragma once
+
+#include "hash-table-common.h"
+#include "hash-table-frozen.h"
+
+#include <stdbool.h>
+
+/*
+ * Read-mostly table keeping one private hash_table_base per CPU. Writers
+ * append to a shared operation log and every replica replays the log before
+ * it is read, so each write is applied once per replica (write
+ * amplification equals the replica count) while reads only touch the
+ * caller's local replica.
+ */
+struct hash_table_replicated;
+struct hash_table_replicated *hash_table_replicated_create(uint32_t replicas);
+void hash_table_replicated_add_entry(struct hash_table_replicated *hash_table,
+                                     const char *key,
+                                     uint32_t value);
+bool hash_table_replicated_contains(struct hash_table_replicated *hash_table,
+                                    const char *key);
+uint32_t hash_table_replicated_get_value(struct hash_table_replicated *hash_table,
+                                         const char* key);
+size_t hash_table_replicated_size(struct hash_table_replicated *hash_table);
+/* Copy the caller's replica, caught up with the log, into a hash_table_frozen */
+struct hash_table_frozen *hash_table_replicated_freeze(struct hash_table_replicated *hash_table);
+void hash_table_replicated_destroy(struct hash_table_replicated *hash_table);
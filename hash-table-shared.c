@@ -0,0 +1,312 @@
+#include "hash-table-shared.h"
+#include "hash-table-common.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SHARED_MAGIC 0x31304853454c4254ULL /* "TBLESH01" */
+
+/* Offset 0 is the header, so it doubles as the end of a chain */
+struct shared_entry {
+	uint64_t next;
+	_Atomic uint32_t value;
+	uint32_t hash;
+	char key[];
+};
+
+struct shared_bucket {
+	pthread_mutex_t mutex;
+	_Atomic uint64_t head;
+};
+
+/*
+ * The region starts with this header and the arena takes the rest. The
+ * magic is stored last by create, so attach can tell a table still being
+ * made from a finished one.
+ */
+struct hash_table_shared {
+	_Atomic uint64_t magic;
+	uint64_t length;
+	_Atomic uint64_t arena_next;
+	_Atomic uint64_t size;
+	_Atomic uint64_t recovered;
+	struct shared_bucket buckets[HASH_TABLE_CAPACITY];
+};
+
+static size_t round_up(size_t bytes)
+{
+	return (bytes + 7) & ~(size_t) 7;
+}
+
+static size_t entry_bytes(size_t length)
+{
+	return round_up(sizeof(struct shared_entry) + length + 1);
+}
+
+static struct shared_entry *get_entry(struct hash_table_shared *hash_table,
+                                      uint64_t offset)
+{
+	return (struct shared_entry *) ((char *) hash_table + offset);
+}
+
+size_t hash_table_shared_bytes_for(size_t size, size_t key_bytes)
+{
+	/* Each key also pays its NUL and up to 7 bytes of padding */
+	return round_up(sizeof(struct hash_table_shared))
+	       + size * (sizeof(struct shared_entry) + 8)
+	       + key_bytes;
+}
+
+static void init_bucket(struct shared_bucket *bucket)
+{
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	int error = pthread_mutex_init(&bucket->mutex, &attr);
+	if (error != 0) {
+		exit(error);
+	}
+	pthread_mutexattr_destroy(&attr);
+	atomic_init(&bucket->head, 0);
+}
+
+static struct hash_table_shared *map_region(int fd, size_t length)
+{
+	void *region = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	int error = errno;
+	close(fd);
+	if (region == MAP_FAILED) {
+		errno = error;
+		return NULL;
+	}
+	return region;
+}
+
+struct hash_table_shared *hash_table_shared_create(const char *name,
+                                                   size_t bytes)
+{
+	size_t length = round_up(sizeof(struct hash_table_shared));
+	if (bytes > length) {
+		length = bytes;
+	}
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0) {
+		return NULL;
+	}
+	if (ftruncate(fd, length) != 0) {
+		int error = errno;
+		close(fd);
+		shm_unlink(name);
+		errno = error;
+		return NULL;
+	}
+	struct hash_table_shared *hash_table = map_region(fd, length);
+	if (hash_table == NULL) {
+		int error = errno;
+		shm_unlink(name);
+		errno = error;
+		return NULL;
+	}
+	/* ftruncate zeroed the region, only the locks need setting up */
+	hash_table->length = length;
+	atomic_init(&hash_table->arena_next, round_up(sizeof(struct hash_table_shared)));
+	for (size_t i = 0; i < HASH_TABLE_CAPACITY; ++i) {
+		init_bucket(&hash_table->buckets[i]);
+	}
+	atomic_store_explicit(&hash_table->magic, SHARED_MAGIC, memory_order_release);
+	return hash_table;
+}
+
+struct hash_table_shared *hash_table_shared_attach(const char *name)
+{
+	int fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0) {
+		return NULL;
+	}
+	struct stat status;
+	if (fstat(fd, &status) != 0) {
+		int error = errno;
+		close(fd);
+		errno = error;
+		return NULL;
+	}
+	if ((size_t) status.st_size < sizeof(struct hash_table_shared)) {
+		close(fd);
+		errno = status.st_size == 0 ? EAGAIN : EBADMSG;
+		return NULL;
+	}
+	struct hash_table_shared *hash_table = map_region(fd, status.st_size);
+	if (hash_table == NULL) {
+		return NULL;
+	}
+	uint64_t magic = atomic_load_explicit(&hash_table->magic, memory_order_acquire);
+	if (magic != SHARED_MAGIC || hash_table->length != (uint64_t) status.st_size) {
+		munmap(hash_table, status.st_size);
+		errno = magic == 0 ? EAGAIN : EBADMSG;
+		return NULL;
+	}
+	return hash_table;
+}
+
+void hash_table_shared_detach(struct hash_table_shared *hash_table)
+{
+	munmap(hash_table, hash_table->length);
+}
+
+int hash_table_shared_unlink(const char *name)
+{
+	return shm_unlink(name) == 0 ? 0 : errno;
+}
+
+/*
+ * EOWNERDEAD means we hold the lock but its last owner died with it.
+ * Whatever it was doing either reached the store that publishes it or
+ * did not, so the chain is whole and the lock only needs marking
+ * consistent. A crash between linking an entry and counting it leaves
+ * size one short, and a crash after taking arena bytes leaks them.
+ */
+static struct shared_bucket *lock_bucket(struct hash_table_shared *hash_table,
+                                         uint32_t hash)
+{
+	struct shared_bucket *bucket = &hash_table->buckets[hash % HASH_TABLE_CAPACITY];
+	int error = pthread_mutex_lock(&bucket->mutex);
+	if (error == EOWNERDEAD) {
+		atomic_fetch_add_explicit(&hash_table->recovered, 1, memory_order_relaxed);
+		error = pthread_mutex_consistent(&bucket->mutex);
+	}
+	if (error != 0) {
+		exit(error);
+	}
+	return bucket;
+}
+
+static void unlock_bucket(struct shared_bucket *bucket)
+{
+	int error = pthread_mutex_unlock(&bucket->mutex);
+	if (error != 0) {
+		exit(error);
+	}
+}
+
+static struct shared_entry *find_entry(struct hash_table_shared *hash_table,
+                                       struct shared_bucket *bucket,
+                                       const char *key,
+                                       uint32_t hash)
+{
+	uint64_t offset = atomic_load_explicit(&bucket->head, memory_order_relaxed);
+	while (offset != 0) {
+		struct shared_entry *entry = get_entry(hash_table, offset);
+		if (entry->hash == hash && strcmp(entry->key, key) == 0) {
+			return entry;
+		}
+		offset = entry->next;
+	}
+	return NULL;
+}
+
+bool hash_table_shared_add_entry(struct hash_table_shared *hash_table,
+                                 const char *key,
+                                 uint32_t value)
+{
+	uint32_t hash = bernstein_hash(key);
+	struct shared_bucket *bucket = lock_bucket(hash_table, hash);
+	struct shared_entry *entry = find_entry(hash_table, bucket, key, hash);
+	if (entry != NULL) {
+		atomic_store_explicit(&entry->value, value, memory_order_relaxed);
+		unlock_bucket(bucket);
+		return true;
+	}
+
+	size_t length = strlen(key);
+	size_t bytes = entry_bytes(length);
+	/* Only take the bytes if they fit, so a refused insert leaves room for smaller ones */
+	uint64_t offset = atomic_load_explicit(&hash_table->arena_next, memory_order_relaxed);
+	do {
+		if (offset + bytes > hash_table->length) {
+			unlock_bucket(bucket);
+			return false;
+		}
+	} while (!atomic_compare_exchange_weak_explicit(&hash_table->arena_next, &offset, offset + bytes,
+	                                                memory_order_relaxed, memory_order_relaxed));
+	entry = get_entry(hash_table, offset);
+	entry->next = atomic_load_explicit(&bucket->head, memory_order_relaxed);
+	atomic_init(&entry->value, value);
+	entry->hash = hash;
+	memcpy(entry->key, key, length + 1);
+	atomic_store_explicit(&bucket->head, offset, memory_order_release);
+	atomic_fetch_add_explicit(&hash_table->size, 1, memory_order_relaxed);
+	unlock_bucket(bucket);
+	return true;
+}
+
+bool hash_table_shared_contains(struct hash_table_shared *hash_table,
+                                const char *key)
+{
+	uint32_t hash = bernstein_hash(key);
+	struct shared_bucket *bucket = lock_bucket(hash_table, hash);
+	struct shared_entry *entry = find_entry(hash_table, bucket, key, hash);
+	unlock_bucket(bucket);
+	return entry != NULL;
+}
+
+uint32_t hash_table_shared_get_value(struct hash_table_shared *hash_table,
+                                     const char *key)
+{
+	uint32_t hash = bernstein_hash(key);
+	struct shared_bucket *bucket = lock_bucket(hash_table, hash);
+	struct shared_entry *entry = find_entry(hash_table, bucket, key, hash);
+	assert(entry != NULL);
+	uint32_t value = atomic_load_explicit(&entry->value, memory_order_relaxed);
+	unlock_bucket(bucket);
+	return value;
+}
+
+size_t hash_table_shared_size(struct hash_table_shared *hash_table)
+{
+	return atomic_load_explicit(&hash_table->size, memory_order_relaxed);
+}
+
+struct hash_table_frozen *hash_table_shared_freeze(struct hash_table_shared *hash_table)
+{
+	size_t size = 0;
+	size_t key_bytes = 0;
+	for (size_t i = 0; i < HASH_TABLE_CAPACITY; ++i) {
+		struct shared_bucket *bucket = lock_bucket(hash_table, i);
+		uint64_t offset = atomic_load_explicit(&bucket->head, memory_order_relaxed);
+		for (; offset != 0; offset = get_entry(hash_table, offset)->next) {
+			++size;
+			key_bytes += strlen(get_entry(hash_table, offset)->key) + 1;
+		}
+	}
+	struct hash_table_frozen *frozen = hash_table_frozen_create(size, key_bytes);
+	for (size_t i = 0; i < HASH_TABLE_CAPACITY; ++i) {
+		struct shared_bucket *bucket = &hash_table->buckets[i];
+		uint64_t offset = atomic_load_explicit(&bucket->head, memory_order_relaxed);
+		for (; offset != 0; offset = get_entry(hash_table, offset)->next) {
+			struct shared_entry *entry = get_entry(hash_table, offset);
+			hash_table_frozen_insert(frozen, entry->key, entry->hash,
+			                         atomic_load_explicit(&entry->value, memory_order_relaxed));
+		}
+		unlock_bucket(bucket);
+	}
+	return frozen;
+}
+
+size_t hash_table_shared_bytes_used(struct hash_table_shared *hash_table)
+{
+	return atomic_load_explicit(&hash_table->arena_next, memory_order_relaxed);
+}
+
+size_t hash_table_shared_recovered(struct hash_table_shared *hash_table)
+{
+	return atomic_load_explicit(&hash_table->recovered, memory_order_relaxed);
+}
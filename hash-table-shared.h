@@ -0,0 +1,64 @@
+#pragma once
+
+#include "hash-table-frozen.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A v2-style table (a lock per bucket, chains of entries) that lives
+ * entirely in one POSIX shared memory object, so every process that
+ * attaches by name sees and updates the same table. Each process maps
+ * the region wherever mmap puts it, so chains link by offset from the
+ * start of the region, never by pointer, and entries come from a bump
+ * arena inside the region. The region is fixed at create: entries are
+ * never freed, and an insert that does not fit is refused.
+ *
+ * Bucket locks are process-shared robust mutexes. An entry is written in
+ * full before one store links it into its chain, and an update is one
+ * store of the value, so a chain is never half changed: when a process
+ * dies holding a bucket lock, the next process to take it marks it
+ * consistent and carries on.
+ */
+struct hash_table_shared;
+
+/* Bytes of region needed for size keys totalling key_bytes without NULs */
+size_t hash_table_shared_bytes_for(size_t size, size_t key_bytes);
+
+/*
+ * Creates the shared memory object name (see shm_open), bytes long, and
+ * attaches to it. Returns NULL with errno set, EEXIST if name is taken.
+ */
+struct hash_table_shared *hash_table_shared_create(const char *name,
+                                                   size_t bytes);
+/*
+ * Attaches to a table made by hash_table_shared_create. Returns NULL with
+ * errno set, EBADMSG if name is not a table, EAGAIN if it is still being
+ * made.
+ */
+struct hash_table_shared *hash_table_shared_attach(const char *name);
+/* Unmaps the table from this process, it lives on for the others */
+void hash_table_shared_detach(struct hash_table_shared *hash_table);
+/*
+ * Removes name at once, so no process can attach by it any more. The table
+ * itself lives on until every process has detached. Returns 0 or an errno
+ * value.
+ */
+int hash_table_shared_unlink(const char *name);
+
+/* Returns false if the region has no room left for the entry */
+bool hash_table_shared_add_entry(struct hash_table_shared *hash_table,
+                                 const char *key,
+                                 uint32_t value);
+bool hash_table_shared_contains(struct hash_table_shared *hash_table,
+                                const char *key);
+uint32_t hash_table_shared_get_value(struct hash_table_shared *hash_table,
+                                     const char *key);
+size_t hash_table_shared_size(struct hash_table_shared *hash_table);
+/* Copy the current contents into a hash_table_frozen private to this process */
+struct hash_table_frozen *hash_table_shared_freeze(struct hash_table_shared *hash_table);
+/* Arena bytes handed out so far */
+size_t hash_table_shared_bytes_used(struct hash_table_shared *hash_table);
+/* How many bucket locks were taken over from processes that died holding them */
+size_t hash_table_shared_recovered(struct hash_table_shared *hash_table);
@@ -0,0 +1,293 @@
+#include "hash-table-snapshot.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLYNOMIAL 0x82f63b78
+
+static uint32_t crc32c_table[256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void init_crc32c_table(void)
+{
+	for (uint32_t i = 0; i < 256; ++i) {
+		uint32_t crc = i;
+		for (int bit = 0; bit < 8; ++bit) {
+			crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLYNOMIAL : 0);
+		}
+		crc32c_table[i] = crc;
+	}
+}
+
+static uint32_t crc32c_software(uint32_t crc, const uint8_t *data, size_t length)
+{
+	pthread_once(&crc32c_once, init_crc32c_table);
+	for (size_t i = 0; i < length; ++i) {
+		crc = (crc >> 8) ^ crc32c_table[(crc ^ data[i]) & 0xff];
+	}
+	return crc;
+}
+
+#if defined(__x86_64__)
+/* SSE4.2 has a CRC32C instruction, eight bytes at a time */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hardware(uint32_t crc, const uint8_t *data, size_t length)
+{
+	uint64_t crc64 = crc;
+	for (; length >= 8; data += 8, length -= 8) {
+		uint64_t word;
+		memcpy(&word, data, sizeof(word));
+		crc64 = _mm_crc32_u64(crc64, word);
+	}
+	crc = crc64;
+	for (; length > 0; ++data, --length) {
+		crc = _mm_crc32_u8(crc, *data);
+	}
+	return crc;
+}
+#endif
+
+uint32_t hash_table_crc32c(uint32_t crc, const void *data, size_t length)
+{
+	crc = ~crc;
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("sse4.2")) {
+		return ~crc32c_hardware(crc, data, length);
+	}
+#endif
+	return ~crc32c_software(crc, data, length);
+}
+
+static int pwrite_all(int fd, const void *data, size_t length, off_t offset)
+{
+	const char *bytes = data;
+	while (length > 0) {
+		ssize_t written = pwrite(fd, bytes, length, offset);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return errno;
+		}
+		bytes += written;
+		length -= written;
+		offset += written;
+	}
+	return 0;
+}
+
+static int pread_all(int fd, void *data, size_t length, off_t offset)
+{
+	char *bytes = data;
+	while (length > 0) {
+		ssize_t nread = pread(fd, bytes, length, offset);
+		if (nread < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return errno;
+		}
+		if (nread == 0) {
+			return EBADMSG;
+		}
+		bytes += nread;
+		length -= nread;
+		offset += nread;
+	}
+	return 0;
+}
+
+struct write_job {
+	int fd;
+	struct hash_table_snapshot_segment *segments;
+	void **buffers;
+	_Atomic int error;
+};
+
+static void write_segment(void *context, uint32_t i)
+{
+	struct write_job *job = context;
+	struct hash_table_snapshot_segment *segment = &job->segments[i];
+	int error = pwrite_all(job->fd, job->buffers[i], segment->length, segment->offset);
+	if (error != 0) {
+		atomic_store(&job->error, error);
+	}
+}
+
+static void checksum_segment(void *context, uint32_t i)
+{
+	struct write_job *job = context;
+	struct hash_table_snapshot_segment *segment = &job->segments[i];
+	segment->crc = hash_table_crc32c(0, job->buffers[i], segment->length);
+}
+
+int hash_table_sync_directory(const char *path)
+{
+	char *directory = strdup(path);
+	assert(directory != NULL);
+	char *slash = strrchr(directory, '/');
+	if (slash == NULL) {
+		strcpy(directory, ".");
+	}
+	else {
+		slash[slash == directory] = '\0';
+	}
+	int fd = open(directory, O_RDONLY | O_DIRECTORY);
+	free(directory);
+	if (fd < 0) {
+		return errno;
+	}
+	int error = fsync(fd) == 0 ? 0 : errno;
+	close(fd);
+	return error;
+}
+
+int hash_table_snapshot_write(const char *path,
+                              uint64_t entry_count,
+                              struct hash_table_snapshot_segment *segments,
+                              void **buffers,
+                              uint32_t threads)
+{
+	size_t descriptors_length = HASH_TABLE_SNAPSHOT_SEGMENTS * sizeof(struct hash_table_snapshot_segment);
+	uint64_t offset = sizeof(struct hash_table_snapshot_header) + descriptors_length;
+	for (uint32_t i = 0; i < HASH_TABLE_SNAPSHOT_SEGMENTS; ++i) {
+		segments[i].offset = offset;
+		offset += segments[i].length;
+		offset = (offset + HASH_TABLE_SNAPSHOT_ALIGNMENT - 1) & ~(uint64_t) (HASH_TABLE_SNAPSHOT_ALIGNMENT - 1);
+	}
+	struct write_job job = { .segments = segments, .buffers = buffers };
+	hash_table_parallel(HASH_TABLE_SNAPSHOT_SEGMENTS, threads, checksum_segment, &job);
+
+	struct hash_table_snapshot_header header = {
+		.magic = HASH_TABLE_SNAPSHOT_MAGIC,
+		.version = HASH_TABLE_SNAPSHOT_VERSION,
+		.segment_count = HASH_TABLE_SNAPSHOT_SEGMENTS,
+		.entry_count = entry_count,
+		.crc = hash_table_crc32c(0, segments, descriptors_length),
+	};
+
+	size_t temporary_length = strlen(path) + sizeof(".tmp");
+	char *temporary = malloc(temporary_length);
+	assert(temporary != NULL);
+	snprintf(temporary, temporary_length, "%s.tmp", path);
+	job.fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (job.fd < 0) {
+		int error = errno;
+		free(temporary);
+		return error;
+	}
+	int error = ftruncate(job.fd, offset) == 0 ? 0 : errno;
+	if (error == 0) {
+		hash_table_parallel(HASH_TABLE_SNAPSHOT_SEGMENTS, threads, write_segment, &job);
+		error = atomic_load(&job.error);
+	}
+	/* The header goes last so a torn save never looks complete */
+	if (error == 0) {
+		error = pwrite_all(job.fd, segments, descriptors_length, sizeof(header));
+	}
+	if (error == 0) {
+		error = pwrite_all(job.fd, &header, sizeof(header), 0);
+	}
+	if (error == 0 && fsync(job.fd) != 0) {
+		error = errno;
+	}
+	if (close(job.fd) != 0 && error == 0) {
+		error = errno;
+	}
+	/* Only a complete, durable file replaces the previous one */
+	if (error == 0 && rename(temporary, path) != 0) {
+		error = errno;
+	}
+	if (error != 0) {
+		unlink(temporary);
+	}
+	else {
+		error = hash_table_sync_directory(path);
+	}
+	free(temporary);
+	return error;
+}
+
+struct read_job {
+	int fd;
+	char *contents;
+	const struct hash_table_snapshot_segment *segments;
+	_Atomic int error;
+};
+
+static void read_segment(void *context, uint32_t i)
+{
+	struct read_job *job = context;
+	const struct hash_table_snapshot_segment *segment = &job->segments[i];
+	char *data = job->contents + segment->offset;
+	int error = pread_all(job->fd, data, segment->length, segment->offset);
+	if (error == 0 && hash_table_crc32c(0, data, segment->length) != segment->crc) {
+		error = EBADMSG;
+	}
+	if (error != 0) {
+		atomic_store(&job->error, error);
+	}
+}
+
+void *hash_table_snapshot_read(const char *path, uint32_t threads)
+{
+	struct read_job job = { .fd = open(path, O_RDONLY) };
+	if (job.fd < 0) {
+		return NULL;
+	}
+	struct stat status;
+	int error = fstat(job.fd, &status) == 0 ? 0 : errno;
+	size_t prefix_length = sizeof(struct hash_table_snapshot_header)
+	                       + HASH_TABLE_SNAPSHOT_SEGMENTS * sizeof(struct hash_table_snapshot_segment);
+	if (error == 0 && (size_t) status.st_size < prefix_length) {
+		error = EBADMSG;
+	}
+	if (error == 0) {
+		job.contents = malloc(status.st_size);
+		assert(job.contents != NULL);
+		error = pread_all(job.fd, job.contents, prefix_length, 0);
+	}
+
+	if (error == 0) {
+		const struct hash_table_snapshot_header *header = (const void *) job.contents;
+		job.segments = (const void *) (header + 1);
+		if (header->magic != HASH_TABLE_SNAPSHOT_MAGIC
+		    || header->version != HASH_TABLE_SNAPSHOT_VERSION
+		    || header->segment_count != HASH_TABLE_SNAPSHOT_SEGMENTS
+		    || header->crc != hash_table_crc32c(0, job.segments, prefix_length - sizeof(*header))) {
+			error = EBADMSG;
+		}
+		for (uint32_t i = 0; error == 0 && i < HASH_TABLE_SNAPSHOT_SEGMENTS; ++i) {
+			const struct hash_table_snapshot_segment *segment = &job.segments[i];
+			if (segment->offset < prefix_length
+			    || segment->offset % HASH_TABLE_SNAPSHOT_ALIGNMENT != 0
+			    || segment->offset > (uint64_t) status.st_size
+			    || segment->length > (uint64_t) status.st_size - segment->offset) {
+				error = EBADMSG;
+			}
+		}
+	}
+	if (error == 0) {
+		hash_table_parallel(HASH_TABLE_SNAPSHOT_SEGMENTS, threads, read_segment, &job);
+		error = atomic_load(&job.error);
+	}
+	close(job.fd);
+	if (error != 0) {
+		free(job.contents);
+		errno = error;
+		return NULL;
+	}
+	return job.contents;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "hash-table-common.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HASH_TABLE_SNAPSHOT_MAGIC 0x31304e5348534148ULL /* "HASHSN01" */
+#define HASH_TABLE_SNAPSHOT_VERSION 2
+/* Each segment covers HASH_TABLE_CAPACITY / HASH_TABLE_SNAPSHOT_SEGMENTS buckets */
+#define HASH_TABLE_SNAPSHOT_SEGMENTS 64
+#define HASH_TABLE_SNAPSHOT_ALIGNMENT 8
+
+/*
+ * On-disk layout, in native byte order: the header, the segment
+ * descriptors, then the segments. A segment holds the entries of one
+ * bucket range as entry_count records followed by the NUL-terminated keys
+ * they point into. Segments start at multiples of
+ * HASH_TABLE_SNAPSHOT_ALIGNMENT, so their records can be read in place;
+ * the gap after a segment is zero and not covered by its length. crc in
+ * the header covers the descriptors, each descriptor's crc covers its
+ * segment; both are CRC32C.
+ */
+struct hash_table_snapshot_header {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t segment_count;
+	uint64_t entry_count;
+	uint32_t crc;
+	uint32_t reserved;
+};
+
+struct hash_table_snapshot_segment {
+	uint64_t offset;
+	uint64_t length;
+	uint32_t begin;
+	uint32_t end;
+	uint32_t entry_count;
+	uint32_t crc;
+};
+
+/* key_offset is from the start of the segment */
+struct hash_table_snapshot_record {
+	uint32_t hash;
+	uint32_t value;
+	uint32_t key_offset;
+};
+
+uint32_t hash_table_crc32c(uint32_t crc, const void *data, size_t length);
+/* fsyncs the directory holding path, so a new name in it is durable. Returns 0 or an errno value. */
+int hash_table_sync_directory(const char *path);
+
+/*
+ * Fills in the descriptors' offsets and checksums and writes the file, one
+ * pwrite per segment. The file is written and synced as path.tmp, then
+ * renamed over path, so a failed or interrupted save leaves the previous
+ * file in place. Returns 0 or an errno value.
+ */
+int hash_table_snapshot_write(const char *path,
+                              uint64_t entry_count,
+                              struct hash_table_snapshot_segment *segments,
+                              void **buffers,
+                              uint32_t threads);
+/*
+ * Reads the whole file with one pread per segment and checks every
+ * checksum. Returns the file contents, header first, or NULL with errno
+ * set (EBADMSG if the file is corrupt).
+ */
+void *hash_table_snapshot_read(const char *path, uint32_t threads);
@@ -1,255 +1,2320 @@
-#include "hash-table-base.h"
-#include "hash-table-v1.h"
-#include "hash-table-v2.h"
-
-#include <argp.h>
-#include <locale.h>
-#include <pthread.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <sys/time.h>
-
-char *entries;
-
-void (*add_entry)(void *, const char *key, uint32_t value);
-
-#define BYTES_PER_STRING 8
-
-struct arguments {
-	uint32_t threads;
-	uint32_t size;
-};
-
-static struct argp_option options[] = { 
-	{ "threads", 't', "NUM", 0, "Number of threads."},
-	{ "size", 's', "NUM", 0, "Size per thread."},
-	{ 0 } 
-};
-
-static uint32_t parse_uint32_t(const char *string) {
-	uint32_t current = 0;
-	uint8_t i = 0;
-	while (true) {
-		char c = string[i];
-		if (c == 0) {
-			break;
-		}
-
-		/* Definitely greater than UINT32_MAX */
-		if (i == 10) {
-			exit(EINVAL);
-		}
-
-		/* Ensure the character is a digit */
-		if (c < 0x30 || c > 0x39) {
-			exit(EINVAL);
-		}
-
-		uint8_t digit = (c - 0x30);
-
-		/* Check for overflows */
-		if (i == 9) {
-			if (current > 429496729) {
-				exit(EINVAL);
-			}
-			else if (current == 429496729 && digit > 5) {
-				exit(EINVAL);
-			}
-		}
-
-		current = current * 10 + digit;
-
-		++i;
-	}
-	return current;
-}
-
-static error_t parse_opt(int key, char *arg, struct argp_state *state) {
-	struct arguments *arguments = state->input;
-	switch (key) {
-	case 't':
-		arguments->threads = parse_uint32_t(arg);
-		break;
-	case 's':
-		arguments->size = parse_uint32_t(arg);
-		break;
-	}   
-	return 0;
-}
-
-static struct arguments arguments;
-static char *data;
-
-static size_t get_global_index(uint32_t thread, uint32_t index)
-{
-	return thread * arguments.size + index;
-}
-
-static char *get_string(size_t global_index)
-{
-	return data + (global_index * BYTES_PER_STRING);
-}
-
-static unsigned long usec_diff(struct timeval *a, struct timeval *b)
-{
-	unsigned long usec;
-	usec = (b->tv_sec - a->tv_sec)*1000000;
-	usec += b->tv_usec - a->tv_usec;
-	return usec;
-}
-
-static struct hash_table_v1 *hash_table_v1;
-
-void *run_v1(void *arg) {
-	uint32_t thread = (uintptr_t) arg;
-	for (uint32_t j = 0; j < arguments.size; ++j) {
-		size_t global_index = get_global_index(thread, j);
-		char *string = get_string(global_index);
-		hash_table_v1_add_entry(hash_table_v1, string, global_index);
-	}
-	return NULL;
-}
-
-static struct hash_table_v2 *hash_table_v2;
-
-void *run_v2(void *arg) {
-	uint32_t thread = (uintptr_t) arg;
-	for (uint32_t j = 0; j < arguments.size; ++j) {
-		size_t global_index = get_global_index(thread, j);
-		char *string = get_string(global_index);
-		hash_table_v2_add_entry(hash_table_v2, string, global_index);
-	}
-	return NULL;
-}
-
-int main(int argc, char *argv[])
-{
-	arguments.threads = 4;
-	arguments.size = 25000;
-  
-	static struct argp argp = { options, parse_opt };
-	argp_parse(&argp, argc, argv, 0, 0, &arguments);
-
-	setlocale(LC_ALL, "en_US.UTF-8");
-
-	data = calloc(arguments.threads * arguments.size, BYTES_PER_STRING);
-
-	struct timeval start, end;
-
-	gettimeofday(&start, NULL);
-	srand(42);
-	for (uint32_t i = 0; i < arguments.threads; ++i) {
-		for (uint32_t j = 0; j < arguments.size; ++j) {
-			size_t global_index = get_global_index(i, j);
-			char *string = get_string(global_index);
-			for (uint32_t k = 0; k < (BYTES_PER_STRING - 1); ++k) {
-				int r = rand() % 52;
-				if (r < 26) {
-					string[k] = r + 0x41;
-				}
-				else {
-					string[k] = r + 0x47;
-				}
-			}
-			string[BYTES_PER_STRING - 1] = 0;
-		}
-	}
-	gettimeofday(&end, NULL);
-	printf("Generation: %'lu usec\n", usec_diff(&start, &end));
-
-	struct hash_table_base *hash_table_base = hash_table_base_create();
-	gettimeofday(&start, NULL);
-	for (uint32_t i = 0; i < arguments.threads; ++i) {
-		for (uint32_t j = 0; j < arguments.size; ++j) {
-			size_t global_index = get_global_index(i, j);
-			char *string = get_string(global_index);
-			hash_table_base_add_entry(hash_table_base, string, global_index);
-		}
-	}
-	gettimeofday(&end, NULL);
-	printf("Hash table base: %'lu usec\n", usec_diff(&start, &end));
-
-	size_t missing = 0;
-	for (uint32_t i = 0; i < arguments.threads; ++i) {
-		for (uint32_t j = 0; j < arguments.size; ++j) {
-			size_t global_index = get_global_index(i, j);
-			char *string = get_string(global_index);
-			if (!hash_table_base_contains(hash_table_base, string)) {
-				++missing;
-			}
-		}
-	}
-	printf("  - %'lu missing\n", missing);
-	hash_table_base_destroy(hash_table_base);
-
-	pthread_t *threads = calloc(arguments.threads, sizeof(pthread_t));
-
-	hash_table_v1 = hash_table_v1_create();
-	gettimeofday(&start, NULL);
-	for (uintptr_t i = 0; i < arguments.threads; ++i) {
-		int err = pthread_create(&threads[i], NULL, run_v1, (void*) i);
-		if (err != 0) {
-			printf("pthread_create returned %d\n", err);
-			return err;
-		}
-	}
-	for (uintptr_t i = 0; i < arguments.threads; ++i) {
-		int err = pthread_join(threads[i], NULL);
-		if (err != 0) {
-			printf("pthread_join returned %d\n", err);
-			return err;
-		}
-	}
-	gettimeofday(&end, NULL);
-	printf("Hash table v1: %'lu usec\n", usec_diff(&start, &end));
-
-	missing = 0;
-	for (uint32_t i = 0; i < arguments.threads; ++i) {
-		for (uint32_t j = 0; j < arguments.size; ++j) {
-			size_t global_index = get_global_index(i, j);
-			char *string = get_string(global_index);
-			if (!hash_table_v1_contains(hash_table_v1, string)) {
-				++missing;
-			}
-		}
-	}
-	printf("  - %'lu missing\n", missing);
-	hash_table_v1_destroy(hash_table_v1);
-
-	hash_table_v2 = hash_table_v2_create();
-	gettimeofday(&start, NULL);
-	for (uintptr_t i = 0; i < arguments.threads; ++i) {
-		int err = pthread_create(&threads[i], NULL, run_v2, (void*) i);
-		if (err != 0) {
-			printf("pthread_create returned %d\n", err);
-			return err;
-		}
-	}
-	for (uintptr_t i = 0; i < arguments.threads; ++i) {
-		int err = pthread_join(threads[i], NULL);
-		if (err != 0) {
-			printf("pthread_join returned %d\n", err);
-			return err;
-		}
-	}
-	gettimeofday(&end, NULL);
-	printf("Hash table v2: %'lu usec\n", usec_diff(&start, &end));
-
-	missing = 0;
-	for (uint32_t i = 0; i < arguments.threads; ++i) {
-		for (uint32_t j = 0; j < arguments.size; ++j) {
-			size_t global_index = get_global_index(i, j);
-			char *string = get_string(global_index);
-			if (!hash_table_v2_contains(hash_table_v2, string)) {
-				++missing;
-			}
-		}
-	}
-	printf("  - %'lu missing\n", missing);
-	hash_table_v2_destroy(hash_table_v2);
-
-	free(threads);
-	free(data);
-
-	return 0;
-}
+#include "hash-table-base.h"
+#include "hash-table-extendible.h"
+#include "hash-table-hlog.h"
+#include "hash-table-linear.h"
+#include "hash-table-mphf.h"
+#include "hash-table-replicated.h"
+#include "hash-table-shared.h"
+#include "hash-table-tiered.h"
+#include "hash-table-v1.h"
+#include "hash-table-v2.h"
+#include "hash-table-vlog.h"
+
+#include <argp.h>
+#include <errno.h>
+#include <limits.h>
+#include <locale.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+char *entries;
+
+void (*add_entry)(void *, const char *key, uint32_t value);
+
+#define BYTES_PER_STRING 8
+
+struct arguments {
+	uint32_t threads;
+	uint32_t size;
+	bool destroy;
+	bool extendible;
+	bool linear;
+	bool replicated;
+	bool mphf;
+	bool shared;
+	bool tiered;
+	bool vlog;
+	bool hlog;
+	bool skewed;
+	bool compact;
+	bool freeze;
+	bool reserve;
+	bool arena;
+	bool versioned;
+	bool empty;
+	const char *snapshot;
+	const char *mapped;
+	const char *wal;
+	const char *fork;
+	const char *checkpoint;
+};
+
+static struct argp_option options[] = { 
+	{ "threads", 't', "NUM", 0, "Number of threads."},
+	{ "size", 's', "NUM", 0, "Size per thread."},
+	{ "destroy", 'd', 0, 0, "Report background destroy time."},
+	{ "skewed", 'z', 0, 0, "Time a skewed read workload on v2."},
+	{ "compact", 'c', 0, 0, "Time v2 lookups before and after compaction."},
+	{ "freeze", 'f', 0, 0, "Time lookups on a frozen copy of v2."},
+	{ "reserve", 'r', 0, 0, "Compare v2 insert tail latency with and without a reservation."},
+	{ "arena", 'a', 0, 0, "Also run v2 on a bump arena that is freed in one call."},
+	{ "versioned", 'v', 0, 0, "Check versioned v2 snapshot reads against concurrent writers."},
+	{ "empty", 'e', 0, 0, "Report what an empty base and v2 table allocate, against a budget."},
+	{ "snapshot", 'p', "PATH", 0, "Save v2 to PATH and load it back."},
+	{ "mapped", 'm', "PATH", 0, "Write a frozen copy of v2 to PATH and query it through mmap."},
+	{ "checkpoint", 'i', "PATH", 0, "Save v2 to PATH, then checkpoint small updates next to it and merge them."},
+	{ "fork", 'k', "PATH", 0, "Snapshot v2 to PATH from a forked child while updating it."},
+	{ "wal", 'w', "PATH", 0, "Time durable v2 inserts logged to PATH at 1 to 64 threads."},
+	{ "extra", 'x', "NAME", 0, "Also run the named table: extendible, linear, replicated, mphf, shared, tiered, vlog, hlog."},
+	{ 0 } 
+};
+
+static uint32_t parse_uint32_t(const char *string) {
+	uint32_t current = 0;
+	uint8_t i = 0;
+	while (true) {
+		char c = string[i];
+		if (c == 0) {
+			break;
+		}
+
+		/* Definitely greater than UINT32_MAX */
+		if (i == 10) {
+			exit(EINVAL);
+		}
+
+		/* Ensure the character is a digit */
+		if (c < 0x30 || c > 0x39) {
+			exit(EINVAL);
+		}
+
+		uint8_t digit = (c - 0x30);
+
+		/* Check for overflows */
+		if (i == 9) {
+			if (current > 429496729) {
+				exit(EINVAL);
+			}
+			else if (current == 429496729 && digit > 5) {
+				exit(EINVAL);
+			}
+		}
+
+		current = current * 10 + digit;
+
+		++i;
+	}
+	return current;
+}
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state) {
+	struct arguments *arguments = state->input;
+	switch (key) {
+	case 't':
+		arguments->threads = parse_uint32_t(arg);
+		break;
+	case 's':
+		arguments->size = parse_uint32_t(arg);
+		break;
+	case 'd':
+		arguments->destroy = true;
+		break;
+	case 'z':
+		arguments->skewed = true;
+		break;
+	case 'c':
+		arguments->compact = true;
+		break;
+	case 'f':
+		arguments->freeze = true;
+		break;
+	case 'r':
+		arguments->reserve = true;
+		break;
+	case 'a':
+		arguments->arena = true;
+		break;
+	case 'v':
+		arguments->versioned = true;
+		break;
+	case 'e':
+		arguments->empty = true;
+		break;
+	case 'p':
+		arguments->snapshot = arg;
+		break;
+	case 'm':
+		arguments->mapped = arg;
+		break;
+	case 'k':
+		arguments->fork = arg;
+		break;
+	case 'i':
+		arguments->checkpoint = arg;
+		break;
+	case 'w':
+		arguments->wal = arg;
+		break;
+	case 'x':
+		if (strcmp(arg, "extendible") == 0) {
+			arguments->extendible = true;
+		}
+		else if (strcmp(arg, "linear") == 0) {
+			arguments->linear = true;
+		}
+		else if (strcmp(arg, "replicated") == 0) {
+			arguments->replicated = true;
+		}
+		else if (strcmp(arg, "mphf") == 0) {
+			arguments->mphf = true;
+		}
+		else if (strcmp(arg, "shared") == 0) {
+			arguments->shared = true;
+		}
+		else if (strcmp(arg, "tiered") == 0) {
+			arguments->tiered = true;
+		}
+		else if (strcmp(arg, "vlog") == 0) {
+			arguments->vlog = true;
+		}
+		else if (strcmp(arg, "hlog") == 0) {
+			arguments->hlog = true;
+		}
+		else {
+			argp_error(state, "unknown table '%s'", arg);
+		}
+		break;
+	}   
+	return 0;
+}
+
+static struct arguments arguments;
+static char *data;
+
+static size_t get_global_index(uint32_t thread, uint32_t index)
+{
+	return thread * arguments.size + index;
+}
+
+static char *get_string(size_t global_index)
+{
+	return data + (global_index * BYTES_PER_STRING);
+}
+
+static unsigned long usec_diff(struct timeval *a, struct timeval *b)
+{
+	unsigned long usec;
+	usec = (b->tv_sec - a->tv_sec)*1000000;
+	usec += b->tv_usec - a->tv_usec;
+	return usec;
+}
+
+static void print_destroy(struct timeval *start)
+{
+	struct timeval detach, end;
+	gettimeofday(&detach, NULL);
+	hash_table_destroy_wait();
+	gettimeofday(&end, NULL);
+	printf("  - %'lu usec destroy (%'lu usec to detach)\n",
+	       usec_diff(start, &end), usec_diff(start, &detach));
+}
+
+static struct hash_table_v1 *hash_table_v1;
+
+void *run_v1(void *arg) {
+	uint32_t thread = (uintptr_t) arg;
+	for (uint32_t j = 0; j < arguments.size; ++j) {
+		size_t global_index = get_global_index(thread, j);
+		char *string = get_string(global_index);
+		hash_table_v1_add_entry(hash_table_v1, string, global_index);
+	}
+	return NULL;
+}
+
+static struct hash_table_v2 *hash_table_v2;
+
+void *run_v2(void *arg) {
+	uint32_t thread = (uintptr_t) arg;
+	for (uint32_t j = 0; j < arguments.size; ++j) {
+		size_t global_index = get_global_index(thread, j);
+		char *string = get_string(global_index);
+		hash_table_v2_add_entry(hash_table_v2, string, global_index);
+	}
+	return NULL;
+}
+
+static int run_threads(pthread_t *threads, void *(*run)(void *))
+{
+	for (uintptr_t i = 0; i < arguments.threads; ++i) {
+		int err = pthread_create(&threads[i], NULL, run, (void*) i);
+		if (err != 0) {
+			printf("pthread_create returned %d\n", err);
+			return err;
+		}
+	}
+	for (uintptr_t i = 0; i < arguments.threads; ++i) {
+		int err = pthread_join(threads[i], NULL);
+		if (err != 0) {
+			printf("pthread_join returned %d\n", err);
+			return err;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Skewed reads: 80% of lookups go to the hottest 1% of keys, the rest are
+ * spread over every key.
+ */
+static uint32_t *skewed;
+
+static void generate_skewed(void)
+{
+	size_t total = (size_t) arguments.threads * arguments.size;
+	size_t hot = (total / 100 > 0) ? total / 100 : 1;
+	skewed = calloc(total, sizeof(uint32_t));
+	for (size_t i = 0; i < total; ++i) {
+		if (rand() % 100 < 80) {
+			skewed[i] = rand() % hot;
+		}
+		else {
+			skewed[i] = rand() % total;
+		}
+	}
+}
+
+void *read_v2_skewed(void *arg) {
+	uint32_t thread = (uintptr_t) arg;
+	for (uint32_t j = 0; j < arguments.size; ++j) {
+		char *string = get_string(skewed[get_global_index(thread, j)]);
+		hash_table_v2_get_value(hash_table_v2, string);
+	}
+	return NULL;
+}
+
+void *read_v2_skewed_cached(void *arg) {
+	uint32_t thread = (uintptr_t) arg;
+	for (uint32_t j = 0; j < arguments.size; ++j) {
+		char *string = get_string(skewed[get_global_index(thread, j)]);
+		hash_table_v2_get_value_cached(hash_table_v2, string);
+	}
+	return NULL;
+}
+
+static double average_skewed_depth(void)
+{
+	size_t total = (size_t) arguments.threads * arguments.size;
+	size_t depth = 0;
+	for (size_t i = 0; i < total; ++i) {
+		depth += hash_table_v2_chain_depth(hash_table_v2, get_string(skewed[i]));
+	}
+	return (double) depth / total;
+}
+
+static int test_v2_skewed(pthread_t *threads)
+{
+	struct timeval start, end;
+
+	generate_skewed();
+	gettimeofday(&start, NULL);
+	int err = run_threads(threads, read_v2_skewed);
+	if (err != 0) {
+		return err;
+	}
+	gettimeofday(&end, NULL);
+	printf("  - %'lu usec skewed reads\n", usec_diff(&start, &end));
+
+	gettimeofday(&start, NULL);
+	err = run_threads(threads, read_v2_skewed_cached);
+	if (err != 0) {
+		return err;
+	}
+	gettimeofday(&end, NULL);
+	printf("  - %'lu usec skewed reads (cached)\n", usec_diff(&start, &end));
+
+	double depth = average_skewed_depth();
+	hash_table_v2_set_chain_policy(hash_table_v2, HASH_TABLE_CHAIN_MOVE_TO_FRONT);
+	gettimeofday(&start, NULL);
+	err = run_threads(threads, read_v2_skewed);
+	if (err != 0) {
+		return err;
+	}
+	gettimeofday(&end, NULL);
+	hash_table_v2_set_chain_policy(hash_table_v2, HASH_TABLE_CHAIN_FIXED);
+	printf("  - %'lu usec skewed reads (move-to-front)\n", usec_diff(&start, &end));
+	printf("  - %.2f average hit chain position, %.2f after move-to-front\n", depth, average_skewed_depth());
+	free(skewed);
+	return 0;
+}
+
+void *read_v2(void *arg) {
+	uint32_t thread = (uintptr_t) arg;
+	for (uint32_t j = 0; j < arguments.size; ++j) {
+		size_t global_index = get_global_index(thread, j);
+		char *string = get_string(global_index);
+		hash_table_v2_get_value(hash_table_v2, string);
+	}
+	return NULL;
+}
+
+void *compact_v2(void *arg) {
+	uint32_t thread = (uintptr_t) arg;
+	size_t step = (HASH_TABLE_CAPACITY + arguments.threads - 1) / arguments.threads;
+	hash_table_v2_compact(hash_table_v2, thread * step, (thread + 1) * step);
+	return NULL;
+}
+
+static int test_v2_compact(pthread_t *threads)
+{
+	struct timeval start, end;
+
+	gettimeofday(&start, NULL);
+	int err = run_threads(threads, read_v2);
+	if (err != 0) {
+		return err;
+	}
+	gettimeofday(&end, NULL);
+	printf("  - %'lu usec lookups\n", usec_diff(&start, &end));
+
+	gettimeofday(&start, NULL);
+	err = run_threads(threads, compact_v2);
+	if (err != 0) {
+		return err;
+	}
+	gettimeofday(&end, NULL);
+	printf("  - %'lu usec compaction\n", usec_diff(&start, &end));
+
+	gettimeofday(&start, NULL);
+	err = run_threads(threads, read_v2);
+	if (err != 0) {
+		return err;
+	}
+	gettimeofday(&end, NULL);
+	printf("  - %'lu usec lookups after compaction\n", usec_diff(&start, &end));
+	return 0;
+}
+
+static struct hash_table_frozen *hash_table_frozen;
+
+void *read_frozen(void *arg) {
+	uint32_t thread = (uintptr_t) arg;
+	for (uint32_t j = 0; j < arguments.size; ++j) {
+		size_t global_index = get_global_index(thread, j);
+		char *string = get_string(global_index);
+		hash_table_frozen_get_value(hash_table_frozen, string);
+	}
+	return NULL;
+}
+
+static int test_v2_freeze(pthread_t *threads)
+{
+	struct timeval start, end;
+
+	gettimeofday(&start, NULL);
+	hash_table_frozen = hash_table_v2_freeze(hash_table_v2);
+	gettimeofday(&end, NULL);
+	printf("  - %'lu usec freeze\n", usec_diff(&start, &end));
+
+	gettimeofday(&start, NULL);
+	int err = run_threads(threads, read_frozen);
+	if (err != 0) {
+		return err;
+	}
+	gettimeofday(&end, NULL);
+	printf("  - %'lu usec frozen lookups\n", usec_diff(&start, &end));
+
+	size_t missing = 0;
+	for (size_t i = 0; i < arguments.threads * arguments.size; ++i) {
+		if (!hash_table_frozen_contains(hash_table_frozen, get_string(i))) {
+			++missing;
+		}
+	}
+	printf("  - %'lu missing from frozen copy\n", missing);
+	hash_table_frozen_destroy(hash_table_frozen);
+	return 0;
+}
+
+static uint32_t index_value(size_t global_index)
+{
+	return global_index;
+}
+
+/* -f on the other tables: the copy must hold every key with its value */
+static void check_frozen(struct hash_table_frozen *frozen,
+                         uint32_t (*expected)(size_t global_index))
+{
+	size_t missing = 0;
+	for (size_t i = 0; i < arguments.threads * arguments.size; ++i) {
+		char *string = get_string(i);
+		if (!hash_table_frozen_contains(frozen, string)
+		    || hash_table_frozen_get_value(frozen, string) != expected(i)) {
+			++missing;
+		}
+	}
+	printf("  - %'lu missing from frozen copy\n", missing);
+	hash_table_frozen_destroy(frozen);
+}
+
+static struct hash_table_extendible *hash_table_extendible;
+
+void *run_extendible(void *arg) {
+	uint32_t thread = (uintptr_t) arg;
+	for (uint32_t j = 0; j < arguments.size; ++j) {
+		size_t global_index = get_global_index(thread, j);
+		char *string = get_string(global_index);
+		hash_table_extendible_add_entry(hash_table_extendible, string, global_index);
+	}
+	return NULL;
+}
+
+static int test_extendible(pthread_t *threads)
+{
+	struct timeval start, end;
+
+	hash_table_extendible = hash_table_extendible_create();
+	gettimeofday(&start, NULL);
+	int err = run_threads(threads, run_extendible);
+	if (err != 0) {
+		return err;
+	}
+	gettimeofday(&end, NULL);
+	printf("Hash table extendible: %'lu usec\n", usec_diff(&start, &end));
+
+	size_t missing = 0;
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		for (uint32_t j = 0; j < arguments.size; ++j) {
+			size_t global_index = get_global_index(i, j);
+			char *string = get_string(global_index);
+			if (!hash_table_extendible_contains(hash_table_extendible, string)
+			    || hash_table_extendible_get_value(hash_table_extendible, string) != global_index) {
+				++missing;
+			}
+		}
+	}
+	printf("  - %'lu missing\n", missing);
+	if (arguments.freeze) {
+		check_frozen(hash_table_extendible_freeze(hash_table_extendible), index_value);
+	}
+	hash_table_extendible_destroy(hash_table_extendible);
+	return 0;
+}
+
+static unsigned long nsec_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000UL + now.tv_nsec;
+}
+
+static struct hash_table_linear *hash_table_linear;
+static unsigned long *worst_insert;
+
+void *run_linear(void *arg) {
+	uint32_t thread = (uintptr_t) arg;
+	unsigned long worst = 0;
+	for (uint32_t j = 0; j < arguments.size; ++j) {
+		size_t global_index = get_global_index(thread, j);
+		char *string = get_string(global_index);
+		unsigned long before = nsec_now();
+		hash_table_linear_add_entry(hash_table_linear, string, global_index);
+		unsigned long latency = nsec_now() - before;
+		if (latency > worst) {
+			worst = latency;
+		}
+	}
+	worst_insert[thread] = worst;
+	return NULL;
+}
+
+static int test_linear(pthread_t *threads)
+{
+	struct timeval start, end;
+
+	worst_insert = calloc(arguments.threads, sizeof(unsigned long));
+	hash_table_linear = hash_table_linear_create();
+	gettimeofday(&start, NULL);
+	int err = run_threads(threads, run_linear);
+	if (err != 0) {
+		return err;
+	}
+	gettimeofday(&end, NULL);
+	printf("Hash table linear: %'lu usec\n", usec_diff(&start, &end));
+
+	size_t missing = 0;
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		for (uint32_t j = 0; j < arguments.size; ++j) {
+			size_t global_index = get_global_index(i, j);
+			char *string = get_string(global_index);
+			if (!hash_table_linear_contains(hash_table_linear, string)
+			    || hash_table_linear_get_value(hash_table_linear, string) != global_index) {
+				++missing;
+			}
+		}
+	}
+	printf("  - %'lu missing\n", missing);
+	if (arguments.freeze) {
+		check_frozen(hash_table_linear_freeze(hash_table_linear), index_value);
+	}
+
+	unsigned long worst = 0;
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		if (worst_insert[i] > worst) {
+			worst = worst_insert[i];
+		}
+	}
+	printf("  - %'lu nsec worst insert\n", worst);
+	hash_table_linear_destroy(hash_table_linear);
+	free(worst_insert);
+	return 0;
+}
+
+static struct hash_table_v2 *hash_table_reserved;
+static unsigned long *insert_latencies;
+
+/* Counts every call that reaches the allocator during -r */
+static atomic_size_t reserved_allocations;
+
+static void *reserved_alloc(void *context, size_t size)
+{
+	(void) context;
+	atomic_fetch_add_explicit(&reserved_allocations, 1, memory_order_relaxed);
+	return calloc(1, size);
+}
+
+static void reserved_free(void *context, void *pointer, size_t size)
+{
+	(void) context;
+	(void) size;
+	free(pointer);
+}
+
+static const struct ht_allocator reserved_allocator = {
+	.alloc = reserved_alloc,
+	.free = reserved_free,
+};
+
+void *run_reserved(void *arg) {
+	uint32_t thread = (uintptr_t) arg;
+	for (uint32_t j = 0; j < arguments.size; ++j) {
+		size_t global_index = get_global_index(thread, j);
+		char *string = get_string(global_index);
+		unsigned long before = nsec_now();
+		hash_table_v2_add_entry(hash_table_reserved, string, global_index);
+		insert_latencies[global_index] = nsec_now() - before;
+	}
+	return NULL;
+}
+
+static int compare_latencies(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *) a;
+	unsigned long y = *(const unsigned long *) b;
+	return (x > y) - (x < y);
+}
+
+static int time_reserved_inserts(pthread_t *threads, bool reserve)
+{
+	size_t count = arguments.threads * arguments.size;
+	hash_table_reserved = hash_table_v2_create_with_allocator(&reserved_allocator);
+	if (reserve) {
+		hash_table_v2_reserve(hash_table_reserved, count);
+	}
+	atomic_store(&reserved_allocations, 0);
+	int err = run_threads(threads, run_reserved);
+	if (err != 0) {
+		return err;
+	}
+	qsort(insert_latencies, count, sizeof(unsigned long), compare_latencies);
+	printf("  - %'lu nsec p99.9 insert, %'zu allocations%s\n",
+	       insert_latencies[count * 999 / 1000], atomic_load(&reserved_allocations),
+	       reserve ? " (reserved)" : "");
+	hash_table_v2_destroy(hash_table_reserved);
+	return 0;
+}
+
+/* Every key in one bucket, so a single index grows to hold them all */
+#define RESERVED_SKEWED_KEYS 1024
+
+static void count_skewed_reserved_inserts(void)
+{
+	char (*keys)[16] = malloc(RESERVED_SKEWED_KEYS * sizeof(*keys));
+	uint32_t found = 0;
+	for (uint32_t i = 0; found < RESERVED_SKEWED_KEYS; ++i) {
+		snprintf(keys[found], sizeof(*keys), "k%u", i);
+		if (bernstein_hash(keys[found]) % HASH_TABLE_CAPACITY == 0) {
+			++found;
+		}
+	}
+
+	/* The first half builds an index before the reservation moves it */
+	struct hash_table_v2 *hash_table = hash_table_v2_create_with_allocator(&reserved_allocator);
+	for (uint32_t i = 0; i < RESERVED_SKEWED_KEYS / 2; ++i) {
+		hash_table_v2_add_entry(hash_table, keys[i], i);
+	}
+	hash_table_v2_reserve(hash_table, RESERVED_SKEWED_KEYS / 2);
+	atomic_store(&reserved_allocations, 0);
+	for (uint32_t i = RESERVED_SKEWED_KEYS / 2; i < RESERVED_SKEWED_KEYS; ++i) {
+		hash_table_v2_add_entry(hash_table, keys[i], i);
+	}
+	size_t missing = 0;
+	for (uint32_t i = 0; i < RESERVED_SKEWED_KEYS; ++i) {
+		if (hash_table_v2_get_value(hash_table, keys[i]) != i) {
+			++missing;
+		}
+	}
+	printf("  - %'zu allocations for %'u keys in one bucket (reserved), %'zu missing\n",
+	       atomic_load(&reserved_allocations), RESERVED_SKEWED_KEYS / 2, missing);
+	hash_table_v2_destroy(hash_table);
+	free(keys);
+}
+
+static int test_v2_reserve(pthread_t *threads)
+{
+	insert_latencies = calloc(arguments.threads * arguments.size, sizeof(unsigned long));
+	int err = time_reserved_inserts(threads, false);
+	if (err == 0) {
+		err = time_reserved_inserts(threads, true);
+	}
+	if (err == 0) {
+		count_skewed_reserved_inserts();
+	}
+	free(insert_latencies);
+	return err;
+}
+
+/*
+ * -v: each writer rewrites its own keys in order, one round after another,
+ * while readers take snapshots of one writer's keys at a time. Versions
+ * follow each writer's program order, so a snapshot holds a prefix of its
+ * writes: the values never rise along the keys and drop by one at most,
+ * and reading the keys again in the same snapshot gives the same values.
+ */
+#define VERSIONED_KEYS 64
+#define VERSIONED_ROUNDS 500
+
+static struct hash_table_v2 *hash_table_versioned;
+static uint32_t versioned_keys;
+static _Atomic uint32_t versioned_writers;
+static _Atomic size_t versioned_snapshots;
+static _Atomic size_t versioned_inconsistent;
+
+void *write_versioned(void *arg) {
+	uint32_t thread = (uintptr_t) arg;
+	for (uint32_t round = 1; round <= VERSIONED_ROUNDS; ++round) {
+		for (uint32_t j = 0; j < versioned_keys; ++j) {
+			hash_table_v2_add_entry(hash_table_versioned, get_string(get_global_index(thread, j)), round);
+		}
+	}
+	atomic_fetch_sub(&versioned_writers, 1);
+	return NULL;
+}
+
+static bool read_snapshot(uint32_t writer)
+{
+	uint32_t values[VERSIONED_KEYS];
+	bool consistent = true;
+	struct hash_table_v2_reader reader;
+	hash_table_v2_begin_read(hash_table_versioned, &reader);
+	for (uint32_t j = 0; j < versioned_keys; ++j) {
+		char *string = get_string(get_global_index(writer, j));
+		if (!hash_table_v2_get_value_at(hash_table_versioned, string, reader.version, &values[j])
+		    || (j > 0 && (values[j] > values[j - 1] || values[0] - values[j] > 1))) {
+			consistent = false;
+		}
+	}
+	/* Give the writers time to push, and try to free, newer versions */
+	sched_yield();
+	for (uint32_t j = 0; j < versioned_keys; ++j) {
+		char *string = get_string(get_global_index(writer, j));
+		uint32_t value;
+		if (!hash_table_v2_get_value_at(hash_table_versioned, string, reader.version, &value)
+		    || value != values[j]) {
+			consistent = false;
+		}
+	}
+	hash_table_v2_end_read(hash_table_versioned, &reader);
+	return consistent;
+}
+
+void *read_versioned(void *arg) {
+	uint32_t writer = (uintptr_t) arg;
+	while (atomic_load(&versioned_writers) > 0) {
+		if (!read_snapshot(writer)) {
+			atomic_fetch_add(&versioned_inconsistent, 1);
+		}
+		atomic_fetch_add(&versioned_snapshots, 1);
+		writer = (writer + 1) % arguments.threads;
+	}
+	return NULL;
+}
+
+static int test_v2_versioned(pthread_t *threads)
+{
+	struct timeval start, end;
+	versioned_keys = arguments.size < VERSIONED_KEYS ? arguments.size : VERSIONED_KEYS;
+	hash_table_versioned = hash_table_v2_create_versioned();
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		for (uint32_t j = 0; j < versioned_keys; ++j) {
+			hash_table_v2_add_entry(hash_table_versioned, get_string(get_global_index(i, j)), 0);
+		}
+	}
+
+	pthread_t *readers = calloc(arguments.threads, sizeof(pthread_t));
+	atomic_store(&versioned_writers, arguments.threads);
+	gettimeofday(&start, NULL);
+	for (uintptr_t i = 0; i < arguments.threads; ++i) {
+		int err = pthread_create(&readers[i], NULL, read_versioned, (void*) i);
+		if (err != 0) {
+			printf("pthread_create returned %d\n", err);
+			return err;
+		}
+	}
+	int err = run_threads(threads, write_versioned);
+	if (err != 0) {
+		return err;
+	}
+	for (uintptr_t i = 0; i < arguments.threads; ++i) {
+		err = pthread_join(readers[i], NULL);
+		if (err != 0) {
+			printf("pthread_join returned %d\n", err);
+			return err;
+		}
+	}
+	gettimeofday(&end, NULL);
+	free(readers);
+	printf("Hash table v2 (versioned): %'lu usec\n", usec_diff(&start, &end));
+	printf("  - %'zu snapshots, %'zu inconsistent\n",
+	       atomic_load(&versioned_snapshots), atomic_load(&versioned_inconsistent));
+
+	size_t missing = 0;
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		for (uint32_t j = 0; j < versioned_keys; ++j) {
+			if (hash_table_v2_get_value(hash_table_versioned, get_string(get_global_index(i, j))) != VERSIONED_ROUNDS) {
+				++missing;
+			}
+		}
+	}
+	printf("  - %'lu missing the last round\n", missing);
+	hash_table_v2_destroy(hash_table_versioned);
+	return 0;
+}
+
+/* Bump allocator for -a: nothing is freed until the whole arena goes */
+#define ARENA_CHUNK_SIZE (4 << 20)
+#define ARENA_ALIGNMENT 16
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t used;
+	size_t capacity;
+	char *data;
+};
+
+struct arena {
+	pthread_mutex_t mutex;
+	struct arena_chunk *chunks;
+	size_t bytes;
+};
+
+static void *arena_alloc(void *context, size_t size)
+{
+	struct arena *arena = context;
+	size = (size + ARENA_ALIGNMENT - 1) & ~(size_t) (ARENA_ALIGNMENT - 1);
+	pthread_mutex_lock(&arena->mutex);
+	struct arena_chunk *chunk = arena->chunks;
+	if (chunk == NULL || chunk->capacity - chunk->used < size) {
+		chunk = malloc(sizeof(struct arena_chunk));
+		chunk->capacity = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+		chunk->data = aligned_alloc(ARENA_ALIGNMENT, chunk->capacity);
+		memset(chunk->data, 0, chunk->capacity);
+		chunk->used = 0;
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+	}
+	void *pointer = &chunk->data[chunk->used];
+	chunk->used += size;
+	arena->bytes += size;
+	pthread_mutex_unlock(&arena->mutex);
+	return pointer;
+}
+
+static void arena_free(void *context, void *pointer, size_t size)
+{
+	(void) context;
+	(void) pointer;
+	(void) size;
+}
+
+static void arena_bulk_free(void *context)
+{
+	struct arena *arena = context;
+	while (arena->chunks != NULL) {
+		struct arena_chunk *next = arena->chunks->next;
+		free(arena->chunks->data);
+		free(arena->chunks);
+		arena->chunks = next;
+	}
+}
+
+static struct hash_table_v2 *hash_table_arena;
+
+void *run_arena(void *arg) {
+	uint32_t thread = (uintptr_t) arg;
+	for (uint32_t j = 0; j < arguments.size; ++j) {
+		size_t global_index = get_global_index(thread, j);
+		char *string = get_string(global_index);
+		hash_table_v2_add_entry(hash_table_arena, string, global_index);
+	}
+	return NULL;
+}
+
+static int test_v2_arena(pthread_t *threads)
+{
+	struct timeval start, end;
+	struct arena arena = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+	struct ht_allocator allocator = {
+		.alloc = arena_alloc,
+		.free = arena_free,
+		.bulk_free = arena_bulk_free,
+		.context = &arena,
+	};
+
+	hash_table_arena = hash_table_v2_create_with_allocator(&allocator);
+	gettimeofday(&start, NULL);
+	int err = run_threads(threads, run_arena);
+	if (err != 0) {
+		return err;
+	}
+	gettimeofday(&end, NULL);
+	printf("Hash table v2 (arena): %'lu usec\n", usec_diff(&start, &end));
+
+	size_t missing = 0;
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		for (uint32_t j = 0; j < arguments.size; ++j) {
+			size_t global_index = get_global_index(i, j);
+			char *string = get_string(global_index);
+			if (!hash_table_v2_contains(hash_table_arena, string)
+			    || hash_table_v2_get_value(hash_table_arena, string) != global_index) {
+				++missing;
+			}
+		}
+	}
+	printf("  - %'lu missing\n", missing);
+	printf("  - %'lu KiB allocated\n", arena.bytes / 1024);
+
+	gettimeofday(&start, NULL);
+	hash_table_v2_destroy(hash_table_arena);
+	gettimeofday(&end, NULL);
+	printf("  - %'lu usec destroy\n", usec_diff(&start, &end));
+	return 0;
+}
+
+/* Keys of 1 to 16 characters leave segments of every length mod 8 */
+static int test_v2_snapshot_mixed(void)
+{
+	size_t total = (size_t) arguments.threads * arguments.size;
+	char **keys = calloc(total, sizeof(char *));
+	if (keys == NULL) {
+		return ENOMEM;
+	}
+	struct hash_table_v2 *saved = hash_table_v2_create();
+	for (size_t i = 0; i < total; ++i) {
+		keys[i] = malloc(32);
+		if (keys[i] == NULL) {
+			return ENOMEM;
+		}
+		snprintf(keys[i], 32, "%zx%.*s", i, (int) (i % 16), "mmmmmmmmmmmmmmmm");
+		hash_table_v2_add_entry(saved, keys[i], i);
+	}
+	int err = hash_table_v2_save(saved, arguments.snapshot, arguments.threads);
+	hash_table_v2_destroy(saved);
+	if (err != 0) {
+		printf("hash_table_v2_save returned %d\n", err);
+		return err;
+	}
+	struct hash_table_v2 *loaded = hash_table_v2_load(arguments.snapshot, arguments.threads);
+	if (loaded == NULL) {
+		printf("hash_table_v2_load failed with %d\n", errno);
+		return errno;
+	}
+	size_t missing = 0;
+	for (size_t i = 0; i < total; ++i) {
+		if (!hash_table_v2_contains(loaded, keys[i])
+		    || hash_table_v2_get_value(loaded, keys[i]) != i) {
+			++missing;
+		}
+	}
+	printf("  - %'lu missing after load with mixed-length keys\n", missing);
+	hash_table_v2_destroy(loaded);
+	for (size_t i = 0; i < total; ++i) {
+		free(keys[i]);
+	}
+	free(keys);
+	return 0;
+}
+
+static int test_v2_snapshot(void)
+{
+	struct timeval start, end;
+
+	gettimeofday(&start, NULL);
+	int err = hash_table_v2_save(hash_table_v2, arguments.snapshot, arguments.threads);
+	if (err != 0) {
+		printf("hash_table_v2_save returned %d\n", err);
+		return err;
+	}
+	gettimeofday(&end, NULL);
+	struct stat status;
+	stat(arguments.snapshot, &status);
+	printf("  - %'lu usec save (%'lu KiB)\n", usec_diff(&start, &end), (unsigned long) status.st_size / 1024);
+
+	gettimeofday(&start, NULL);
+	struct hash_table_v2 *loaded = hash_table_v2_load(arguments.snapshot, arguments.threads);
+	if (loaded == NULL) {
+		printf("hash_table_v2_load failed with %d\n", errno);
+		return errno;
+	}
+	gettimeofday(&end, NULL);
+	printf("  - %'lu usec load\n", usec_diff(&start, &end));
+
+	size_t missing = 0;
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		for (uint32_t j = 0; j < arguments.size; ++j) {
+			size_t global_index = get_global_index(i, j);
+			char *string = get_string(global_index);
+			if (!hash_table_v2_contains(loaded, string)
+			    || hash_table_v2_get_value(loaded, string) != global_index) {
+				++missing;
+			}
+		}
+	}
+	printf("  - %'lu missing after load\n", missing);
+	hash_table_v2_destroy(loaded);
+	return test_v2_snapshot_mixed();
+}
+
+static uint32_t update_offset;
+
+static size_t file_kib(const char *path)
+{
+	struct stat status;
+	if (stat(path, &status) != 0) {
+		return 0;
+	}
+	return status.st_size / 1024;
+}
+
+/* Round r rewrites the keys of every 64th bucket, from bucket r on, to index + r */
+static size_t update_buckets(uint32_t round)
+{
+	size_t updated = 0;
+	size_t total = (size_t) arguments.threads * arguments.size;
+	for (size_t i = 0; i < total; ++i) {
+		char *string = get_string(i);
+		if (bernstein_hash(string) % HASH_TABLE_CAPACITY % 64 == round) {
+			hash_table_v2_add_entry(hash_table_v2, string, i + round);
+			++updated;
+		}
+	}
+	return updated;
+}
+
+static size_t count_checkpoint_missing(struct hash_table_v2 *hash_table, uint32_t rounds)
+{
+	size_t missing = 0;
+	size_t total = (size_t) arguments.threads * arguments.size;
+	for (size_t i = 0; i < total; ++i) {
+		char *string = get_string(i);
+		uint32_t round = bernstein_hash(string) % HASH_TABLE_CAPACITY % 64;
+		size_t expected = round >= 1 && round <= rounds ? i + round : i;
+		if (!hash_table_v2_contains(hash_table, string)
+		    || hash_table_v2_get_value(hash_table, string) != expected) {
+			++missing;
+		}
+	}
+	return missing;
+}
+
+/* A full save, two checkpoints of about 1.6% of the buckets each, then a merge */
+static int test_v2_checkpoint(void)
+{
+	struct timeval start, end;
+	char deltas[2][PATH_MAX];
+	char merged[PATH_MAX];
+	const char *delta_paths[2] = { deltas[0], deltas[1] };
+	snprintf(deltas[0], PATH_MAX, "%s.1", arguments.checkpoint);
+	snprintf(deltas[1], PATH_MAX, "%s.2", arguments.checkpoint);
+	snprintf(merged, PATH_MAX, "%s.merged", arguments.checkpoint);
+
+	gettimeofday(&start, NULL);
+	int err = hash_table_v2_save(hash_table_v2, arguments.checkpoint, arguments.threads);
+	if (err != 0) {
+		printf("hash_table_v2_save returned %d\n", err);
+		return err;
+	}
+	gettimeofday(&end, NULL);
+	printf("  - %'lu usec base save (%'lu KiB)\n", usec_diff(&start, &end), file_kib(arguments.checkpoint));
+
+	for (uint32_t round = 1; round <= 2; ++round) {
+		size_t updated = update_buckets(round);
+		gettimeofday(&start, NULL);
+		err = hash_table_v2_checkpoint(hash_table_v2, deltas[round - 1], arguments.threads);
+		if (err != 0) {
+			printf("hash_table_v2_checkpoint returned %d\n", err);
+			return err;
+		}
+		gettimeofday(&end, NULL);
+		printf("  - %'lu usec checkpoint of %'lu updates (%'lu KiB)\n",
+		       usec_diff(&start, &end), updated, file_kib(deltas[round - 1]));
+	}
+
+	struct hash_table_v2 *loaded = hash_table_v2_load(arguments.checkpoint, arguments.threads);
+	if (loaded == NULL) {
+		printf("hash_table_v2_load failed with %d\n", errno);
+		return errno;
+	}
+	for (uint32_t i = 0; i < 2; ++i) {
+		err = hash_table_v2_apply(loaded, deltas[i], arguments.threads);
+		if (err != 0) {
+			printf("hash_table_v2_apply returned %d\n", err);
+			return err;
+		}
+	}
+	printf("  - %'lu missing after base and checkpoints\n", count_checkpoint_missing(loaded, 2));
+	hash_table_v2_destroy(loaded);
+
+	gettimeofday(&start, NULL);
+	err = hash_table_v2_merge(arguments.checkpoint, delta_paths, 2, merged, arguments.threads);
+	if (err != 0) {
+		printf("hash_table_v2_merge returned %d\n", err);
+		return err;
+	}
+	gettimeofday(&end, NULL);
+	printf("  - %'lu usec merge (%'lu KiB)\n", usec_diff(&start, &end), file_kib(merged));
+	loaded = hash_table_v2_load(merged, arguments.threads);
+	if (loaded == NULL) {
+		printf("hash_table_v2_load failed with %d\n", errno);
+		return errno;
+	}
+	printf("  - %'lu missing after merge\n", count_checkpoint_missing(loaded, 2));
+	hash_table_v2_destroy(loaded);
+
+	/* Later tests expect every value to be its index again */
+	size_t total = (size_t) arguments.threads * arguments.size;
+	for (size_t i = 0; i < total; ++i) {
+		hash_table_v2_add_entry(hash_table_v2, get_string(i), i);
+	}
+	return 0;
+}
+
+void *update_v2(void *arg) {
+	uint32_t thread = (uintptr_t) arg;
+	for (uint32_t j = 0; j < arguments.size; ++j) {
+		size_t global_index = get_global_index(thread, j);
+		char *string = get_string(global_index);
+		hash_table_v2_add_entry(hash_table_v2, string, global_index + update_offset);
+	}
+	return NULL;
+}
+
+static long minor_faults(void)
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_minflt;
+}
+
+/*
+ * The same update pass is timed alone and then while a forked child
+ * writes the snapshot, the difference is what copy-on-write costs us.
+ * The snapshot must hold the first pass's values, never the second's.
+ */
+static int test_v2_fork(pthread_t *threads)
+{
+	struct timeval start, end;
+
+	update_offset = 1;
+	long faults = minor_faults();
+	gettimeofday(&start, NULL);
+	int err = run_threads(threads, update_v2);
+	if (err != 0) {
+		return err;
+	}
+	gettimeofday(&end, NULL);
+	unsigned long alone = usec_diff(&start, &end);
+	faults = minor_faults() - faults;
+	printf("  - %'lu usec updates (%'ld minor faults)\n", alone, faults);
+
+	struct hash_table_v2_snapshot snapshot;
+	err = hash_table_v2_snapshot_async(hash_table_v2, arguments.fork, &snapshot);
+	if (err != 0) {
+		printf("hash_table_v2_snapshot_async returned %d\n", err);
+		return err;
+	}
+	update_offset = 2;
+	long window = minor_faults();
+	gettimeofday(&start, NULL);
+	err = run_threads(threads, update_v2);
+	if (err != 0) {
+		return err;
+	}
+	gettimeofday(&end, NULL);
+	unsigned long during = usec_diff(&start, &end);
+	window = minor_faults() - window;
+	err = hash_table_v2_snapshot_wait(&snapshot);
+	if (err != 0) {
+		printf("hash_table_v2_snapshot_wait returned %d\n", err);
+		return err;
+	}
+	printf("  - %'lu usec updates during snapshot (%'ld minor faults)\n", during, window);
+	printf("  - %'lu usec snapshot window (%'ld minor faults)\n",
+	       (unsigned long) (snapshot.nsec / 1000), snapshot.faults);
+	if (window > faults && during > alone) {
+		printf("  - %.2f usec per copy-on-write fault\n",
+		       (double) (during - alone) / (window - faults));
+	}
+
+	struct hash_table_v2 *loaded = hash_table_v2_load(arguments.fork, arguments.threads);
+	if (loaded == NULL) {
+		printf("hash_table_v2_load failed with %d\n", errno);
+		return errno;
+	}
+	size_t missing = 0;
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		for (uint32_t j = 0; j < arguments.size; ++j) {
+			size_t global_index = get_global_index(i, j);
+			char *string = get_string(global_index);
+			if (!hash_table_v2_contains(loaded, string)
+			    || hash_table_v2_get_value(loaded, string) != global_index + 1) {
+				++missing;
+			}
+		}
+	}
+	printf("  - %'lu missing from snapshot\n", missing);
+	hash_table_v2_destroy(loaded);
+	return 0;
+}
+
+static const struct hash_table_frozen *hash_table_mapped;
+
+void *read_mapped(void *arg) {
+	uint32_t thread = (uintptr_t) arg;
+	for (uint32_t j = 0; j < arguments.size; ++j) {
+		size_t global_index = get_global_index(thread, j);
+		char *string = get_string(global_index);
+		hash_table_frozen_get_value(hash_table_mapped, string);
+	}
+	return NULL;
+}
+
+static int test_v2_mapped(pthread_t *threads)
+{
+	struct timeval start, end;
+
+	struct hash_table_frozen *frozen = hash_table_v2_freeze(hash_table_v2);
+	int err = hash_table_frozen_save(frozen, arguments.mapped);
+	hash_table_frozen_destroy(frozen);
+	if (err != 0) {
+		printf("hash_table_frozen_save returned %d\n", err);
+		return err;
+	}
+
+	gettimeofday(&start, NULL);
+	hash_table_mapped = hash_table_frozen_open(arguments.mapped);
+	if (hash_table_mapped == NULL) {
+		printf("hash_table_frozen_open failed with %d\n", errno);
+		return errno;
+	}
+	gettimeofday(&end, NULL);
+	printf("  - %'lu usec open\n", usec_diff(&start, &end));
+
+	gettimeofday(&start, NULL);
+	err = run_threads(threads, read_mapped);
+	if (err != 0) {
+		return err;
+	}
+	gettimeofday(&end, NULL);
+	printf("  - %'lu usec mapped lookups\n", usec_diff(&start, &end));
+
+	size_t missing = 0;
+	for (size_t i = 0; i < arguments.threads * arguments.size; ++i) {
+		if (!hash_table_frozen_contains(hash_table_mapped, get_string(i))) {
+			++missing;
+		}
+	}
+	printf("  - %'lu missing from mapped copy\n", missing);
+	hash_table_frozen_close(hash_table_mapped);
+	return 0;
+}
+
+#define MAX_DURABLE_THREADS 64
+
+static struct hash_table_v2 *hash_table_durable;
+static uint32_t durable_threads;
+
+/* Thread i of durable_threads inserts its share of the first size keys */
+void *run_durable(void *arg) {
+	uint32_t thread = (uintptr_t) arg;
+	size_t begin = (size_t) arguments.size * thread / durable_threads;
+	size_t end = (size_t) arguments.size * (thread + 1) / durable_threads;
+	for (size_t i = begin; i < end; ++i) {
+		hash_table_v2_add_entry(hash_table_durable, get_string(i), i);
+	}
+	return NULL;
+}
+
+static int test_v2_durable(void)
+{
+	struct timeval start, end;
+	pthread_t durable[MAX_DURABLE_THREADS];
+
+	for (durable_threads = 1; durable_threads <= MAX_DURABLE_THREADS; durable_threads *= 2) {
+		unlink(arguments.wal);
+		hash_table_durable = hash_table_v2_create_durable(arguments.wal, arguments.threads);
+		if (hash_table_durable == NULL) {
+			printf("hash_table_v2_create_durable failed with %d\n", errno);
+			return errno;
+		}
+		gettimeofday(&start, NULL);
+		for (uintptr_t i = 0; i < durable_threads; ++i) {
+			int err = pthread_create(&durable[i], NULL, run_durable, (void *) i);
+			if (err != 0) {
+				printf("pthread_create returned %d\n", err);
+				return err;
+			}
+		}
+		for (uintptr_t i = 0; i < durable_threads; ++i) {
+			int err = pthread_join(durable[i], NULL);
+			if (err != 0) {
+				printf("pthread_join returned %d\n", err);
+				return err;
+			}
+		}
+		gettimeofday(&end, NULL);
+		unsigned long usec = usec_diff(&start, &end);
+		printf("  - %'lu durable inserts/sec with %u threads\n",
+		       (unsigned long) (arguments.size * 1000000.0 / (usec > 0 ? usec : 1)), durable_threads);
+		hash_table_v2_destroy(hash_table_durable);
+	}
+
+	gettimeofday(&start, NULL);
+	hash_table_durable = hash_table_v2_create_durable(arguments.wal, arguments.threads);
+	if (hash_table_durable == NULL) {
+		printf("hash_table_v2_create_durable failed with %d\n", errno);
+		return errno;
+	}
+	gettimeofday(&end, NULL);
+	printf("  - %'lu usec recovery\n", usec_diff(&start, &end));
+
+	size_t missing = 0;
+	for (size_t i = 0; i < arguments.size; ++i) {
+		char *string = get_string(i);
+		if (!hash_table_v2_contains(hash_table_durable, string)
+		    || hash_table_v2_get_value(hash_table_durable, string) != i) {
+			++missing;
+		}
+	}
+	printf("  - %'lu missing after recovery\n", missing);
+	hash_table_v2_destroy(hash_table_durable);
+	return 0;
+}
+
+static struct hash_table_replicated *hash_table_replicated;
+
+void *run_replicated(void *arg) {
+	uint32_t thread = (uintptr_t) arg;
+	for (uint32_t j = 0; j < arguments.size; ++j) {
+		size_t global_index = get_global_index(thread, j);
+		char *string = get_string(global_index);
+		hash_table_replicated_add_entry(hash_table_replicated, string, global_index);
+	}
+	return NULL;
+}
+
+void *read_replicated(void *arg) {
+	uint32_t thread = (uintptr_t) arg;
+	for (uint32_t j = 0; j < arguments.size; ++j) {
+		size_t global_index = get_global_index(thread, j);
+		char *string = get_string(global_index);
+		hash_table_replicated_get_value(hash_table_replicated, string);
+	}
+	return NULL;
+}
+
+static int test_replicated(pthread_t *threads)
+{
+	struct timeval start, end;
+
+	hash_table_replicated = hash_table_replicated_create(0);
+	gettimeofday(&start, NULL);
+	int err = run_threads(threads, run_replicated);
+	if (err != 0) {
+		return err;
+	}
+	gettimeofday(&end, NULL);
+	printf("Hash table replicated: %'lu usec\n", usec_diff(&start, &end));
+
+	size_t missing = 0;
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		for (uint32_t j = 0; j < arguments.size; ++j) {
+			size_t global_index = get_global_index(i, j);
+			char *string = get_string(global_index);
+			if (!hash_table_replicated_contains(hash_table_replicated, string)
+			    || hash_table_replicated_get_value(hash_table_replicated, string) != global_index) {
+				++missing;
+			}
+		}
+	}
+	printf("  - %'lu missing\n", missing);
+	if (arguments.freeze) {
+		check_frozen(hash_table_replicated_freeze(hash_table_replicated), index_value);
+	}
+
+	gettimeofday(&start, NULL);
+	err = run_threads(threads, read_replicated);
+	if (err != 0) {
+		return err;
+	}
+	gettimeofday(&end, NULL);
+	printf("  - %'lu usec reads\n", usec_diff(&start, &end));
+	hash_table_replicated_destroy(hash_table_replicated);
+	return 0;
+}
+
+/* calloc and free, counting the bytes in use */
+static void *counting_alloc(void *context, size_t size)
+{
+	*(size_t *) context += size;
+	return calloc(1, size);
+}
+
+static void counting_free(void *context, void *pointer, size_t size)
+{
+	*(size_t *) context -= size;
+	free(pointer);
+}
+
+static struct hash_table_mphf *hash_table_mphf;
+static struct hash_table_base *hash_table_mphf_base;
+
+void *read_mphf(void *arg) {
+	uint32_t thread = (uintptr_t) arg;
+	for (uint32_t j = 0; j < arguments.size; ++j) {
+		size_t global_index = get_global_index(thread, j);
+		char *string = get_string(global_index);
+		hash_table_mphf_get_value(hash_table_mphf, string);
+	}
+	return NULL;
+}
+
+void *read_mphf_base(void *arg) {
+	uint32_t thread = (uintptr_t) arg;
+	for (uint32_t j = 0; j < arguments.size; ++j) {
+		size_t global_index = get_global_index(thread, j);
+		char *string = get_string(global_index);
+		hash_table_base_get_value(hash_table_mphf_base, string);
+	}
+	return NULL;
+}
+
+static int test_mphf(pthread_t *threads)
+{
+	struct timeval start, end;
+	size_t count = arguments.threads * arguments.size;
+	const char **keys = malloc(count * sizeof(char *));
+	uint32_t *values = malloc(count * sizeof(uint32_t));
+	for (size_t i = 0; i < count; ++i) {
+		keys[i] = get_string(i);
+		values[i] = i;
+	}
+
+	gettimeofday(&start, NULL);
+	hash_table_mphf = hash_table_mphf_create(keys, values, count, arguments.threads);
+	gettimeofday(&end, NULL);
+	printf("Hash table mphf: %'lu usec\n", usec_diff(&start, &end));
+
+	size_t missing = 0;
+	for (size_t i = 0; i < count; ++i) {
+		if (!hash_table_mphf_contains(hash_table_mphf, keys[i])
+		    || hash_table_mphf_get_value(hash_table_mphf, keys[i]) != i) {
+			++missing;
+		}
+	}
+	printf("  - %'lu missing\n", missing);
+	if (arguments.freeze) {
+		check_frozen(hash_table_mphf_freeze(hash_table_mphf), index_value);
+	}
+
+	/* The same keys in a base table, counting what it allocates */
+	size_t base_bytes = 0;
+	struct ht_allocator allocator = {
+		.alloc = counting_alloc,
+		.free = counting_free,
+		.context = &base_bytes,
+	};
+	hash_table_mphf_base = hash_table_base_create_with_allocator(&allocator);
+	for (size_t i = 0; i < count; ++i) {
+		hash_table_base_add_entry(hash_table_mphf_base, keys[i], i);
+	}
+
+	gettimeofday(&start, NULL);
+	int err = run_threads(threads, read_mphf);
+	if (err != 0) {
+		return err;
+	}
+	gettimeofday(&end, NULL);
+	unsigned long mphf_usec = usec_diff(&start, &end);
+	gettimeofday(&start, NULL);
+	err = run_threads(threads, read_mphf_base);
+	if (err != 0) {
+		return err;
+	}
+	gettimeofday(&end, NULL);
+	printf("  - %'lu usec lookups (%'lu usec on base)\n", mphf_usec, usec_diff(&start, &end));
+	printf("  - %.2f bits/key function, %'lu KiB table (%'lu KiB base)\n",
+	       8.0 * hash_table_mphf_function_bytes(hash_table_mphf) / count,
+	       hash_table_mphf_bytes(hash_table_mphf) / 1024, base_bytes / 1024);
+
+	hash_table_base_destroy(hash_table_mphf_base);
+	hash_table_mphf_destroy(hash_table_mphf);
+	free(values);
+	free(keys);
+	return 0;
+}
+
+static struct hash_table_tiered *hash_table_tiered;
+static size_t *tiered_hot;
+static size_t tiered_hot_count;
+
+void *run_tiered(void *arg) {
+	uint32_t thread = (uintptr_t) arg;
+	for (uint32_t j = 0; j < arguments.size; ++j) {
+		size_t global_index = get_global_index(thread, j);
+		char *string = get_string(global_index);
+		hash_table_tiered_add_entry(hash_table_tiered, string, global_index);
+	}
+	return NULL;
+}
+
+void *read_tiered(void *arg) {
+	unsigned int seed = (uintptr_t) arg;
+	for (uint32_t j = 0; j < arguments.size; ++j) {
+		size_t global_index = tiered_hot[rand_r(&seed) % tiered_hot_count];
+		hash_table_tiered_get_value(hash_table_tiered, get_string(global_index));
+	}
+	return NULL;
+}
+
+static void print_tiered_stats(void)
+{
+	struct hash_table_tiered_stats stats;
+	hash_table_tiered_stats(hash_table_tiered, &stats);
+	printf("  - %'lu KiB resident, %'lu KiB spilled in %'lu segments (%'lu KiB written), "
+	       "%'lu evictions, %'lu faults, %'lu segments compacted\n",
+	       stats.resident_bytes / 1024, stats.spilled_bytes / 1024, stats.segments,
+	       stats.segment_bytes / 1024, stats.evictions, stats.faults, stats.compacted);
+}
+
+/*
+ * The memory budget holds about a quarter of the chains. Lookups then go
+ * to a growing share of the buckets, since keys are cached by bucket.
+ */
+static int test_tiered(pthread_t *threads)
+{
+	struct timeval start, end;
+	size_t total = (size_t) arguments.threads * arguments.size;
+	const char *directory = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+
+	hash_table_tiered = hash_table_tiered_create(directory, total * (BYTES_PER_STRING + 16) / 4);
+	if (hash_table_tiered == NULL) {
+		printf("hash_table_tiered_create failed with %d\n", errno);
+		return errno;
+	}
+	gettimeofday(&start, NULL);
+	int err = run_threads(threads, run_tiered);
+	if (err != 0) {
+		return err;
+	}
+	gettimeofday(&end, NULL);
+	printf("Hash table tiered: %'lu usec\n", usec_diff(&start, &end));
+
+	size_t missing = 0;
+	for (size_t i = 0; i < total; ++i) {
+		char *string = get_string(i);
+		if (!hash_table_tiered_contains(hash_table_tiered, string)
+		    || hash_table_tiered_get_value(hash_table_tiered, string) != i) {
+			++missing;
+		}
+	}
+	printf("  - %'lu missing\n", missing);
+	print_tiered_stats();
+	if (arguments.freeze) {
+		check_frozen(hash_table_tiered_freeze(hash_table_tiered), index_value);
+	}
+
+	tiered_hot = calloc(total, sizeof(size_t));
+	uint32_t percents[] = { 10, 25, 50, 100 };
+	for (size_t p = 0; p < sizeof(percents) / sizeof(percents[0]); ++p) {
+		tiered_hot_count = 0;
+		for (size_t i = 0; i < total; ++i) {
+			if (bernstein_hash(get_string(i)) % HASH_TABLE_CAPACITY < HASH_TABLE_CAPACITY / 100 * percents[p]
+			    || percents[p] == 100) {
+				tiered_hot[tiered_hot_count++] = i;
+			}
+		}
+		gettimeofday(&start, NULL);
+		err = run_threads(threads, read_tiered);
+		if (err != 0) {
+			return err;
+		}
+		gettimeofday(&end, NULL);
+		unsigned long usec = usec_diff(&start, &end);
+		printf("  - %'.0f lookups/s with %u%% of buckets hot\n",
+		       total / (usec > 0 ? usec / 1e6 : 1e-6), percents[p]);
+	}
+	free(tiered_hot);
+
+	/* Rewriting every key leaves the first spills dead for the compactor */
+	err = run_threads(threads, run_tiered);
+	if (err != 0) {
+		return err;
+	}
+	usleep(100000);
+	print_tiered_stats();
+	hash_table_tiered_destroy(hash_table_tiered);
+	return 0;
+}
+
+#define VLOG_VALUE_BYTES 1024
+/* Larger than a value log chunk */
+#define VLOG_LARGE_BYTES (5 << 20)
+
+static struct hash_table_vlog *hash_table_vlog;
+static _Atomic bool vlog_collecting;
+
+/* Starts with the index and the round that wrote it, the rest follows from them */
+static void fill_vlog_value(uint8_t *value, uint32_t index, uint32_t round)
+{
+	memcpy(value, &index, sizeof(index));
+	memcpy(value + sizeof(index), &round, sizeof(round));
+	for (uint32_t i = 2 * sizeof(uint32_t); i < VLOG_VALUE_BYTES; ++i) {
+		value[i] = index + round + i;
+	}
+}
+
+void *run_vlog(void *arg) {
+	uint32_t thread = (uintptr_t) arg;
+	uint8_t value[VLOG_VALUE_BYTES];
+	for (uint32_t j = 0; j < arguments.size; ++j) {
+		size_t global_index = get_global_index(thread, j);
+		fill_vlog_value(value, global_index, 0);
+		hash_table_vlog_add_entry(hash_table_vlog, get_string(global_index), value, VLOG_VALUE_BYTES);
+	}
+	return NULL;
+}
+
+/* Overwrites every other key, leaving half the log as garbage */
+void *overwrite_vlog(void *arg) {
+	uint32_t thread = (uintptr_t) arg;
+	uint8_t value[VLOG_VALUE_BYTES];
+	for (uint32_t j = 0; j < arguments.size; j += 2) {
+		size_t global_index = get_global_index(thread, j);
+		fill_vlog_value(value, global_index, 1);
+		hash_table_vlog_add_entry(hash_table_vlog, get_string(global_index), value, VLOG_VALUE_BYTES);
+	}
+	return NULL;
+}
+
+void *read_vlog(void *arg) {
+	uint32_t thread = (uintptr_t) arg;
+	uint8_t value[VLOG_VALUE_BYTES];
+	uint32_t length;
+	for (uint32_t j = 0; j < arguments.size; ++j) {
+		size_t global_index = get_global_index(thread, j);
+		hash_table_vlog_get_value(hash_table_vlog, get_string(global_index), value, sizeof(value), &length);
+	}
+	return NULL;
+}
+
+void *collect_vlog(void *arg) {
+	(void) arg;
+	while (hash_table_vlog_collect(hash_table_vlog) > 0) {
+	}
+	atomic_store(&vlog_collecting, false);
+	return NULL;
+}
+
+static size_t count_vlog_missing(void)
+{
+	size_t missing = 0;
+	uint8_t expected[VLOG_VALUE_BYTES];
+	uint8_t value[VLOG_VALUE_BYTES];
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		for (uint32_t j = 0; j < arguments.size; ++j) {
+			size_t global_index = get_global_index(i, j);
+			uint32_t length = 0;
+			fill_vlog_value(expected, global_index, j % 2 == 0);
+			if (!hash_table_vlog_get_value(hash_table_vlog, get_string(global_index), value, sizeof(value), &length)
+			    || length != VLOG_VALUE_BYTES || memcmp(value, expected, VLOG_VALUE_BYTES) != 0) {
+				++missing;
+			}
+		}
+	}
+	return missing;
+}
+
+/* Writes the large value for round, or checks it is the one read back */
+static bool large_vlog_value(uint32_t round, bool check)
+{
+	uint8_t *value = malloc(VLOG_LARGE_BYTES);
+	uint8_t *read = malloc(VLOG_LARGE_BYTES);
+	if (value == NULL || read == NULL) {
+		free(value);
+		free(read);
+		return false;
+	}
+	for (uint32_t i = 0; i < VLOG_LARGE_BYTES; ++i) {
+		value[i] = i / 4096 + round;
+	}
+	uint32_t length = 0;
+	bool ok;
+	if (check) {
+		ok = hash_table_vlog_get_value(hash_table_vlog, "large", read, VLOG_LARGE_BYTES, &length)
+		     && length == VLOG_LARGE_BYTES && memcmp(read, value, VLOG_LARGE_BYTES) == 0;
+	}
+	else {
+		ok = hash_table_vlog_add_entry(hash_table_vlog, "large", value, VLOG_LARGE_BYTES);
+	}
+	free(value);
+	free(read);
+	return ok;
+}
+
+static int test_vlog(pthread_t *threads)
+{
+	struct timeval start, end;
+	struct hash_table_vlog_stats before, after;
+
+	hash_table_vlog = hash_table_vlog_create(NULL);
+	if (hash_table_vlog == NULL) {
+		printf("hash_table_vlog_create failed with %d\n", errno);
+		return errno;
+	}
+	gettimeofday(&start, NULL);
+	int err = run_threads(threads, run_vlog);
+	if (err != 0) {
+		return err;
+	}
+	gettimeofday(&end, NULL);
+	printf("Hash table vlog: %'lu usec (%u byte values)\n", usec_diff(&start, &end), VLOG_VALUE_BYTES);
+
+	gettimeofday(&start, NULL);
+	err = run_threads(threads, overwrite_vlog);
+	if (err != 0) {
+		return err;
+	}
+	gettimeofday(&end, NULL);
+	printf("  - %'lu usec overwriting half the values\n", usec_diff(&start, &end));
+
+	/* The first large value becomes a chunk of pure garbage */
+	if (!large_vlog_value(0, false) || !large_vlog_value(1, false)) {
+		printf("hash_table_vlog_add_entry failed with %d for a large value\n", errno);
+		return errno;
+	}
+
+	gettimeofday(&start, NULL);
+	err = run_threads(threads, read_vlog);
+	if (err != 0) {
+		return err;
+	}
+	gettimeofday(&end, NULL);
+	unsigned long alone = usec_diff(&start, &end);
+
+	hash_table_vlog_stats(hash_table_vlog, &before);
+	pthread_t collector;
+	atomic_store(&vlog_collecting, true);
+	err = pthread_create(&collector, NULL, collect_vlog, NULL);
+	if (err != 0) {
+		printf("pthread_create returned %d\n", err);
+		return err;
+	}
+	size_t passes = 0;
+	gettimeofday(&start, NULL);
+	do {
+		err = run_threads(threads, read_vlog);
+		if (err != 0) {
+			return err;
+		}
+		++passes;
+	} while (atomic_load(&vlog_collecting));
+	gettimeofday(&end, NULL);
+	pthread_join(collector, NULL);
+	hash_table_vlog_stats(hash_table_vlog, &after);
+	printf("  - %'lu usec reads, %'lu usec per read pass while collecting\n",
+	       alone, usec_diff(&start, &end) / passes);
+	printf("  - %'lu chunks collected (%'lu KiB moved), log from %'lu KiB to %'lu KiB for %'lu KiB live\n",
+	       after.collected, after.moved_bytes / 1024, before.log_bytes / 1024,
+	       after.log_bytes / 1024, after.live_bytes / 1024);
+	printf("  - %'lu missing\n", count_vlog_missing() + !large_vlog_value(1, true));
+	hash_table_vlog_destroy(hash_table_vlog);
+	return 0;
+}
+
+#define HLOG_ROUNDS 10
+#define HLOG_HOT_EVERY 10
+
+static struct hash_table_hlog *hash_table_hlog;
+static struct hash_table_v2 *hash_table_counters;
+
+void *run_hlog(void *arg) {
+	uint32_t thread = (uintptr_t) arg;
+	for (uint32_t j = 0; j < arguments.size; ++j) {
+		size_t global_index = get_global_index(thread, j);
+		hash_table_hlog_add_entry(hash_table_hlog, get_string(global_index), 0);
+	}
+	return NULL;
+}
+
+/* Every key once, then every tenth key again each round */
+void *count_hlog(void *arg) {
+	uint32_t thread = (uintptr_t) arg;
+	for (uint32_t round = 0; round < HLOG_ROUNDS; ++round) {
+		for (uint32_t j = 0; j < arguments.size; ++j) {
+			if (round == 0 || j % HLOG_HOT_EVERY == 0) {
+				hash_table_hlog_add_count(hash_table_hlog, get_string(get_global_index(thread, j)), 1);
+			}
+		}
+	}
+	return NULL;
+}
+
+void *run_counters(void *arg) {
+	uint32_t thread = (uintptr_t) arg;
+	for (uint32_t j = 0; j < arguments.size; ++j) {
+		hash_table_v2_add_entry(hash_table_counters, get_string(get_global_index(thread, j)), 0);
+	}
+	return NULL;
+}
+
+void *count_counters(void *arg) {
+	uint32_t thread = (uintptr_t) arg;
+	for (uint32_t round = 0; round < HLOG_ROUNDS; ++round) {
+		for (uint32_t j = 0; j < arguments.size; ++j) {
+			if (round == 0 || j % HLOG_HOT_EVERY == 0) {
+				hash_table_v2_add_count(hash_table_counters, get_string(get_global_index(thread, j)), 1);
+			}
+		}
+	}
+	return NULL;
+}
+
+/* Every key is counted once, and the hot ones once more each round after */
+static uint32_t hlog_value(size_t global_index)
+{
+	return global_index % arguments.size % HLOG_HOT_EVERY == 0 ? HLOG_ROUNDS : 1;
+}
+
+static void print_hlog_stats(void)
+{
+	struct hash_table_hlog_stats stats;
+	hash_table_hlog_stats(hash_table_hlog, &stats);
+	printf("  - %'lu in place, %'lu copied to the tail, %'lu retries, %'lu disk reads\n",
+	       stats.in_place, stats.copied, stats.retries, stats.disk_reads);
+	printf("  - %'lu KiB log, %'lu KiB in memory, %'lu KiB flushed\n",
+	       stats.log_bytes / 1024, stats.memory_bytes / 1024, stats.flushed_bytes / 1024);
+}
+
+/*
+ * Memory holds about a quarter of the records, so the first round of
+ * counts copies cold records up from the file while the hot keys settle
+ * in the mutable region. v2 runs the same counts for comparison.
+ */
+static int test_hlog(pthread_t *threads)
+{
+	struct timeval start, end;
+	size_t total = (size_t) arguments.threads * arguments.size;
+	const char *directory = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+
+	hash_table_hlog = hash_table_hlog_create(directory, total * (BYTES_PER_STRING + 16) / 4);
+	if (hash_table_hlog == NULL) {
+		printf("hash_table_hlog_create failed with %d\n", errno);
+		return errno;
+	}
+	gettimeofday(&start, NULL);
+	int err = run_threads(threads, run_hlog);
+	if (err != 0) {
+		return err;
+	}
+	gettimeofday(&end, NULL);
+	printf("Hash table hlog: %'lu usec\n", usec_diff(&start, &end));
+
+	gettimeofday(&start, NULL);
+	err = run_threads(threads, count_hlog);
+	if (err != 0) {
+		return err;
+	}
+	gettimeofday(&end, NULL);
+	unsigned long usec = usec_diff(&start, &end);
+
+	hash_table_counters = hash_table_v2_create();
+	err = run_threads(threads, run_counters);
+	if (err != 0) {
+		return err;
+	}
+	gettimeofday(&start, NULL);
+	err = run_threads(threads, count_counters);
+	if (err != 0) {
+		return err;
+	}
+	gettimeofday(&end, NULL);
+	printf("  - %'lu usec counting, %'lu usec with v2\n", usec, usec_diff(&start, &end));
+	hash_table_v2_destroy(hash_table_counters);
+	print_hlog_stats();
+
+	size_t missing = 0;
+	for (size_t i = 0; i < total; ++i) {
+		char *string = get_string(i);
+		if (!hash_table_hlog_contains(hash_table_hlog, string)
+		    || hash_table_hlog_get_value(hash_table_hlog, string) != hlog_value(i)) {
+			++missing;
+		}
+	}
+	printf("  - %'lu missing\n", missing);
+	if (arguments.freeze) {
+		check_frozen(hash_table_hlog_freeze(hash_table_hlog), hlog_value);
+	}
+	hash_table_hlog_destroy(hash_table_hlog);
+	return 0;
+}
+
+/* Each worker is a process that attaches by name and inserts its own keys */
+static void run_shared(const char *name, uint32_t thread)
+{
+	struct hash_table_shared *hash_table = hash_table_shared_attach(name);
+	if (hash_table == NULL) {
+		_exit(errno);
+	}
+	for (uint32_t j = 0; j < arguments.size; ++j) {
+		size_t global_index = get_global_index(thread, j);
+		if (!hash_table_shared_add_entry(hash_table, get_string(global_index), global_index)) {
+			_exit(ENOSPC);
+		}
+	}
+	hash_table_shared_detach(hash_table);
+	_exit(0);
+}
+
+/* Rewrites every key until killed, likely while holding some bucket lock */
+static void run_shared_victim(struct hash_table_shared *hash_table)
+{
+	size_t total = (size_t) arguments.threads * arguments.size;
+	for (size_t i = 0; ; i = (i + 1) % total) {
+		hash_table_shared_add_entry(hash_table, get_string(i), i);
+	}
+}
+
+static int wait_shared(pid_t pid)
+{
+	int status;
+	if (waitpid(pid, &status, 0) < 0) {
+		return errno;
+	}
+	if (WIFEXITED(status)) {
+		return WEXITSTATUS(status);
+	}
+	return WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL ? 0 : EIO;
+}
+
+static int test_shared(void)
+{
+	struct timeval start, end;
+	char name[64];
+	snprintf(name, sizeof(name), "/hash-table-tester-%d", (int) getpid());
+	size_t total = (size_t) arguments.threads * arguments.size;
+
+	struct hash_table_shared *hash_table = hash_table_shared_create(name,
+		hash_table_shared_bytes_for(total, total * (BYTES_PER_STRING - 1)));
+	if (hash_table == NULL) {
+		printf("hash_table_shared_create failed with %d\n", errno);
+		return errno;
+	}
+	pid_t *workers = calloc(arguments.threads, sizeof(pid_t));
+	gettimeofday(&start, NULL);
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		workers[i] = fork();
+		if (workers[i] == 0) {
+			run_shared(name, i);
+		}
+	}
+	int err = 0;
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		int status = wait_shared(workers[i]);
+		if (status != 0) {
+			printf("shared worker %u failed with %d\n", i, status);
+			err = status;
+		}
+	}
+	gettimeofday(&end, NULL);
+	free(workers);
+	printf("Hash table shared: %'lu usec (%u processes)\n", usec_diff(&start, &end), arguments.threads);
+
+	size_t missing = 0;
+	for (size_t i = 0; i < total && err == 0; ++i) {
+		char *string = get_string(i);
+		if (!hash_table_shared_contains(hash_table, string)
+		    || hash_table_shared_get_value(hash_table, string) != i) {
+			++missing;
+		}
+	}
+	printf("  - %'lu missing\n", missing);
+	printf("  - %'lu KiB of region used\n", hash_table_shared_bytes_used(hash_table) / 1024);
+	if (arguments.freeze) {
+		check_frozen(hash_table_shared_freeze(hash_table), index_value);
+	}
+
+	/* Kill a writer mid-update, then make sure every bucket can still be locked */
+	pid_t victim = fork();
+	if (victim == 0) {
+		run_shared_victim(hash_table);
+	}
+	usleep(20000);
+	kill(victim, SIGKILL);
+	wait_shared(victim);
+	missing = 0;
+	for (size_t i = 0; i < total && err == 0; ++i) {
+		char *string = get_string(i);
+		if (!hash_table_shared_add_entry(hash_table, string, i)
+		    || hash_table_shared_get_value(hash_table, string) != i) {
+			++missing;
+		}
+	}
+	printf("  - %'lu missing after a killed writer (%'lu locks recovered)\n",
+	       missing, hash_table_shared_recovered(hash_table));
+
+	hash_table_shared_detach(hash_table);
+	hash_table_shared_unlink(name);
+	return err;
+}
+
+/* A fresh table must stay this small for many small tables to be cheap */
+#define EMPTY_TABLE_BUDGET 256
+
+/* Counts the bytes each table asks its allocator for, not the size class */
+static int check_empty_tables(void)
+{
+	size_t base_bytes = 0;
+	struct ht_allocator base_allocator = {
+		.alloc = counting_alloc,
+		.free = counting_free,
+		.context = &base_bytes,
+	};
+	size_t v2_bytes = 0;
+	struct ht_allocator v2_allocator = {
+		.alloc = counting_alloc,
+		.free = counting_free,
+		.context = &v2_bytes,
+	};
+	struct hash_table_base *base = hash_table_base_create_with_allocator(&base_allocator);
+	struct hash_table_v2 *v2 = hash_table_v2_create_with_allocator(&v2_allocator);
+	printf("Empty tables: %zu bytes (base), %zu bytes (v2), %d byte budget\n",
+	       base_bytes, v2_bytes, EMPTY_TABLE_BUDGET);
+	hash_table_base_destroy(base);
+	hash_table_v2_destroy(v2);
+	return base_bytes > EMPTY_TABLE_BUDGET || v2_bytes > EMPTY_TABLE_BUDGET ? EFBIG : 0;
+}
+
+int main(int argc, char *argv[])
+{
+	arguments.threads = 4;
+	arguments.size = 25000;
+  
+	static struct argp argp = { options, parse_opt };
+	argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+	setlocale(LC_ALL, "en_US.UTF-8");
+
+	if (arguments.empty) {
+		int err = check_empty_tables();
+		if (err != 0) {
+			return err;
+		}
+	}
+
+	data = calloc(arguments.threads * arguments.size, BYTES_PER_STRING);
+
+	struct timeval start, end;
+
+	gettimeofday(&start, NULL);
+	srand(42);
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		for (uint32_t j = 0; j < arguments.size; ++j) {
+			size_t global_index = get_global_index(i, j);
+			char *string = get_string(global_index);
+			for (uint32_t k = 0; k < (BYTES_PER_STRING - 1); ++k) {
+				int r = rand() % 52;
+				if (r < 26) {
+					string[k] = r + 0x41;
+				}
+				else {
+					string[k] = r + 0x47;
+				}
+			}
+			string[BYTES_PER_STRING - 1] = 0;
+		}
+	}
+	gettimeofday(&end, NULL);
+	printf("Generation: %'lu usec\n", usec_diff(&start, &end));
+
+	struct hash_table_base *hash_table_base = hash_table_base_create();
+	gettimeofday(&start, NULL);
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		for (uint32_t j = 0; j < arguments.size; ++j) {
+			size_t global_index = get_global_index(i, j);
+			char *string = get_string(global_index);
+			hash_table_base_add_entry(hash_table_base, string, global_index);
+		}
+	}
+	gettimeofday(&end, NULL);
+	printf("Hash table base: %'lu usec\n", usec_diff(&start, &end));
+
+	size_t missing = 0;
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		for (uint32_t j = 0; j < arguments.size; ++j) {
+			size_t global_index = get_global_index(i, j);
+			char *string = get_string(global_index);
+			if (!hash_table_base_contains(hash_table_base, string)) {
+				++missing;
+			}
+		}
+	}
+	printf("  - %'lu missing\n", missing);
+	if (arguments.destroy) {
+		gettimeofday(&start, NULL);
+		hash_table_base_destroy_async(hash_table_base, arguments.threads);
+		print_destroy(&start);
+	}
+	else {
+		hash_table_base_destroy(hash_table_base);
+	}
+
+	pthread_t *threads = calloc(arguments.threads, sizeof(pthread_t));
+
+	hash_table_v1 = hash_table_v1_create();
+	gettimeofday(&start, NULL);
+	for (uintptr_t i = 0; i < arguments.threads; ++i) {
+		int err = pthread_create(&threads[i], NULL, run_v1, (void*) i);
+		if (err != 0) {
+			printf("pthread_create returned %d\n", err);
+			return err;
+		}
+	}
+	for (uintptr_t i = 0; i < arguments.threads; ++i) {
+		int err = pthread_join(threads[i], NULL);
+		if (err != 0) {
+			printf("pthread_join returned %d\n", err);
+			return err;
+		}
+	}
+	gettimeofday(&end, NULL);
+	printf("Hash table v1: %'lu usec\n", usec_diff(&start, &end));
+
+	missing = 0;
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		for (uint32_t j = 0; j < arguments.size; ++j) {
+			size_t global_index = get_global_index(i, j);
+			char *string = get_string(global_index);
+			if (!hash_table_v1_contains(hash_table_v1, string)) {
+				++missing;
+			}
+		}
+	}
+	printf("  - %'lu missing\n", missing);
+	if (arguments.freeze) {
+		check_frozen(hash_table_v1_freeze(hash_table_v1), index_value);
+	}
+	if (arguments.destroy) {
+		gettimeofday(&start, NULL);
+		hash_table_v1_destroy_async(hash_table_v1, arguments.threads);
+		print_destroy(&start);
+	}
+	else {
+		hash_table_v1_destroy(hash_table_v1);
+	}
+
+	hash_table_v2 = hash_table_v2_create();
+	gettimeofday(&start, NULL);
+	for (uintptr_t i = 0; i < arguments.threads; ++i) {
+		int err = pthread_create(&threads[i], NULL, run_v2, (void*) i);
+		if (err != 0) {
+			printf("pthread_create returned %d\n", err);
+			return err;
+		}
+	}
+	for (uintptr_t i = 0; i < arguments.threads; ++i) {
+		int err = pthread_join(threads[i], NULL);
+		if (err != 0) {
+			printf("pthread_join returned %d\n", err);
+			return err;
+		}
+	}
+	gettimeofday(&end, NULL);
+	printf("Hash table v2: %'lu usec\n", usec_diff(&start, &end));
+
+	missing = 0;
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		for (uint32_t j = 0; j < arguments.size; ++j) {
+			size_t global_index = get_global_index(i, j);
+			char *string = get_string(global_index);
+			if (!hash_table_v2_contains(hash_table_v2, string)) {
+				++missing;
+			}
+		}
+	}
+	printf("  - %'lu missing\n", missing);
+	if (arguments.skewed) {
+		int err = test_v2_skewed(threads);
+		if (err != 0) {
+			return err;
+		}
+	}
+	if (arguments.compact) {
+		int err = test_v2_compact(threads);
+		if (err != 0) {
+			return err;
+		}
+	}
+	if (arguments.freeze) {
+		int err = test_v2_freeze(threads);
+		if (err != 0) {
+			return err;
+		}
+	}
+	if (arguments.reserve) {
+		int err = test_v2_reserve(threads);
+		if (err != 0) {
+			return err;
+		}
+	}
+	if (arguments.wal != NULL) {
+		int err = test_v2_durable();
+		if (err != 0) {
+			return err;
+		}
+	}
+	if (arguments.mapped != NULL) {
+		int err = test_v2_mapped(threads);
+		if (err != 0) {
+			return err;
+		}
+	}
+	if (arguments.snapshot != NULL) {
+		int err = test_v2_snapshot();
+		if (err != 0) {
+			return err;
+		}
+	}
+	if (arguments.checkpoint != NULL) {
+		int err = test_v2_checkpoint();
+		if (err != 0) {
+			return err;
+		}
+	}
+	if (arguments.fork != NULL) {
+		int err = test_v2_fork(threads);
+		if (err != 0) {
+			return err;
+		}
+	}
+	if (arguments.arena) {
+		int err = test_v2_arena(threads);
+		if (err != 0) {
+			return err;
+		}
+	}
+	if (arguments.versioned) {
+		int err = test_v2_versioned(threads);
+		if (err != 0) {
+			return err;
+		}
+	}
+	if (arguments.destroy) {
+		gettimeofday(&start, NULL);
+		hash_table_v2_destroy_async(hash_table_v2, arguments.threads);
+		print_destroy(&start);
+	}
+	else {
+		hash_table_v2_destroy(hash_table_v2);
+	}
+
+	if (arguments.extendible) {
+		int err = test_extendible(threads);
+		if (err != 0) {
+			return err;
+		}
+	}
+
+	if (arguments.linear) {
+		int err = test_linear(threads);
+		if (err != 0) {
+			return err;
+		}
+	}
+
+	if (arguments.replicated) {
+		int err = test_replicated(threads);
+		if (err != 0) {
+			return err;
+		}
+	}
+
+	if (arguments.mphf) {
+		int err = test_mphf(threads);
+		if (err != 0) {
+			return err;
+		}
+	}
+
+	if (arguments.tiered) {
+		int err = test_tiered(threads);
+		if (err != 0) {
+			return err;
+		}
+	}
+
+	if (arguments.vlog) {
+		int err = test_vlog(threads);
+		if (err != 0) {
+			return err;
+		}
+	}
+
+	if (arguments.hlog) {
+		int err = test_hlog(threads);
+		if (err != 0) {
+			return err;
+		}
+	}
+
+	if (arguments.shared) {
+		int err = test_shared();
+		if (err != 0) {
+			return err;
+		}
+	}
+
+	free(threads);
+	free(data);
+
+	return 0;
+}
@@ -0,0 +1,597 @@
+#include "hash-table-tiered.h"
+#include "hash-table-counter.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SEGMENT_BYTES (64 << 20)
+#define MAX_SEGMENTS 4096
+/* Evicting down past the budget lets one sweep cover many inserts */
+#define EVICT_TARGET_PERCENT 90
+#define COMPACT_INTERVAL_MSEC 10
+
+struct tiered_entry {
+	struct tiered_entry *next;
+	uint32_t hash;
+	uint32_t value;
+	char key[];
+};
+
+/*
+ * A spilled chain is a record count followed by, for each entry, its
+ * hash, value and key length, then the key and its NUL padded to 4 bytes.
+ */
+struct spill_record {
+	uint32_t hash;
+	uint32_t value;
+	uint32_t key_length;
+};
+
+/* Where a chain was spilled, length 0 meaning it never was */
+struct spill {
+	uint32_t segment;
+	uint32_t offset;
+	uint32_t length;
+};
+
+/*
+ * A bucket is resident when head is its chain, otherwise the chain is only
+ * at spill. A resident bucket that is not dirty also still matches spill,
+ * so it can be evicted by just freeing the chain. referenced is the clock
+ * bit, set on every access and cleared by the sweep.
+ */
+struct tiered_bucket {
+	pthread_mutex_t mutex;
+	struct tiered_entry *head;
+	size_t bytes;
+	bool resident;
+	bool dirty;
+	bool referenced;
+	struct spill spill;
+};
+
+/* live counts bytes still referenced, or reserved by an append in flight */
+struct segment {
+	int fd;
+	char *map;
+	uint32_t tail;
+	_Atomic uint64_t live;
+};
+
+/*
+ * segment_mutex guards current and every tail. Lock order is bucket, then
+ * segment_mutex; the sweep only ever trylocks buckets.
+ */
+struct hash_table_tiered {
+	char *directory;
+	size_t memory_bytes;
+	_Atomic size_t resident_bytes;
+	struct hash_table_counter *counter;
+	pthread_mutex_t segment_mutex;
+	struct segment *_Atomic segments[MAX_SEGMENTS];
+	uint32_t current;
+	pthread_mutex_t evict_mutex;
+	size_t hand;
+	_Atomic size_t evictions;
+	_Atomic size_t faults;
+	_Atomic size_t compacted;
+	pthread_t compactor;
+	pthread_mutex_t compactor_mutex;
+	pthread_cond_t compactor_cond;
+	bool stop;
+	struct tiered_bucket buckets[HASH_TABLE_CAPACITY];
+};
+
+static void lock(pthread_mutex_t *mutex)
+{
+	int error = pthread_mutex_lock(mutex);
+	if (error != 0) {
+		exit(error);
+	}
+}
+
+static void unlock(pthread_mutex_t *mutex)
+{
+	int error = pthread_mutex_unlock(mutex);
+	if (error != 0) {
+		exit(error);
+	}
+}
+
+static size_t entry_bytes(size_t key_length)
+{
+	return sizeof(struct tiered_entry) + key_length + 1;
+}
+
+static uint32_t record_bytes(size_t key_length)
+{
+	return sizeof(struct spill_record) + ((key_length + 4) & ~(size_t) 3);
+}
+
+/* An unlinked file only the mapping and fd keep alive, or NULL with errno set */
+static struct segment *create_segment(const char *directory)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/hash-table-tiered-XXXXXX", directory);
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		return NULL;
+	}
+	unlink(path);
+	if (ftruncate(fd, SEGMENT_BYTES) != 0) {
+		int error = errno;
+		close(fd);
+		errno = error;
+		return NULL;
+	}
+	char *map = mmap(NULL, SEGMENT_BYTES, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		int error = errno;
+		close(fd);
+		errno = error;
+		return NULL;
+	}
+	struct segment *segment = calloc(1, sizeof(struct segment));
+	assert(segment != NULL);
+	segment->fd = fd;
+	segment->map = map;
+	return segment;
+}
+
+static void destroy_segment(struct segment *segment)
+{
+	munmap(segment->map, SEGMENT_BYTES);
+	close(segment->fd);
+	free(segment);
+}
+
+/* Called with segment_mutex held, takes the next free id after current */
+static void next_segment(struct hash_table_tiered *hash_table)
+{
+	struct segment *segment = create_segment(hash_table->directory);
+	if (segment == NULL) {
+		exit(errno);
+	}
+	for (uint32_t i = 1; i < MAX_SEGMENTS; ++i) {
+		uint32_t id = (hash_table->current + i) % MAX_SEGMENTS;
+		if (atomic_load(&hash_table->segments[id]) == NULL) {
+			atomic_store(&hash_table->segments[id], segment);
+			hash_table->current = id;
+			return;
+		}
+	}
+	exit(ENOSPC);
+}
+
+static struct spill append(struct hash_table_tiered *hash_table,
+                           const void *block,
+                           uint32_t length)
+{
+	assert(length <= SEGMENT_BYTES);
+	lock(&hash_table->segment_mutex);
+	struct segment *segment = atomic_load(&hash_table->segments[hash_table->current]);
+	if (segment->tail + (uint64_t) length > SEGMENT_BYTES) {
+		next_segment(hash_table);
+		segment = atomic_load(&hash_table->segments[hash_table->current]);
+	}
+	struct spill spill = {
+		.segment = hash_table->current,
+		.offset = segment->tail,
+		.length = length,
+	};
+	segment->tail += length;
+	atomic_fetch_add(&segment->live, length);
+	unlock(&hash_table->segment_mutex);
+
+	for (uint32_t written = 0; written < length; ) {
+		ssize_t result = pwrite(segment->fd, (const char *) block + written, length - written,
+		                        spill.offset + written);
+		if (result < 0 && errno != EINTR) {
+			exit(errno);
+		}
+		if (result > 0) {
+			written += result;
+		}
+	}
+	return spill;
+}
+
+/* Called with the bucket lock held once nothing refers to spill any more */
+static void drop_spill(struct hash_table_tiered *hash_table,
+                       struct tiered_bucket *bucket)
+{
+	if (bucket->spill.length == 0) {
+		return;
+	}
+	struct segment *segment = atomic_load(&hash_table->segments[bucket->spill.segment]);
+	atomic_fetch_sub(&segment->live, bucket->spill.length);
+	bucket->spill.length = 0;
+}
+
+/* Called with the bucket lock held: reads a spilled chain back into memory */
+static void fault_in(struct hash_table_tiered *hash_table,
+                     struct tiered_bucket *bucket)
+{
+	if (bucket->resident) {
+		return;
+	}
+	struct segment *segment = atomic_load(&hash_table->segments[bucket->spill.segment]);
+	const char *block = segment->map + bucket->spill.offset;
+	uint32_t count;
+	memcpy(&count, block, sizeof(count));
+	const char *position = block + sizeof(count);
+	struct tiered_entry **tail = &bucket->head;
+	for (uint32_t i = 0; i < count; ++i) {
+		struct spill_record record;
+		memcpy(&record, position, sizeof(record));
+		struct tiered_entry *entry = malloc(entry_bytes(record.key_length));
+		assert(entry != NULL);
+		entry->hash = record.hash;
+		entry->value = record.value;
+		memcpy(entry->key, position + sizeof(record), record.key_length + 1);
+		entry->next = NULL;
+		*tail = entry;
+		tail = &entry->next;
+		bucket->bytes += entry_bytes(record.key_length);
+		position += record_bytes(record.key_length);
+	}
+	bucket->resident = true;
+	bucket->dirty = false;
+	atomic_fetch_add(&hash_table->resident_bytes, bucket->bytes);
+	atomic_fetch_add(&hash_table->faults, 1);
+}
+
+/* Called with the bucket lock held; writes the chain out only if it changed */
+static void evict(struct hash_table_tiered *hash_table,
+                  struct tiered_bucket *bucket)
+{
+	if (bucket->dirty) {
+		uint32_t count = 0;
+		size_t length = sizeof(count);
+		for (struct tiered_entry *entry = bucket->head; entry != NULL; entry = entry->next) {
+			++count;
+			length += record_bytes(strlen(entry->key));
+		}
+		char *block = calloc(1, length);
+		assert(block != NULL);
+		memcpy(block, &count, sizeof(count));
+		char *position = block + sizeof(count);
+		for (struct tiered_entry *entry = bucket->head; entry != NULL; entry = entry->next) {
+			struct spill_record record = {
+				.hash = entry->hash,
+				.value = entry->value,
+				.key_length = strlen(entry->key),
+			};
+			memcpy(position, &record, sizeof(record));
+			memcpy(position + sizeof(record), entry->key, record.key_length + 1);
+			position += record_bytes(record.key_length);
+		}
+		bucket->spill = append(hash_table, block, length);
+		free(block);
+		atomic_fetch_add(&hash_table->evictions, 1);
+	}
+	while (bucket->head != NULL) {
+		struct tiered_entry *next = bucket->head->next;
+		free(bucket->head);
+		bucket->head = next;
+	}
+	atomic_fetch_sub(&hash_table->resident_bytes, bucket->bytes);
+	bucket->bytes = 0;
+	bucket->resident = false;
+	bucket->dirty = false;
+}
+
+/* Clock sweep, run by whichever thread finds the budget exceeded first */
+static void sweep(struct hash_table_tiered *hash_table)
+{
+	if (atomic_load(&hash_table->resident_bytes) <= hash_table->memory_bytes
+	    || pthread_mutex_trylock(&hash_table->evict_mutex) != 0) {
+		return;
+	}
+	size_t target = hash_table->memory_bytes / 100 * EVICT_TARGET_PERCENT;
+	for (size_t scanned = 0;
+	     atomic_load(&hash_table->resident_bytes) > target && scanned < 2 * HASH_TABLE_CAPACITY;
+	     ++scanned) {
+		struct tiered_bucket *bucket = &hash_table->buckets[hash_table->hand];
+		hash_table->hand = (hash_table->hand + 1) % HASH_TABLE_CAPACITY;
+		if (pthread_mutex_trylock(&bucket->mutex) != 0) {
+			continue;
+		}
+		if (bucket->referenced) {
+			bucket->referenced = false;
+		}
+		else if (bucket->resident && bucket->head != NULL) {
+			evict(hash_table, bucket);
+		}
+		unlock(&bucket->mutex);
+	}
+	unlock(&hash_table->evict_mutex);
+}
+
+/* Moves the live chains out of a sealed segment, then deletes it once empty */
+static void compact_segment(struct hash_table_tiered *hash_table, uint32_t id)
+{
+	struct segment *segment = atomic_load(&hash_table->segments[id]);
+	for (size_t i = 0; i < HASH_TABLE_CAPACITY; ++i) {
+		struct tiered_bucket *bucket = &hash_table->buckets[i];
+		lock(&bucket->mutex);
+		if (bucket->spill.length > 0 && bucket->spill.segment == id) {
+			struct spill spill = append(hash_table, segment->map + bucket->spill.offset, bucket->spill.length);
+			drop_spill(hash_table, bucket);
+			bucket->spill = spill;
+		}
+		unlock(&bucket->mutex);
+	}
+	if (atomic_load(&segment->live) == 0) {
+		lock(&hash_table->segment_mutex);
+		atomic_store(&hash_table->segments[id], NULL);
+		unlock(&hash_table->segment_mutex);
+		destroy_segment(segment);
+		atomic_fetch_add(&hash_table->compacted, 1);
+	}
+}
+
+static void *run_compactor(void *arg)
+{
+	struct hash_table_tiered *hash_table = arg;
+	lock(&hash_table->compactor_mutex);
+	while (!hash_table->stop) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += COMPACT_INTERVAL_MSEC * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			++deadline.tv_sec;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&hash_table->compactor_cond, &hash_table->compactor_mutex, &deadline);
+		if (hash_table->stop) {
+			break;
+		}
+		unlock(&hash_table->compactor_mutex);
+		/* Half dead or worse, the current segment is still being filled */
+		for (uint32_t id = 0; id < MAX_SEGMENTS; ++id) {
+			lock(&hash_table->segment_mutex);
+			struct segment *segment = atomic_load(&hash_table->segments[id]);
+			bool candidate = segment != NULL && id != hash_table->current
+			                 && atomic_load(&segment->live) * 2 < segment->tail;
+			unlock(&hash_table->segment_mutex);
+			if (candidate) {
+				compact_segment(hash_table, id);
+			}
+		}
+		lock(&hash_table->compactor_mutex);
+	}
+	unlock(&hash_table->compactor_mutex);
+	return NULL;
+}
+
+struct hash_table_tiered *hash_table_tiered_create(const char *directory,
+                                                   size_t memory_bytes)
+{
+	struct segment *segment = create_segment(directory);
+	if (segment == NULL) {
+		return NULL;
+	}
+	struct hash_table_tiered *hash_table = calloc(1, sizeof(struct hash_table_tiered));
+	assert(hash_table != NULL);
+	hash_table->directory = strdup(directory);
+	assert(hash_table->directory != NULL);
+	hash_table->memory_bytes = memory_bytes;
+	hash_table->counter = hash_table_counter_create();
+	atomic_store(&hash_table->segments[0], segment);
+	pthread_mutex_init(&hash_table->segment_mutex, NULL);
+	pthread_mutex_init(&hash_table->evict_mutex, NULL);
+	pthread_mutex_init(&hash_table->compactor_mutex, NULL);
+	pthread_cond_init(&hash_table->compactor_cond, NULL);
+	for (size_t i = 0; i < HASH_TABLE_CAPACITY; ++i) {
+		int error = pthread_mutex_init(&hash_table->buckets[i].mutex, NULL);
+		if (error != 0) {
+			exit(error);
+		}
+		hash_table->buckets[i].resident = true;
+	}
+	int error = pthread_create(&hash_table->compactor, NULL, run_compactor, hash_table);
+	if (error != 0) {
+		exit(error);
+	}
+	return hash_table;
+}
+
+/* Locks and faults in key's bucket, and marks it recently used */
+static struct tiered_bucket *get_bucket(struct hash_table_tiered *hash_table,
+                                        uint32_t hash)
+{
+	struct tiered_bucket *bucket = &hash_table->buckets[hash % HASH_TABLE_CAPACITY];
+	lock(&bucket->mutex);
+	fault_in(hash_table, bucket);
+	bucket->referenced = true;
+	return bucket;
+}
+
+static struct tiered_entry *find_entry(struct tiered_bucket *bucket,
+                                       const char *key,
+                                       uint32_t hash)
+{
+	for (struct tiered_entry *entry = bucket->head; entry != NULL; entry = entry->next) {
+		if (entry->hash == hash && strcmp(entry->key, key) == 0) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+void hash_table_tiered_add_entry(struct hash_table_tiered *hash_table,
+                                 const char *key,
+                                 uint32_t value)
+{
+	uint32_t hash = bernstein_hash(key);
+	struct tiered_bucket *bucket = get_bucket(hash_table, hash);
+	struct tiered_entry *entry = find_entry(bucket, key, hash);
+	bool inserted = entry == NULL;
+	if (inserted) {
+		size_t length = strlen(key);
+		entry = malloc(entry_bytes(length));
+		assert(entry != NULL);
+		memcpy(entry->key, key, length + 1);
+		entry->hash = hash;
+		entry->next = bucket->head;
+		bucket->head = entry;
+		bucket->bytes += entry_bytes(length);
+		atomic_fetch_add(&hash_table->resident_bytes, entry_bytes(length));
+	}
+	entry->value = value;
+	drop_spill(hash_table, bucket);
+	bucket->dirty = true;
+	unlock(&bucket->mutex);
+	if (inserted) {
+		hash_table_counter_add(hash_table->counter, 1);
+	}
+	sweep(hash_table);
+}
+
+bool hash_table_tiered_contains(struct hash_table_tiered *hash_table,
+                                const char *key)
+{
+	uint32_t hash = bernstein_hash(key);
+	struct tiered_bucket *bucket = get_bucket(hash_table, hash);
+	bool found = find_entry(bucket, key, hash) != NULL;
+	unlock(&bucket->mutex);
+	sweep(hash_table);
+	return found;
+}
+
+uint32_t hash_table_tiered_get_value(struct hash_table_tiered *hash_table,
+                                     const char *key)
+{
+	uint32_t hash = bernstein_hash(key);
+	struct tiered_bucket *bucket = get_bucket(hash_table, hash);
+	struct tiered_entry *entry = find_entry(bucket, key, hash);
+	assert(entry != NULL);
+	uint32_t value = entry->value;
+	unlock(&bucket->mutex);
+	sweep(hash_table);
+	return value;
+}
+
+size_t hash_table_tiered_size(struct hash_table_tiered *hash_table)
+{
+	return hash_table_counter_read(hash_table->counter);
+}
+
+/*
+ * Called with the bucket lock held: counts the bucket's entries and key
+ * bytes, and inserts them into frozen unless it is NULL.
+ */
+static void freeze_bucket(struct hash_table_tiered *hash_table,
+                          struct tiered_bucket *bucket,
+                          size_t *size,
+                          size_t *key_bytes,
+                          struct hash_table_frozen *frozen)
+{
+	if (bucket->resident) {
+		for (struct tiered_entry *entry = bucket->head; entry != NULL; entry = entry->next) {
+			++*size;
+			*key_bytes += strlen(entry->key) + 1;
+			if (frozen != NULL) {
+				hash_table_frozen_insert(frozen, entry->key, entry->hash, entry->value);
+			}
+		}
+		return;
+	}
+	struct segment *segment = atomic_load(&hash_table->segments[bucket->spill.segment]);
+	const char *block = segment->map + bucket->spill.offset;
+	uint32_t count;
+	memcpy(&count, block, sizeof(count));
+	const char *position = block + sizeof(count);
+	for (uint32_t i = 0; i < count; ++i) {
+		struct spill_record record;
+		memcpy(&record, position, sizeof(record));
+		++*size;
+		*key_bytes += record.key_length + 1;
+		if (frozen != NULL) {
+			hash_table_frozen_insert(frozen, position + sizeof(record), record.hash, record.value);
+		}
+		position += record_bytes(record.key_length);
+	}
+}
+
+struct hash_table_frozen *hash_table_tiered_freeze(struct hash_table_tiered *hash_table)
+{
+	size_t size = 0;
+	size_t key_bytes = 0;
+	for (size_t i = 0; i < HASH_TABLE_CAPACITY; ++i) {
+		struct tiered_bucket *bucket = &hash_table->buckets[i];
+		lock(&bucket->mutex);
+		freeze_bucket(hash_table, bucket, &size, &key_bytes, NULL);
+	}
+	struct hash_table_frozen *frozen = hash_table_frozen_create(size, key_bytes);
+	for (size_t i = 0; i < HASH_TABLE_CAPACITY; ++i) {
+		struct tiered_bucket *bucket = &hash_table->buckets[i];
+		freeze_bucket(hash_table, bucket, &size, &key_bytes, frozen);
+		unlock(&bucket->mutex);
+	}
+	return frozen;
+}
+
+void hash_table_tiered_stats(struct hash_table_tiered *hash_table,
+                             struct hash_table_tiered_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	stats->resident_bytes = atomic_load(&hash_table->resident_bytes);
+	lock(&hash_table->segment_mutex);
+	for (uint32_t id = 0; id < MAX_SEGMENTS; ++id) {
+		struct segment *segment = atomic_load(&hash_table->segments[id]);
+		if (segment != NULL) {
+			stats->spilled_bytes += atomic_load(&segment->live);
+			stats->segment_bytes += segment->tail;
+			++stats->segments;
+		}
+	}
+	unlock(&hash_table->segment_mutex);
+	stats->evictions = atomic_load(&hash_table->evictions);
+	stats->faults = atomic_load(&hash_table->faults);
+	stats->compacted = atomic_load(&hash_table->compacted);
+}
+
+void hash_table_tiered_destroy(struct hash_table_tiered *hash_table)
+{
+	lock(&hash_table->compactor_mutex);
+	hash_table->stop = true;
+	pthread_cond_signal(&hash_table->compactor_cond);
+	unlock(&hash_table->compactor_mutex);
+	int error = pthread_join(hash_table->compactor, NULL);
+	if (error != 0) {
+		exit(error);
+	}
+	for (size_t i = 0; i < HASH_TABLE_CAPACITY; ++i) {
+		struct tiered_bucket *bucket = &hash_table->buckets[i];
+		while (bucket->head != NULL) {
+			struct tiered_entry *next = bucket->head->next;
+			free(bucket->head);
+			bucket->head = next;
+		}
+		pthread_mutex_destroy(&bucket->mutex);
+	}
+	for (uint32_t id = 0; id < MAX_SEGMENTS; ++id) {
+		struct segment *segment = atomic_load(&hash_table->segments[id]);
+		if (segment != NULL) {
+			destroy_segment(segment);
+		}
+	}
+	pthread_cond_destroy(&hash_table->compactor_cond);
+	pthread_mutex_destroy(&hash_table->compactor_mutex);
+	pthread_mutex_destroy(&hash_table->evict_mutex);
+	pthread_mutex_destroy(&hash_table->segment_mutex);
+	hash_table_counter_destroy(hash_table->counter);
+	free(hash_table->directory);
+	free(hash_table);
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "hash-table-common.h"
+#include "hash-table-frozen.h"
+
+#include <stdbool.h>
+
+/*
+ * A table that keeps at most memory_bytes of chains in memory and spills
+ * the rest to disk. When the budget is exceeded a clock sweep over the
+ * buckets writes cold chains to append-only segment files and keeps only
+ * a 12 byte reference in the bucket. Touching a spilled bucket reads its
+ * chain back through the segment's mapping; it stays clean until written,
+ * so evicting it again costs no I/O. Rewritten chains leave dead space
+ * behind, which a background thread reclaims by moving the live chains of
+ * mostly dead segments forward and deleting the segments.
+ *
+ * Keys are copied into the table. Segment files are created in directory
+ * and unlinked at once, so they never outlive the table.
+ */
+struct hash_table_tiered;
+
+struct hash_table_tiered_stats {
+	size_t resident_bytes;
+	size_t spilled_bytes;
+	size_t segment_bytes;
+	size_t segments;
+	size_t evictions;
+	size_t faults;
+	size_t compacted;
+};
+
+/* Returns NULL with errno set if directory cannot hold segment files */
+struct hash_table_tiered *hash_table_tiered_create(const char *directory,
+                                                   size_t memory_bytes);
+void hash_table_tiered_add_entry(struct hash_table_tiered *hash_table,
+                                 const char *key,
+                                 uint32_t value);
+bool hash_table_tiered_contains(struct hash_table_tiered *hash_table,
+                                const char *key);
+uint32_t hash_table_tiered_get_value(struct hash_table_tiered *hash_table,
+                                     const char *key);
+size_t hash_table_tiered_size(struct hash_table_tiered *hash_table);
+/*
+ * Copy the current contents into an immutable hash_table_frozen. Spilled
+ * chains are read in place, so freezing does not fault them back in.
+ */
+struct hash_table_frozen *hash_table_tiered_freeze(struct hash_table_tiered *hash_table);
+/* spilled_bytes is live chain data, segment_bytes includes dead space */
+void hash_table_tiered_stats(struct hash_table_tiered *hash_table,
+                             struct hash_table_tiered_stats *stats);
+void hash_table_tiered_destroy(struct hash_table_tiered *hash_table);
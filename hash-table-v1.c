@@ -1,140 +1,213 @@
-#include "hash-table-base.h"
-
-#include <assert.h>
-#include <stdlib.h>
-#include <string.h>
-#include <sys/queue.h>
-
-#include <pthread.h>
-
-struct list_entry {
-	const char *key;
-	uint32_t value;
-	SLIST_ENTRY(list_entry) pointers;
-};
-
-SLIST_HEAD(list_head, list_entry);
-
-struct hash_table_entry {
-	struct list_head list_head;
-};
-
-struct hash_table_v1 {
-	struct hash_table_entry entries[HASH_TABLE_CAPACITY];
-	pthread_mutex_t mutex;
-};
-
-struct hash_table_v1 *hash_table_v1_create()
-{
-	struct hash_table_v1 *hash_table = calloc(1, sizeof(struct hash_table_v1));
-	assert(hash_table != NULL);
-	for (size_t i = 0; i < HASH_TABLE_CAPACITY; ++i) {
-		struct hash_table_entry *entry = &hash_table->entries[i];
-		SLIST_INIT(&entry->list_head);
-	}
-	//verify lock is created
-	int error = pthread_mutex_init(&(hash_table->mutex), NULL);
-	if (error != 0) {
-		exit(error);
-	}
-
-	return hash_table;
-}
-
-static struct hash_table_entry *get_hash_table_entry(struct hash_table_v1 *hash_table,
-                                                     const char *key)
-{
-	assert(key != NULL);
-	uint32_t index = bernstein_hash(key) % HASH_TABLE_CAPACITY;
-	struct hash_table_entry *entry = &hash_table->entries[index];
-	return entry;
-}
-
-static struct list_entry *get_list_entry(struct hash_table_v1 *hash_table,
-                                         const char *key,
-                                         struct list_head *list_head)
-{
-	assert(key != NULL);
-
-	struct list_entry *entry = NULL;
-	
-	SLIST_FOREACH(entry, list_head, pointers) {
-	  if (strcmp(entry->key, key) == 0) {
-	    return entry;
-	  }
-	}
-	return NULL;
-}
-
-bool hash_table_v1_contains(struct hash_table_v1 *hash_table,
-                            const char *key)
-{
-	struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, key);
-	struct list_head *list_head = &hash_table_entry->list_head;
-	struct list_entry *list_entry = get_list_entry(hash_table, key, list_head);
-	return list_entry != NULL;
-}
-
-void hash_table_v1_add_entry(struct hash_table_v1 *hash_table,
-                             const char *key,
-                             uint32_t value)
-{
-	//lock must be enabled before we find the right position, in case position changes 
-	int error = pthread_mutex_lock(&hash_table->mutex);
-	if (error != 0) {
-		exit(error);
-	}
-
-	struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, key);
-	struct list_head *list_head = &hash_table_entry->list_head;
-	struct list_entry *list_entry = get_list_entry(hash_table, key, list_head);
-
-	/* Update the value if it already exists */
-
-	if (list_entry != NULL) {
-		list_entry->value = value;
-		error = pthread_mutex_unlock(&hash_table->mutex);
-		if (error != 0) {
-			exit(error);
-		}
-		return;
-	}
-
-	list_entry = calloc(1, sizeof(struct list_entry));
-	list_entry->key = key;
-	list_entry->value = value;
-	SLIST_INSERT_HEAD(list_head, list_entry, pointers);
-	error = pthread_mutex_unlock(&hash_table->mutex);
-	if (error != 0) exit(error);
-}
-
-uint32_t hash_table_v1_get_value(struct hash_table_v1 *hash_table,
-                                 const char *key)
-{
-	struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, key);
-	struct list_head *list_head = &hash_table_entry->list_head;
-	struct list_entry *list_entry = get_list_entry(hash_table, key, list_head);
-	assert(list_entry != NULL);
-	return list_entry->value;
-}
-
-void hash_table_v1_destroy(struct hash_table_v1 *hash_table)
-{
-	for (size_t i = 0; i < HASH_TABLE_CAPACITY; ++i) {
-		struct hash_table_entry *entry = &hash_table->entries[i];
-		struct list_head *list_head = &entry->list_head;
-		struct list_entry *list_entry = NULL;
-		while (!SLIST_EMPTY(list_head)) {
-			list_entry = SLIST_FIRST(list_head);
-			SLIST_REMOVE_HEAD(list_head, pointers);
-			free(list_entry);
-		}
-	}
-
-	int error = pthread_mutex_unlock(&hash_table->mutex);
-	if (error != 0) {
-		exit(error);
-	}
-
-	free(hash_table);
-}
+#include "hash-table-v1.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+
+#include <pthread.h>
+
+struct list_entry {
+	const char *key;
+	uint32_t value;
+	SLIST_ENTRY(list_entry) pointers;
+};
+
+SLIST_HEAD(list_head, list_entry);
+
+struct hash_table_entry {
+	struct list_head list_head;
+};
+
+struct hash_table_v1 {
+	struct hash_table_entry entries[HASH_TABLE_CAPACITY];
+	size_t size;
+	pthread_mutex_t mutex;
+	struct ht_allocator allocator;
+};
+
+struct hash_table_v1 *hash_table_v1_create()
+{
+	return hash_table_v1_create_with_allocator(&hash_table_default_allocator);
+}
+
+struct hash_table_v1 *hash_table_v1_create_with_allocator(const struct ht_allocator *allocator)
+{
+	struct hash_table_v1 *hash_table = hash_table_alloc(allocator, sizeof(struct hash_table_v1));
+	hash_table->allocator = *allocator;
+	for (size_t i = 0; i < HASH_TABLE_CAPACITY; ++i) {
+		struct hash_table_entry *entry = &hash_table->entries[i];
+		SLIST_INIT(&entry->list_head);
+	}
+	//verify lock is created
+	int error = pthread_mutex_init(&(hash_table->mutex), NULL);
+	if (error != 0) {
+		exit(error);
+	}
+
+	return hash_table;
+}
+
+static struct hash_table_entry *get_hash_table_entry(struct hash_table_v1 *hash_table,
+                                                     const char *key)
+{
+	assert(key != NULL);
+	uint32_t index = bernstein_hash(key) % HASH_TABLE_CAPACITY;
+	struct hash_table_entry *entry = &hash_table->entries[index];
+	return entry;
+}
+
+static struct list_entry *get_list_entry(struct hash_table_v1 *hash_table,
+                                         const char *key,
+                                         struct list_head *list_head)
+{
+	assert(key != NULL);
+
+	struct list_entry *entry = NULL;
+	
+	SLIST_FOREACH(entry, list_head, pointers) {
+	  if (strcmp(entry->key, key) == 0) {
+	    return entry;
+	  }
+	}
+	return NULL;
+}
+
+bool hash_table_v1_contains(struct hash_table_v1 *hash_table,
+                            const char *key)
+{
+	struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, key);
+	struct list_head *list_head = &hash_table_entry->list_head;
+	struct list_entry *list_entry = get_list_entry(hash_table, key, list_head);
+	return list_entry != NULL;
+}
+
+void hash_table_v1_add_entry(struct hash_table_v1 *hash_table,
+                             const char *key,
+                             uint32_t value)
+{
+	//lock must be enabled before we find the right position, in case position changes 
+	int error = pthread_mutex_lock(&hash_table->mutex);
+	if (error != 0) {
+		exit(error);
+	}
+
+	struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, key);
+	struct list_head *list_head = &hash_table_entry->list_head;
+	struct list_entry *list_entry = get_list_entry(hash_table, key, list_head);
+
+	/* Update the value if it already exists */
+
+	if (list_entry != NULL) {
+		list_entry->value = value;
+		error = pthread_mutex_unlock(&hash_table->mutex);
+		if (error != 0) {
+			exit(error);
+		}
+		return;
+	}
+
+	list_entry = hash_table_alloc(&hash_table->allocator, sizeof(struct list_entry));
+	list_entry->key = key;
+	list_entry->value = value;
+	SLIST_INSERT_HEAD(list_head, list_entry, pointers);
+	++hash_table->size;
+	error = pthread_mutex_unlock(&hash_table->mutex);
+	if (error != 0) exit(error);
+}
+
+uint32_t hash_table_v1_get_value(struct hash_table_v1 *hash_table,
+                                 const char *key)
+{
+	struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, key);
+	struct list_head *list_head = &hash_table_entry->list_head;
+	struct list_entry *list_entry = get_list_entry(hash_table, key, list_head);
+	assert(list_entry != NULL);
+	return list_entry->value;
+}
+
+size_t hash_table_v1_size(struct hash_table_v1 *hash_table)
+{
+	int error = pthread_mutex_lock(&hash_table->mutex);
+	if (error != 0) {
+		exit(error);
+	}
+	size_t size = hash_table->size;
+	error = pthread_mutex_unlock(&hash_table->mutex);
+	if (error != 0) {
+		exit(error);
+	}
+	return size;
+}
+
+struct hash_table_frozen *hash_table_v1_freeze(struct hash_table_v1 *hash_table)
+{
+	int error = pthread_mutex_lock(&hash_table->mutex);
+	if (error != 0) {
+		exit(error);
+	}
+	size_t key_bytes = 0;
+	struct list_entry *list_entry = NULL;
+	for (size_t i = 0; i < HASH_TABLE_CAPACITY; ++i) {
+		SLIST_FOREACH(list_entry, &hash_table->entries[i].list_head, pointers) {
+			key_bytes += strlen(list_entry->key) + 1;
+		}
+	}
+	struct hash_table_frozen *frozen = hash_table_frozen_create(hash_table->size, key_bytes);
+	for (size_t i = 0; i < HASH_TABLE_CAPACITY; ++i) {
+		SLIST_FOREACH(list_entry, &hash_table->entries[i].list_head, pointers) {
+			hash_table_frozen_insert(frozen, list_entry->key, bernstein_hash(list_entry->key), list_entry->value);
+		}
+	}
+	error = pthread_mutex_unlock(&hash_table->mutex);
+	if (error != 0) {
+		exit(error);
+	}
+	return frozen;
+}
+
+static void destroy_range(void *arg, size_t begin, size_t end)
+{
+	struct hash_table_v1 *hash_table = arg;
+	if (hash_table->allocator.bulk_free != NULL) {
+		return;
+	}
+	for (size_t i = begin; i < end; ++i) {
+		struct hash_table_entry *entry = &hash_table->entries[i];
+		struct list_head *list_head = &entry->list_head;
+		struct list_entry *list_entry = NULL;
+		while (!SLIST_EMPTY(list_head)) {
+			list_entry = SLIST_FIRST(list_head);
+			SLIST_REMOVE_HEAD(list_head, pointers);
+			hash_table_free(&hash_table->allocator, list_entry, sizeof(struct list_entry));
+		}
+	}
+}
+
+static void release(void *arg)
+{
+	struct hash_table_v1 *hash_table = arg;
+	int error = pthread_mutex_destroy(&hash_table->mutex);
+	if (error != 0) {
+		exit(error);
+	}
+
+	struct ht_allocator allocator = hash_table->allocator;
+	if (allocator.bulk_free != NULL) {
+		allocator.bulk_free(allocator.context);
+		return;
+	}
+	hash_table_free(&allocator, hash_table, sizeof(struct hash_table_v1));
+}
+
+void hash_table_v1_destroy(struct hash_table_v1 *hash_table)
+{
+	destroy_range(hash_table, 0, HASH_TABLE_CAPACITY);
+	release(hash_table);
+}
+
+void hash_table_v1_destroy_async(struct hash_table_v1 *hash_table,
+                                 uint32_t threads)
+{
+	hash_table_destroy_async(hash_table, threads, destroy_range, release);
+}
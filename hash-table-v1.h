@@ -1,16 +1,23 @@
-#pragma once
-
-#include "hash-table-common.h"
-
-#include <stdbool.h>
-
-struct hash_table_v1;
-struct hash_table_v1 *hash_table_v1_create();
-void hash_table_v1_add_entry(struct hash_table_v1 *hash_table,
-                             const char *key,
-                             uint32_t value);
-bool hash_table_v1_contains(struct hash_table_v1 *hash_table,
-                            const char *key);
-uint32_t hash_table_v1_get_value(struct hash_table_v1 *hash_table,
-                                 const char* key);
-void hash_table_v1_destroy(struct hash_table_v1 *hash_table);
+#pragma once
+
+#include "hash-table-common.h"
+#include "hash-table-frozen.h"
+
+#include <stdbool.h>
+
+struct hash_table_v1;
+struct hash_table_v1 *hash_table_v1_create();
+struct hash_table_v1 *hash_table_v1_create_with_allocator(const struct ht_allocator *allocator);
+void hash_table_v1_add_entry(struct hash_table_v1 *hash_table,
+                             const char *key,
+                             uint32_t value);
+bool hash_table_v1_contains(struct hash_table_v1 *hash_table,
+                            const char *key);
+uint32_t hash_table_v1_get_value(struct hash_table_v1 *hash_table,
+                                 const char* key);
+size_t hash_table_v1_size(struct hash_table_v1 *hash_table);
+/* Copy the current contents into an immutable hash_table_frozen */
+struct hash_table_frozen *hash_table_v1_freeze(struct hash_table_v1 *hash_table);
+void hash_table_v1_destroy(struct hash_table_v1 *hash_table);
+void hash_table_v1_destroy_async(struct hash_table_v1 *hash_table,
+                                 uint32_t threads);
@@ -1,163 +1,1695 @@
-#include "hash-table-base.h"
-
-#include <assert.h>
-#include <stdlib.h>
-#include <string.h>
-#include <sys/queue.h>
-
-#include <pthread.h>
-
-struct list_entry {
-	const char *key;
-	uint32_t value;
-	SLIST_ENTRY(list_entry) pointers;
-};
-
-SLIST_HEAD(list_head, list_entry);
-
-struct hash_table_entry {
-	struct list_head list_head;
-	pthread_mutex_t *mutex;
-};
-
-struct hash_table_v2 {
-	struct hash_table_entry entries[HASH_TABLE_CAPACITY];
-};
-
-struct hash_table_v2 *hash_table_v2_create()
-{
-	struct hash_table_v2 *hash_table = calloc(1, sizeof(struct hash_table_v2));
-	assert(hash_table != NULL);
-	for (size_t i = 0; i < HASH_TABLE_CAPACITY; ++i) {
-		struct hash_table_entry *entry = &hash_table->entries[i];
-		SLIST_INIT(&entry->list_head);
-		// Dynamically allocate mutex
-		entry->mutex = malloc(sizeof(pthread_mutex_t));
-		assert(entry->mutex != NULL);
-		int error = pthread_mutex_init(entry->mutex, NULL);
-		if (error != 0) {
-			// Clean up already allocated mutexes
-			for (size_t j = 0; j < i; ++j) {
-				pthread_mutex_destroy(hash_table->entries[j].mutex);
-				free(hash_table->entries[j].mutex);
-			}
-			free(hash_table);
-			exit(error);
-		}
-	}
-	return hash_table;
-}
-
-static struct hash_table_entry *get_hash_table_entry(struct hash_table_v2 *hash_table,
-                                                     const char *key)
-{
-	assert(key != NULL);
-	uint32_t index = bernstein_hash(key) % HASH_TABLE_CAPACITY;
-	struct hash_table_entry *entry = &hash_table->entries[index];
-	return entry;
-}
-
-static struct list_entry *get_list_entry(struct hash_table_v2 *hash_table,
-                                         const char *key,
-                                         struct list_head *list_head)
-{
-	assert(key != NULL);
-
-	struct list_entry *entry = NULL;
-	
-	SLIST_FOREACH(entry, list_head, pointers) {
-	  if (strcmp(entry->key, key) == 0) {
-	    return entry;
-	  }
-	}
-	return NULL;
-}
-
-bool hash_table_v2_contains(struct hash_table_v2 *hash_table,
-                            const char *key)
-{
-	struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, key);
-	struct list_head *list_head = &hash_table_entry->list_head;
-	// Lock using mutex pointer
-	int error = pthread_mutex_lock(hash_table_entry->mutex);
-	if (error != 0) {
-		exit(error);
-	}
-	struct list_entry *list_entry = get_list_entry(hash_table, key, list_head);
-	error = pthread_mutex_unlock(hash_table_entry->mutex);
-	if (error != 0) {
-		exit(error);
-	}
-	return list_entry != NULL;
-}
-
-void hash_table_v2_add_entry(struct hash_table_v2 *hash_table,
-                             const char *key,
-                             uint32_t value)
-{
-	struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, key);
-	struct list_head *list_head = &hash_table_entry->list_head;
-	struct list_entry *list_entry = get_list_entry(hash_table, key, list_head);
-
-	/* Update the value if it already exists */
-	if (list_entry != NULL) {
-		list_entry->value = value;
-		return;
-	}
-	list_entry = calloc(1, sizeof(struct list_entry));
-	list_entry->key = key;
-	list_entry->value = value;
-	
-	// Lock using mutex pointer
-	int error = pthread_mutex_lock(hash_table_entry->mutex);
-	if (error != 0) {
-		exit(error);
-	}
-	
-	SLIST_INSERT_HEAD(list_head, list_entry, pointers);
-	error = pthread_mutex_unlock(hash_table_entry->mutex);
-	if (error != 0) {
-		exit(error);
-	}
-}
-
-uint32_t hash_table_v2_get_value(struct hash_table_v2 *hash_table,
-                                 const char *key)
-{
-	struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, key);
-	struct list_head *list_head = &hash_table_entry->list_head;
-	// Lock using mutex pointer
-	int error = pthread_mutex_lock(hash_table_entry->mutex);
-	if (error != 0) {
-		exit(error);
-	}
-	struct list_entry *list_entry = get_list_entry(hash_table, key, list_head);
-	assert(list_entry != NULL);
-	uint32_t value = list_entry->value;
-	error = pthread_mutex_unlock(hash_table_entry->mutex);
-	if (error != 0) {
-		exit(error);
-	}
-	return value;
-}
-
-void hash_table_v2_destroy(struct hash_table_v2 *hash_table)
-{
-	for (size_t i = 0; i < HASH_TABLE_CAPACITY; ++i) {
-		struct hash_table_entry *entry = &hash_table->entries[i];
-		struct list_head *list_head = &entry->list_head;
-		struct list_entry *list_entry = NULL;
-		while (!SLIST_EMPTY(list_head)) {
-			list_entry = SLIST_FIRST(list_head);
-			SLIST_REMOVE_HEAD(list_head, pointers);
-			free(list_entry);
-		}
-		// Destroy and free the mutex
-		int error = pthread_mutex_destroy(entry->mutex);
-		if (error != 0) {
-			exit(error);
-		}
-		free(entry->mutex);
-	}
-	free(hash_table);
-}
\ No newline at end of file
+#include "hash-table-v2.h"
+#include "hash-table-counter.h"
+#include "hash-table-index.h"
+#include "hash-table-snapshot.h"
+#include "hash-table-wal.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <pthread.h>
+
+#define CACHE_LINE_SIZE 64
+#define LOOKUP_CACHE_CAPACITY 1024
+
+/* Newest first, only used by versioned tables */
+struct version {
+	uint64_t version;
+	uint32_t value;
+	struct version *next;
+};
+
+struct list_entry {
+	const char *key;
+	uint32_t hash;
+	uint32_t value;
+	struct version *versions;
+	SLIST_ENTRY(list_entry) pointers;
+};
+
+SLIST_HEAD(list_head, list_entry);
+
+/*
+ * generation is bumped by every write to the bucket, see get_value_cached,
+ * and dirty is the checkpoint epoch of the last one, see
+ * hash_table_v2_checkpoint. block holds the first block_length nodes of
+ * the chain once the bucket has been compacted, nodes inserted since are
+ * still allocated on their own.
+ */
+struct hash_table_entry {
+	struct list_head list_head;
+	_Atomic uint32_t generation;
+	uint32_t length;
+	uint32_t block_length;
+	struct list_entry *block;
+	struct hash_table_index *index;
+	pthread_mutex_t *mutex;
+	uint64_t dirty;
+};
+
+/*
+ * State most tables never touch, kept out of struct hash_table_v2 so a
+ * small table stays small. It is created on first use, or with the table
+ * when the allocator is not the default one; until then every field reads
+ * as zero and the allocator as hash_table_default_allocator.
+ *
+ * After hash_table_v2_reserve new nodes come from the prefaulted pool until
+ * it runs out, and new or growing bucket indexes from the index arena,
+ * which is sized for the worst case but only touched where a chain grows
+ * long; neither is ever freed piece by piece. A table made by
+ * hash_table_v2_load or recovered from a log owns the file contents its
+ * keys point into, as well as those of every checkpoint applied to it.
+ */
+struct extras {
+	struct ht_allocator allocator;
+	struct mvcc *mvcc;
+	struct list_entry *pool;
+	size_t pool_capacity;
+	_Atomic size_t pool_next;
+	/* Bucket indexes made after a reservation are carved out of index_arena */
+	struct ht_allocator index_allocator;
+	char *index_arena;
+	size_t index_arena_capacity;
+	_Atomic size_t index_arena_next;
+	char *snapshot;
+	char **deltas;
+	size_t delta_count;
+	struct hash_table_wal *wal;
+	/* Writes are tagged epoch + 1, those tagged up to checkpointed are saved */
+	_Atomic uint64_t epoch;
+	uint64_t checkpointed;
+	uint64_t small_dirty;
+};
+
+/*
+ * Tables start small: the first HASH_TABLE_SMALL_CAPACITY entries live
+ * inline under small_mutex. Once the table grows past that the bucket array
+ * (and its per-bucket mutexes) is allocated and published through entries,
+ * which never changes again. The sharded entry counter is only needed from
+ * then on too. Everything that grows with the table comes from the
+ * allocator; the counter, the extras and MVCC state are a fixed size per
+ * table, so they stay on the C allocator.
+ */
+struct hash_table_v2 {
+	struct hash_table_entry *_Atomic entries;
+	pthread_mutex_t small_mutex;
+	uint32_t small_size;
+	const char *small_keys[HASH_TABLE_SMALL_CAPACITY];
+	uint32_t small_values[HASH_TABLE_SMALL_CAPACITY];
+	enum hash_table_chain_policy chain_policy;
+	uint64_t id;
+	struct hash_table_counter *counter;
+	struct extras *_Atomic extras;
+};
+
+/*
+ * Per-thread direct-mapped cache of recent lookups. A slot is valid while
+ * its bucket's generation is unchanged. Tables get a unique id so a slot
+ * can never match a different table allocated at the same address.
+ */
+struct lookup_cache_slot {
+	uint64_t table_id;
+	const char *key;
+	uint32_t hash;
+	uint32_t generation;
+	uint32_t value;
+};
+
+static _Atomic uint64_t next_table_id = 1;
+static _Thread_local struct lookup_cache_slot lookup_cache[LOOKUP_CACHE_CAPACITY];
+
+/*
+ * Versions are handed out under the bucket lock but become visible to
+ * readers strictly in order, so a snapshot never misses an older write that
+ * was still being published. A reader slot holds its snapshot plus one, zero
+ * meaning free, and the oldest slot decides which versions can be freed.
+ */
+struct reader_slot {
+	_Atomic uint64_t version;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct mvcc {
+	_Atomic uint64_t next;
+	_Atomic uint64_t visible;
+	struct reader_slot readers[HASH_TABLE_V2_MAX_READERS];
+};
+
+static struct extras *peek_extras(struct hash_table_v2 *hash_table)
+{
+	return atomic_load_explicit(&hash_table->extras, memory_order_acquire);
+}
+
+/* Creates the extras on first use, racing callers agree on one */
+static struct extras *get_extras(struct hash_table_v2 *hash_table)
+{
+	struct extras *extras = peek_extras(hash_table);
+	if (extras != NULL) {
+		return extras;
+	}
+	struct extras *fresh = calloc(1, sizeof(struct extras));
+	assert(fresh != NULL);
+	fresh->allocator = hash_table_default_allocator;
+	/* Small writes made before now were not tagged, so they count as dirty */
+	fresh->small_dirty = 1;
+	if (atomic_compare_exchange_strong(&hash_table->extras, &extras, fresh)) {
+		return fresh;
+	}
+	free(fresh);
+	return extras;
+}
+
+static const struct ht_allocator *table_allocator(struct hash_table_v2 *hash_table)
+{
+	struct extras *extras = peek_extras(hash_table);
+	return extras != NULL ? &extras->allocator : &hash_table_default_allocator;
+}
+
+/* The index arena once the table is reserved, the table's allocator before */
+static const struct ht_allocator *index_allocator(struct hash_table_v2 *hash_table)
+{
+	struct extras *extras = peek_extras(hash_table);
+	if (extras != NULL && extras->index_arena != NULL) {
+		return &extras->index_allocator;
+	}
+	return table_allocator(hash_table);
+}
+
+static struct mvcc *get_mvcc(struct hash_table_v2 *hash_table)
+{
+	struct extras *extras = peek_extras(hash_table);
+	return extras != NULL ? extras->mvcc : NULL;
+}
+
+static struct hash_table_wal *get_wal(struct hash_table_v2 *hash_table)
+{
+	struct extras *extras = peek_extras(hash_table);
+	return extras != NULL ? extras->wal : NULL;
+}
+
+struct hash_table_v2 *hash_table_v2_create()
+{
+	return hash_table_v2_create_with_allocator(&hash_table_default_allocator);
+}
+
+struct hash_table_v2 *hash_table_v2_create_with_allocator(const struct ht_allocator *allocator)
+{
+	struct hash_table_v2 *hash_table = hash_table_alloc(allocator, sizeof(struct hash_table_v2));
+	if (allocator != &hash_table_default_allocator) {
+		get_extras(hash_table)->allocator = *allocator;
+	}
+	int error = pthread_mutex_init(&hash_table->small_mutex, NULL);
+	if (error != 0) {
+		hash_table_free(allocator, hash_table, sizeof(struct hash_table_v2));
+		exit(error);
+	}
+	hash_table->id = atomic_fetch_add(&next_table_id, 1);
+	return hash_table;
+}
+
+static struct hash_table_entry *create_entries(const struct ht_allocator *allocator)
+{
+	struct hash_table_entry *entries = hash_table_alloc(allocator,
+	                                                    HASH_TABLE_CAPACITY * sizeof(struct hash_table_entry));
+	for (size_t i = 0; i < HASH_TABLE_CAPACITY; ++i) {
+		struct hash_table_entry *entry = &entries[i];
+		SLIST_INIT(&entry->list_head);
+		// Dynamically allocate mutex
+		entry->mutex = hash_table_alloc(allocator, sizeof(pthread_mutex_t));
+		int error = pthread_mutex_init(entry->mutex, NULL);
+		if (error != 0) {
+			// Clean up already allocated mutexes
+			for (size_t j = 0; j < i; ++j) {
+				pthread_mutex_destroy(entries[j].mutex);
+				hash_table_free(allocator, entries[j].mutex, sizeof(pthread_mutex_t));
+			}
+			hash_table_free(allocator, entry->mutex, sizeof(pthread_mutex_t));
+			hash_table_free(allocator, entries, HASH_TABLE_CAPACITY * sizeof(struct hash_table_entry));
+			exit(error);
+		}
+	}
+	return entries;
+}
+
+static void promote(struct hash_table_v2 *hash_table);
+
+static struct list_entry *alloc_list_entry(struct hash_table_v2 *hash_table)
+{
+	struct extras *extras = peek_extras(hash_table);
+	if (extras != NULL && extras->pool != NULL
+	    && atomic_load_explicit(&extras->pool_next, memory_order_relaxed) < extras->pool_capacity) {
+		size_t i = atomic_fetch_add_explicit(&extras->pool_next, 1, memory_order_relaxed);
+		if (i < extras->pool_capacity) {
+			return &extras->pool[i];
+		}
+	}
+	return hash_table_alloc(table_allocator(hash_table), sizeof(struct list_entry));
+}
+
+static bool in_pool(struct hash_table_v2 *hash_table,
+                    struct list_entry *list_entry)
+{
+	struct extras *extras = peek_extras(hash_table);
+	return extras != NULL && extras->pool != NULL
+	       && list_entry >= extras->pool
+	       && list_entry < extras->pool + extras->pool_capacity;
+}
+
+struct hash_table_v2 *hash_table_v2_create_versioned()
+{
+	struct hash_table_v2 *hash_table = hash_table_v2_create();
+	struct mvcc *mvcc = aligned_alloc(CACHE_LINE_SIZE, sizeof(struct mvcc));
+	assert(mvcc != NULL);
+	memset(mvcc, 0, sizeof(struct mvcc));
+	get_extras(hash_table)->mvcc = mvcc;
+	/* Lock-free readers need the buckets from the start */
+	promote(hash_table);
+	return hash_table;
+}
+
+static struct hash_table_entry *get_hash_table_entry(struct hash_table_v2 *hash_table,
+                                                     uint32_t hash)
+{
+	uint32_t index = hash % HASH_TABLE_CAPACITY;
+	struct hash_table_entry *entries = atomic_load_explicit(&hash_table->entries, memory_order_acquire);
+	struct hash_table_entry *entry = &entries[index];
+	return entry;
+}
+
+/* Read with the lock covering the write held, see hash_table_v2_checkpoint */
+static uint64_t dirty_epoch(struct hash_table_v2 *hash_table)
+{
+	struct extras *extras = peek_extras(hash_table);
+	return (extras != NULL ? atomic_load(&extras->epoch) : 0) + 1;
+}
+
+/* Called with small_mutex held, without extras nothing is checkpointed yet */
+static void mark_small_dirty(struct hash_table_v2 *hash_table)
+{
+	struct extras *extras = peek_extras(hash_table);
+	if (extras != NULL) {
+		extras->small_dirty = atomic_load(&extras->epoch) + 1;
+	}
+}
+
+static uint64_t small_dirty(struct hash_table_v2 *hash_table)
+{
+	struct extras *extras = peek_extras(hash_table);
+	return extras != NULL ? extras->small_dirty : 1;
+}
+
+/* Move a hit towards the head of its chain, previous is never NULL */
+static void reorder_list_entry(enum hash_table_chain_policy chain_policy,
+                               struct hash_table_entry *hash_table_entry,
+                               struct list_entry *entry,
+                               struct list_entry *previous,
+                               struct list_entry *before_previous)
+{
+	struct list_head *list_head = &hash_table_entry->list_head;
+	switch (chain_policy) {
+	case HASH_TABLE_CHAIN_FIXED:
+		break;
+	case HASH_TABLE_CHAIN_MOVE_TO_FRONT:
+		SLIST_NEXT(previous, pointers) = SLIST_NEXT(entry, pointers);
+		SLIST_NEXT(entry, pointers) = SLIST_FIRST(list_head);
+		SLIST_FIRST(list_head) = entry;
+		break;
+	case HASH_TABLE_CHAIN_TRANSPOSE:
+		SLIST_NEXT(previous, pointers) = SLIST_NEXT(entry, pointers);
+		SLIST_NEXT(entry, pointers) = previous;
+		if (before_previous == NULL) {
+			SLIST_FIRST(list_head) = entry;
+		}
+		else {
+			SLIST_NEXT(before_previous, pointers) = entry;
+		}
+		break;
+	}
+}
+
+static struct list_entry *get_list_entry(struct hash_table_v2 *hash_table,
+                                         const char *key,
+                                         uint32_t hash,
+                                         struct hash_table_entry *hash_table_entry)
+{
+	assert(key != NULL);
+
+	struct hash_table_index *index = hash_table_entry->index;
+	if (index != NULL) {
+		for (size_t i = hash_table_index_lower_bound(index, hash);
+		     i < index->size && index->hashes[i] == hash; ++i) {
+			struct list_entry *entry = index->entries[i];
+			if (strcmp(entry->key, key) == 0) {
+				return entry;
+			}
+		}
+		return NULL;
+	}
+
+	struct list_entry *entry = NULL;
+	struct list_entry *previous = NULL;
+	struct list_entry *before_previous = NULL;
+	
+	SLIST_FOREACH(entry, &hash_table_entry->list_head, pointers) {
+	  if (entry->hash == hash && strcmp(entry->key, key) == 0) {
+	    if (previous != NULL) {
+	      reorder_list_entry(hash_table->chain_policy, hash_table_entry, entry, previous, before_previous);
+	    }
+	    return entry;
+	  }
+	  before_previous = previous;
+	  previous = entry;
+	}
+	return NULL;
+}
+
+/*
+ * Link a new entry, promoting the bucket to an index once its chain is long.
+ * Called with the bucket's mutex held (or before the buckets are published).
+ */
+static void link_list_entry(struct hash_table_v2 *hash_table,
+                            struct hash_table_entry *hash_table_entry,
+                            struct list_entry *list_entry)
+{
+	/* Publish the fully built entry for get_value_at, which takes no lock */
+	SLIST_NEXT(list_entry, pointers) = SLIST_FIRST(&hash_table_entry->list_head);
+	__atomic_store_n(&SLIST_FIRST(&hash_table_entry->list_head), list_entry, __ATOMIC_RELEASE);
+	++hash_table_entry->length;
+	if (hash_table_entry->index != NULL) {
+		hash_table_index_insert(hash_table_entry->index, list_entry->hash, list_entry);
+	}
+	else if (hash_table_entry->length > HASH_TABLE_INDEX_THRESHOLD) {
+		struct hash_table_index *index = hash_table_index_create(index_allocator(hash_table),
+		                                                         2 * HASH_TABLE_INDEX_THRESHOLD);
+		struct list_entry *entry = NULL;
+		SLIST_FOREACH(entry, &hash_table_entry->list_head, pointers) {
+			hash_table_index_insert(index, entry->hash, entry);
+		}
+		hash_table_entry->index = index;
+	}
+}
+
+/*
+ * Returns true with small_mutex held if the table is still small, false if
+ * the bucket array is in place and the per-bucket mutexes apply.
+ */
+static bool lock_small(struct hash_table_v2 *hash_table)
+{
+	if (atomic_load_explicit(&hash_table->entries, memory_order_acquire) != NULL) {
+		return false;
+	}
+	int error = pthread_mutex_lock(&hash_table->small_mutex);
+	if (error != 0) {
+		exit(error);
+	}
+	if (atomic_load_explicit(&hash_table->entries, memory_order_relaxed) != NULL) {
+		error = pthread_mutex_unlock(&hash_table->small_mutex);
+		if (error != 0) {
+			exit(error);
+		}
+		return false;
+	}
+	return true;
+}
+
+static void unlock_small(struct hash_table_v2 *hash_table)
+{
+	int error = pthread_mutex_unlock(&hash_table->small_mutex);
+	if (error != 0) {
+		exit(error);
+	}
+}
+
+static int get_small_index(struct hash_table_v2 *hash_table,
+                           const char *key)
+{
+	assert(key != NULL);
+	for (uint32_t i = 0; i < hash_table->small_size; ++i) {
+		if (strcmp(hash_table->small_keys[i], key) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* Called with small_mutex held, nobody can reach the buckets until they are published */
+static void promote(struct hash_table_v2 *hash_table)
+{
+	struct hash_table_entry *entries = create_entries(table_allocator(hash_table));
+	for (uint32_t i = 0; i < hash_table->small_size; ++i) {
+		const char *key = hash_table->small_keys[i];
+		uint32_t hash = bernstein_hash(key);
+		struct hash_table_entry *hash_table_entry = &entries[hash % HASH_TABLE_CAPACITY];
+		struct list_entry *list_entry = alloc_list_entry(hash_table);
+		list_entry->key = key;
+		list_entry->hash = hash;
+		list_entry->value = hash_table->small_values[i];
+		link_list_entry(hash_table, hash_table_entry, list_entry);
+		hash_table_entry->dirty = small_dirty(hash_table);
+	}
+	hash_table->counter = hash_table_counter_create();
+	hash_table_counter_add(hash_table->counter, hash_table->small_size);
+	hash_table->small_size = 0;
+	atomic_store_explicit(&hash_table->entries, entries, memory_order_release);
+}
+
+static uint64_t oldest_reader(struct mvcc *mvcc)
+{
+	uint64_t oldest = atomic_load(&mvcc->visible);
+	for (size_t i = 0; i < HASH_TABLE_V2_MAX_READERS; ++i) {
+		uint64_t version = atomic_load(&mvcc->readers[i].version);
+		if (version != 0 && version - 1 < oldest) {
+			oldest = version - 1;
+		}
+	}
+	return oldest;
+}
+
+/*
+ * Called with the bucket lock held. Pushes a new version and frees the ones
+ * no reader can reach any more: everything past the newest version the
+ * oldest reader can see.
+ */
+static uint64_t push_version(struct hash_table_v2 *hash_table,
+                             struct list_entry *list_entry,
+                             uint32_t value)
+{
+	struct mvcc *mvcc = get_mvcc(hash_table);
+	struct version *version = hash_table_alloc(table_allocator(hash_table), sizeof(struct version));
+	version->version = atomic_fetch_add(&mvcc->next, 1) + 1;
+	version->value = value;
+	version->next = list_entry->versions;
+	__atomic_store_n(&list_entry->versions, version, __ATOMIC_RELEASE);
+
+	uint64_t oldest = oldest_reader(mvcc);
+	struct version *visible = version;
+	while (visible != NULL && visible->version > oldest) {
+		visible = visible->next;
+	}
+	if (visible != NULL) {
+		struct version *garbage = visible->next;
+		__atomic_store_n(&visible->next, NULL, __ATOMIC_RELEASE);
+		while (garbage != NULL) {
+			struct version *next = garbage->next;
+			hash_table_free(table_allocator(hash_table), garbage, sizeof(struct version));
+			garbage = next;
+		}
+	}
+	return version->version;
+}
+
+/* Make version visible once every earlier version is */
+static void commit_version(struct mvcc *mvcc, uint64_t version)
+{
+	while (atomic_load(&mvcc->visible) != version - 1) {
+		sched_yield();
+	}
+	atomic_store(&mvcc->visible, version);
+}
+
+void hash_table_v2_begin_read(struct hash_table_v2 *hash_table,
+                              struct hash_table_v2_reader *reader)
+{
+	static _Atomic uint32_t next_thread;
+	static _Thread_local int thread_slot = -1;
+
+	struct mvcc *mvcc = get_mvcc(hash_table);
+	assert(mvcc != NULL);
+	if (thread_slot < 0) {
+		thread_slot = atomic_fetch_add(&next_thread, 1) % HASH_TABLE_V2_MAX_READERS;
+	}
+	for (uint32_t i = thread_slot, tried = 1; ; i = (i + 1) % HASH_TABLE_V2_MAX_READERS, ++tried) {
+		uint64_t version = atomic_load(&mvcc->visible);
+		uint64_t expected = 0;
+		if (atomic_compare_exchange_strong(&mvcc->readers[i].version, &expected, version + 1)) {
+			/*
+			 * A writer may have read the reader slots before we took this
+			 * one, so only settle on a snapshot still current afterwards.
+			 */
+			uint64_t current = atomic_load(&mvcc->visible);
+			while (current != version) {
+				version = current;
+				atomic_store(&mvcc->readers[i].version, version + 1);
+				current = atomic_load(&mvcc->visible);
+			}
+			reader->slot = i;
+			reader->version = version;
+			return;
+		}
+		/* Every slot is taken, wait for a snapshot to close */
+		if (tried % HASH_TABLE_V2_MAX_READERS == 0) {
+			sched_yield();
+		}
+	}
+}
+
+void hash_table_v2_end_read(struct hash_table_v2 *hash_table,
+                            struct hash_table_v2_reader *reader)
+{
+	atomic_store(&get_mvcc(hash_table)->readers[reader->slot].version, 0);
+}
+
+bool hash_table_v2_get_value_at(struct hash_table_v2 *hash_table,
+                                const char *key,
+                                uint64_t version,
+                                uint32_t *value)
+{
+	assert(key != NULL);
+	assert(get_mvcc(hash_table) != NULL);
+	uint32_t hash = bernstein_hash(key);
+	struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, hash);
+	struct list_entry *list_entry = __atomic_load_n(&SLIST_FIRST(&hash_table_entry->list_head), __ATOMIC_ACQUIRE);
+	for (; list_entry != NULL; list_entry = SLIST_NEXT(list_entry, pointers)) {
+		if (list_entry->hash != hash || strcmp(list_entry->key, key) != 0) {
+			continue;
+		}
+		struct version *current = __atomic_load_n(&list_entry->versions, __ATOMIC_ACQUIRE);
+		for (; current != NULL; current = __atomic_load_n(&current->next, __ATOMIC_ACQUIRE)) {
+			if (current->version <= version) {
+				*value = current->value;
+				return true;
+			}
+		}
+		return false;
+	}
+	return false;
+}
+
+bool hash_table_v2_contains(struct hash_table_v2 *hash_table,
+                            const char *key)
+{
+	if (lock_small(hash_table)) {
+		bool found = get_small_index(hash_table, key) >= 0;
+		unlock_small(hash_table);
+		return found;
+	}
+	uint32_t hash = bernstein_hash(key);
+	struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, hash);
+	// Lock using mutex pointer
+	int error = pthread_mutex_lock(hash_table_entry->mutex);
+	if (error != 0) {
+		exit(error);
+	}
+	struct list_entry *list_entry = get_list_entry(hash_table, key, hash, hash_table_entry);
+	error = pthread_mutex_unlock(hash_table_entry->mutex);
+	if (error != 0) {
+		exit(error);
+	}
+	return list_entry != NULL;
+}
+
+/*
+ * Called with the lock that orders writes to key held, so the log and the
+ * table agree on which write came last. Returns 0 without a log.
+ */
+static uint64_t log_entry(struct hash_table_v2 *hash_table,
+                          const char *key,
+                          uint32_t value)
+{
+	struct hash_table_wal *wal = get_wal(hash_table);
+	if (wal == NULL) {
+		return 0;
+	}
+	return hash_table_wal_append(wal, key, value);
+}
+
+/* Called after the lock is dropped, the sync is shared with other writers */
+static void wait_logged(struct hash_table_v2 *hash_table, uint64_t ticket)
+{
+	if (ticket != 0) {
+		hash_table_wal_wait(get_wal(hash_table), ticket);
+	}
+}
+
+/* Sets key to value, or adds value to it (a new key starts at 0) if add is set */
+static void store(struct hash_table_v2 *hash_table,
+                  const char *key,
+                  uint32_t value,
+                  bool add)
+{
+	if (lock_small(hash_table)) {
+		int index = get_small_index(hash_table, key);
+		if (index >= 0) {
+			if (add) {
+				value += hash_table->small_values[index];
+			}
+			hash_table->small_values[index] = value;
+			mark_small_dirty(hash_table);
+			uint64_t ticket = log_entry(hash_table, key, value);
+			unlock_small(hash_table);
+			wait_logged(hash_table, ticket);
+			return;
+		}
+		if (hash_table->small_size < HASH_TABLE_SMALL_CAPACITY) {
+			hash_table->small_keys[hash_table->small_size] = key;
+			hash_table->small_values[hash_table->small_size] = value;
+			++hash_table->small_size;
+			mark_small_dirty(hash_table);
+			uint64_t ticket = log_entry(hash_table, key, value);
+			unlock_small(hash_table);
+			wait_logged(hash_table, ticket);
+			return;
+		}
+		promote(hash_table);
+		unlock_small(hash_table);
+	}
+
+	uint32_t hash = bernstein_hash(key);
+	struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, hash);
+
+	// Lock using mutex pointer, the lookup has to happen under it too
+	int error = pthread_mutex_lock(hash_table_entry->mutex);
+	if (error != 0) {
+		exit(error);
+	}
+
+	struct list_entry *list_entry = get_list_entry(hash_table, key, hash, hash_table_entry);
+	uint64_t version = 0;
+	bool inserted = false;
+
+	/* Update the value if it already exists */
+	if (list_entry != NULL) {
+		if (add) {
+			value += list_entry->value;
+		}
+		list_entry->value = value;
+		if (get_mvcc(hash_table) != NULL) {
+			version = push_version(hash_table, list_entry, value);
+		}
+	}
+	else {
+		list_entry = alloc_list_entry(hash_table);
+		list_entry->key = key;
+		list_entry->hash = hash;
+		list_entry->value = value;
+		inserted = true;
+		if (get_mvcc(hash_table) != NULL) {
+			version = push_version(hash_table, list_entry, value);
+		}
+		link_list_entry(hash_table, hash_table_entry, list_entry);
+	}
+	atomic_fetch_add_explicit(&hash_table_entry->generation, 1, memory_order_release);
+	hash_table_entry->dirty = dirty_epoch(hash_table);
+	uint64_t ticket = log_entry(hash_table, key, value);
+	error = pthread_mutex_unlock(hash_table_entry->mutex);
+	if (error != 0) {
+		exit(error);
+	}
+	if (inserted) {
+		hash_table_counter_add(hash_table->counter, 1);
+	}
+	if (version != 0) {
+		commit_version(get_mvcc(hash_table), version);
+	}
+	wait_logged(hash_table, ticket);
+}
+
+void hash_table_v2_add_entry(struct hash_table_v2 *hash_table,
+                             const char *key,
+                             uint32_t value)
+{
+	store(hash_table, key, value, false);
+}
+
+void hash_table_v2_add_count(struct hash_table_v2 *hash_table,
+                             const char *key,
+                             uint32_t delta)
+{
+	store(hash_table, key, delta, true);
+}
+
+struct batch_item {
+	uint32_t hash;
+	uint32_t index;
+};
+
+static int compare_batch_items(const void *a, const void *b)
+{
+	uint32_t left = ((const struct batch_item *) a)->hash % HASH_TABLE_CAPACITY;
+	uint32_t right = ((const struct batch_item *) b)->hash % HASH_TABLE_CAPACITY;
+	return (left > right) - (left < right);
+}
+
+void hash_table_v2_add_counts(struct hash_table_v2 *hash_table,
+                              const char **keys,
+                              const uint32_t *deltas,
+                              size_t count)
+{
+	bool small = lock_small(hash_table);
+	if (small) {
+		unlock_small(hash_table);
+	}
+	/* Versions and log records are per write, so those tables go key by key */
+	if (small || get_mvcc(hash_table) != NULL || get_wal(hash_table) != NULL) {
+		for (size_t i = 0; i < count; ++i) {
+			hash_table_v2_add_count(hash_table, keys[i], deltas[i]);
+		}
+		return;
+	}
+
+	struct batch_item *items = malloc(count * sizeof(struct batch_item));
+	assert(count == 0 || items != NULL);
+	for (size_t i = 0; i < count; ++i) {
+		items[i].hash = bernstein_hash(keys[i]);
+		items[i].index = i;
+	}
+	qsort(items, count, sizeof(struct batch_item), compare_batch_items);
+
+	size_t inserted = 0;
+	for (size_t begin = 0; begin < count; ) {
+		struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, items[begin].hash);
+		int error = pthread_mutex_lock(hash_table_entry->mutex);
+		if (error != 0) {
+			exit(error);
+		}
+		size_t end = begin;
+		for (; end < count
+		       && items[end].hash % HASH_TABLE_CAPACITY == items[begin].hash % HASH_TABLE_CAPACITY; ++end) {
+			const char *key = keys[items[end].index];
+			uint32_t hash = items[end].hash;
+			struct list_entry *list_entry = get_list_entry(hash_table, key, hash, hash_table_entry);
+			if (list_entry != NULL) {
+				list_entry->value += deltas[items[end].index];
+				continue;
+			}
+			list_entry = alloc_list_entry(hash_table);
+			list_entry->key = key;
+			list_entry->hash = hash;
+			list_entry->value = deltas[items[end].index];
+			link_list_entry(hash_table, hash_table_entry, list_entry);
+			++inserted;
+		}
+		atomic_fetch_add_explicit(&hash_table_entry->generation, 1, memory_order_release);
+		hash_table_entry->dirty = dirty_epoch(hash_table);
+		error = pthread_mutex_unlock(hash_table_entry->mutex);
+		if (error != 0) {
+			exit(error);
+		}
+		begin = end;
+	}
+	hash_table_counter_add(hash_table->counter, inserted);
+	free(items);
+}
+
+uint32_t hash_table_v2_get_value(struct hash_table_v2 *hash_table,
+                                 const char *key)
+{
+	if (lock_small(hash_table)) {
+		int index = get_small_index(hash_table, key);
+		assert(index >= 0);
+		uint32_t value = hash_table->small_values[index];
+		unlock_small(hash_table);
+		return value;
+	}
+	uint32_t hash = bernstein_hash(key);
+	struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, hash);
+	// Lock using mutex pointer
+	int error = pthread_mutex_lock(hash_table_entry->mutex);
+	if (error != 0) {
+		exit(error);
+	}
+	struct list_entry *list_entry = get_list_entry(hash_table, key, hash, hash_table_entry);
+	assert(list_entry != NULL);
+	uint32_t value = list_entry->value;
+	error = pthread_mutex_unlock(hash_table_entry->mutex);
+	if (error != 0) {
+		exit(error);
+	}
+	return value;
+}
+
+uint32_t hash_table_v2_get_value_cached(struct hash_table_v2 *hash_table,
+                                        const char *key)
+{
+	if (atomic_load_explicit(&hash_table->entries, memory_order_acquire) == NULL) {
+		return hash_table_v2_get_value(hash_table, key);
+	}
+	uint32_t hash = bernstein_hash(key);
+	struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, hash);
+	struct lookup_cache_slot *slot = &lookup_cache[hash % LOOKUP_CACHE_CAPACITY];
+	if (slot->table_id == hash_table->id && slot->hash == hash
+	    && slot->generation == atomic_load_explicit(&hash_table_entry->generation, memory_order_acquire)
+	    && (slot->key == key || strcmp(slot->key, key) == 0)) {
+		return slot->value;
+	}
+
+	int error = pthread_mutex_lock(hash_table_entry->mutex);
+	if (error != 0) {
+		exit(error);
+	}
+	struct list_entry *list_entry = get_list_entry(hash_table, key, hash, hash_table_entry);
+	assert(list_entry != NULL);
+	slot->table_id = hash_table->id;
+	slot->key = list_entry->key;
+	slot->hash = hash;
+	slot->generation = atomic_load_explicit(&hash_table_entry->generation, memory_order_relaxed);
+	slot->value = list_entry->value;
+	error = pthread_mutex_unlock(hash_table_entry->mutex);
+	if (error != 0) {
+		exit(error);
+	}
+	return slot->value;
+}
+
+size_t hash_table_v2_size(struct hash_table_v2 *hash_table)
+{
+	if (lock_small(hash_table)) {
+		size_t size = hash_table->small_size;
+		unlock_small(hash_table);
+		return size;
+	}
+	return hash_table_counter_read(hash_table->counter);
+}
+
+void hash_table_v2_set_chain_policy(struct hash_table_v2 *hash_table,
+                                    enum hash_table_chain_policy chain_policy)
+{
+	/* get_value_at walks chains without a lock and cannot follow a reorder */
+	assert(get_mvcc(hash_table) == NULL || chain_policy == HASH_TABLE_CHAIN_FIXED);
+	hash_table->chain_policy = chain_policy;
+}
+
+size_t hash_table_v2_chain_depth(struct hash_table_v2 *hash_table,
+                                 const char *key)
+{
+	if (lock_small(hash_table)) {
+		size_t depth = get_small_index(hash_table, key) + 1;
+		unlock_small(hash_table);
+		return depth;
+	}
+	uint32_t hash = bernstein_hash(key);
+	struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, hash);
+	int error = pthread_mutex_lock(hash_table_entry->mutex);
+	if (error != 0) {
+		exit(error);
+	}
+	size_t depth = 0;
+	size_t position = 0;
+	struct list_entry *entry = NULL;
+	SLIST_FOREACH(entry, &hash_table_entry->list_head, pointers) {
+		++position;
+		if (entry->hash == hash && strcmp(entry->key, key) == 0) {
+			depth = position;
+			break;
+		}
+	}
+	error = pthread_mutex_unlock(hash_table_entry->mutex);
+	if (error != 0) {
+		exit(error);
+	}
+	return depth;
+}
+
+static bool in_block(struct hash_table_entry *hash_table_entry,
+                     struct list_entry *list_entry)
+{
+	return hash_table_entry->block != NULL
+	       && list_entry >= hash_table_entry->block
+	       && list_entry < hash_table_entry->block + hash_table_entry->block_length;
+}
+
+/*
+ * Called with the bucket lock held. Copies the chain, in chain order, into
+ * one contiguous block and frees the old nodes. Each old node is left
+ * pointing at its copy so the index can be redirected before it is freed.
+ */
+static void compact_bucket(struct hash_table_v2 *hash_table,
+                           struct hash_table_entry *hash_table_entry)
+{
+	uint32_t length = hash_table_entry->length;
+	if (length == 0 || hash_table_entry->block_length == length) {
+		return;
+	}
+
+	const struct ht_allocator *allocator = table_allocator(hash_table);
+	struct list_entry *block = hash_table_alloc(allocator, length * sizeof(struct list_entry));
+	struct list_entry **old = hash_table_alloc(allocator, length * sizeof(struct list_entry *));
+	uint32_t i = 0;
+	struct list_entry *list_entry = NULL;
+	SLIST_FOREACH(list_entry, &hash_table_entry->list_head, pointers) {
+		old[i] = list_entry;
+		block[i] = *list_entry;
+		SLIST_NEXT(&block[i], pointers) = (i + 1 < length) ? &block[i + 1] : NULL;
+		++i;
+	}
+	for (i = 0; i < length; ++i) {
+		SLIST_NEXT(old[i], pointers) = &block[i];
+	}
+	if (hash_table_entry->index != NULL) {
+		struct hash_table_index *index = hash_table_entry->index;
+		for (size_t j = 0; j < index->size; ++j) {
+			index->entries[j] = SLIST_NEXT((struct list_entry *) index->entries[j], pointers);
+		}
+	}
+	SLIST_FIRST(&hash_table_entry->list_head) = &block[0];
+
+	for (i = 0; i < length; ++i) {
+		if (!in_block(hash_table_entry, old[i]) && !in_pool(hash_table, old[i])) {
+			hash_table_free(allocator, old[i], sizeof(struct list_entry));
+		}
+	}
+	hash_table_free(allocator, hash_table_entry->block,
+	                hash_table_entry->block_length * sizeof(struct list_entry));
+	hash_table_free(allocator, old, length * sizeof(struct list_entry *));
+	hash_table_entry->block = block;
+	hash_table_entry->block_length = length;
+}
+
+void hash_table_v2_compact(struct hash_table_v2 *hash_table,
+                           size_t begin,
+                           size_t end)
+{
+	/* get_value_at walks chains without a lock, so nodes must never move */
+	if (get_mvcc(hash_table) != NULL) {
+		return;
+	}
+	struct hash_table_entry *entries = atomic_load_explicit(&hash_table->entries, memory_order_acquire);
+	if (entries == NULL) {
+		return;
+	}
+	for (size_t i = begin; i < end && i < HASH_TABLE_CAPACITY; ++i) {
+		struct hash_table_entry *hash_table_entry = &entries[i];
+		int error = pthread_mutex_lock(hash_table_entry->mutex);
+		if (error != 0) {
+			exit(error);
+		}
+		compact_bucket(hash_table, hash_table_entry);
+		error = pthread_mutex_unlock(hash_table_entry->mutex);
+		if (error != 0) {
+			exit(error);
+		}
+	}
+}
+
+/* Index sizes are all multiples of 8, so the arena needs no padding */
+static void *index_arena_alloc(void *context, size_t size)
+{
+	struct extras *extras = context;
+	size_t offset = atomic_fetch_add_explicit(&extras->index_arena_next, size, memory_order_relaxed);
+	if (offset + size <= extras->index_arena_capacity) {
+		return extras->index_arena + offset;
+	}
+	return hash_table_alloc(&extras->allocator, size);
+}
+
+static void index_arena_free(void *context, void *pointer, size_t size)
+{
+	struct extras *extras = context;
+	char *bytes = pointer;
+	if (bytes < extras->index_arena || bytes >= extras->index_arena + extras->index_arena_capacity) {
+		hash_table_free(&extras->allocator, pointer, size);
+	}
+}
+
+/*
+ * An index whose chain ends up with k > HASH_TABLE_INDEX_THRESHOLD entries
+ * starts at capacity c0 and doubles, so its arrays add up to less than
+ * 2 * max(c0, 2k) slots of 12 bytes. Over every bucket that is at most
+ * the struct and 2 * c0 slots per bucket plus 4 slots per entry.
+ */
+static size_t index_arena_bytes(size_t entries, size_t initial_capacity)
+{
+	size_t per_bucket = sizeof(struct hash_table_index)
+	                    + 2 * initial_capacity * (sizeof(uint32_t) + sizeof(void *));
+	return HASH_TABLE_CAPACITY * per_bucket + 4 * entries * (sizeof(uint32_t) + sizeof(void *));
+}
+
+void hash_table_v2_reserve(struct hash_table_v2 *hash_table,
+                           size_t size)
+{
+	struct extras *extras = get_extras(hash_table);
+	assert(extras->pool == NULL);
+	if (size == 0) {
+		return;
+	}
+	/* MAP_POPULATE faults every page in now rather than on the first insert */
+	void *pool = mmap(NULL, size * sizeof(struct list_entry), PROT_READ | PROT_WRITE,
+	                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	assert(pool != MAP_FAILED);
+	extras->pool = pool;
+	extras->pool_capacity = size;
+
+	size_t expected = (size + HASH_TABLE_CAPACITY - 1) / HASH_TABLE_CAPACITY;
+	size_t initial_capacity = 2 * HASH_TABLE_INDEX_THRESHOLD;
+	if (expected > HASH_TABLE_INDEX_THRESHOLD) {
+		initial_capacity = 2 * expected;
+	}
+	/*
+	 * Any bucket may take every entry, so the arena covers that, but it is
+	 * not prefaulted: a uniform table only ever touches the indexes made
+	 * below.
+	 */
+	size_t arena_bytes = index_arena_bytes(size + hash_table_v2_size(hash_table), initial_capacity);
+	void *arena = mmap(NULL, arena_bytes, PROT_READ | PROT_WRITE,
+	                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	assert(arena != MAP_FAILED);
+	extras->index_allocator = (struct ht_allocator) {
+		.alloc = index_arena_alloc,
+		.free = index_arena_free,
+		.context = extras,
+	};
+	extras->index_arena_capacity = arena_bytes;
+	extras->index_arena = arena;
+
+	if (lock_small(hash_table)) {
+		promote(hash_table);
+		unlock_small(hash_table);
+	}
+
+	/*
+	 * Chains expected to outgrow the threshold get their index up front,
+	 * and indexes made before the reservation move into the arena so they
+	 * can keep growing without the allocator.
+	 */
+	struct hash_table_entry *entries = atomic_load_explicit(&hash_table->entries, memory_order_acquire);
+	for (size_t i = 0; i < HASH_TABLE_CAPACITY; ++i) {
+		struct hash_table_entry *hash_table_entry = &entries[i];
+		if (hash_table_entry->index == NULL && expected <= HASH_TABLE_INDEX_THRESHOLD) {
+			continue;
+		}
+		struct hash_table_index *index = hash_table_index_create(index_allocator(hash_table),
+		                                                         initial_capacity + 2 * hash_table_entry->length);
+		struct list_entry *entry = NULL;
+		SLIST_FOREACH(entry, &hash_table_entry->list_head, pointers) {
+			hash_table_index_insert(index, entry->hash, entry);
+		}
+		hash_table_index_destroy(hash_table_entry->index);
+		hash_table_entry->index = index;
+	}
+}
+
+struct hash_table_frozen *hash_table_v2_freeze(struct hash_table_v2 *hash_table)
+{
+	struct hash_table_frozen *frozen = NULL;
+	size_t key_bytes = 0;
+	if (lock_small(hash_table)) {
+		for (uint32_t i = 0; i < hash_table->small_size; ++i) {
+			key_bytes += strlen(hash_table->small_keys[i]) + 1;
+		}
+		frozen = hash_table_frozen_create(hash_table->small_size, key_bytes);
+		for (uint32_t i = 0; i < hash_table->small_size; ++i) {
+			const char *key = hash_table->small_keys[i];
+			hash_table_frozen_insert(frozen, key, bernstein_hash(key), hash_table->small_values[i]);
+		}
+		unlock_small(hash_table);
+		return frozen;
+	}
+
+	struct hash_table_entry *entries = atomic_load_explicit(&hash_table->entries, memory_order_acquire);
+	size_t size = 0;
+	for (size_t i = 0; i < HASH_TABLE_CAPACITY; ++i) {
+		int error = pthread_mutex_lock(entries[i].mutex);
+		if (error != 0) {
+			exit(error);
+		}
+		struct list_entry *list_entry = NULL;
+		SLIST_FOREACH(list_entry, &entries[i].list_head, pointers) {
+			key_bytes += strlen(list_entry->key) + 1;
+		}
+		size += entries[i].length;
+	}
+	frozen = hash_table_frozen_create(size, key_bytes);
+	for (size_t i = 0; i < HASH_TABLE_CAPACITY; ++i) {
+		struct list_entry *list_entry = NULL;
+		SLIST_FOREACH(list_entry, &entries[i].list_head, pointers) {
+			hash_table_frozen_insert(frozen, list_entry->key, list_entry->hash, list_entry->value);
+		}
+		int error = pthread_mutex_unlock(entries[i].mutex);
+		if (error != 0) {
+			exit(error);
+		}
+	}
+	return frozen;
+}
+
+struct save_job {
+	struct hash_table_v2 *hash_table;
+	/* NULL while the table is small, small_mutex is held instead */
+	struct hash_table_entry *entries;
+	struct hash_table_snapshot_segment *segments;
+	void **buffers;
+	/* Every bucket lock is already held, see hash_table_v2_snapshot_async */
+	bool locked;
+	/* Only buckets written after epoch since, see hash_table_v2_checkpoint */
+	bool delta;
+	uint64_t since;
+};
+
+/* Called with the bucket lock held, so the answer holds until it is dropped */
+static bool in_save(const struct save_job *job, const struct hash_table_entry *entry)
+{
+	return !job->delta || entry->dirty > job->since;
+}
+
+static void put_record(char *buffer,
+                       uint32_t *count,
+                       uint32_t *key_offset,
+                       const char *key,
+                       uint32_t hash,
+                       uint32_t value)
+{
+	struct hash_table_snapshot_record *record = (void *) buffer;
+	size_t length = strlen(key) + 1;
+	record[*count].hash = hash;
+	record[*count].value = value;
+	record[*count].key_offset = *key_offset;
+	memcpy(buffer + *key_offset, key, length);
+	++*count;
+	*key_offset += length;
+}
+
+/* Serializes one bucket range, holding all of its bucket locks while it does */
+static void save_segment(void *context, uint32_t i)
+{
+	struct save_job *job = context;
+	struct hash_table_v2 *hash_table = job->hash_table;
+	struct hash_table_snapshot_segment *segment = &job->segments[i];
+	uint32_t step = HASH_TABLE_CAPACITY / HASH_TABLE_SNAPSHOT_SEGMENTS;
+	segment->begin = i * step;
+	segment->end = (i + 1) * step;
+
+	size_t count = 0;
+	size_t key_bytes = 0;
+	bool small_saved = !job->delta || small_dirty(hash_table) > job->since;
+	if (job->entries == NULL) {
+		for (uint32_t j = 0; j < hash_table->small_size; ++j) {
+			uint32_t bucket = bernstein_hash(hash_table->small_keys[j]) % HASH_TABLE_CAPACITY;
+			if (small_saved && bucket >= segment->begin && bucket < segment->end) {
+				++count;
+				key_bytes += strlen(hash_table->small_keys[j]) + 1;
+			}
+		}
+	}
+	else {
+		for (uint32_t bucket = segment->begin; bucket < segment->end; ++bucket) {
+			if (!job->locked) {
+				int error = pthread_mutex_lock(job->entries[bucket].mutex);
+				if (error != 0) {
+					exit(error);
+				}
+			}
+			if (!in_save(job, &job->entries[bucket])) {
+				continue;
+			}
+			struct list_entry *list_entry = NULL;
+			SLIST_FOREACH(list_entry, &job->entries[bucket].list_head, pointers) {
+				key_bytes += strlen(list_entry->key) + 1;
+			}
+			count += job->entries[bucket].length;
+		}
+	}
+
+	size_t length = count * sizeof(struct hash_table_snapshot_record) + key_bytes;
+	assert(length <= UINT32_MAX);
+	char *buffer = malloc(length + 1);
+	assert(buffer != NULL);
+	uint32_t written = 0;
+	uint32_t key_offset = count * sizeof(struct hash_table_snapshot_record);
+	if (job->entries == NULL) {
+		for (uint32_t j = 0; j < hash_table->small_size; ++j) {
+			const char *key = hash_table->small_keys[j];
+			uint32_t hash = bernstein_hash(key);
+			if (small_saved && hash % HASH_TABLE_CAPACITY >= segment->begin
+			    && hash % HASH_TABLE_CAPACITY < segment->end) {
+				put_record(buffer, &written, &key_offset, key, hash, hash_table->small_values[j]);
+			}
+		}
+	}
+	else {
+		for (uint32_t bucket = segment->begin; bucket < segment->end; ++bucket) {
+			struct list_entry *list_entry = NULL;
+			if (in_save(job, &job->entries[bucket])) {
+				SLIST_FOREACH(list_entry, &job->entries[bucket].list_head, pointers) {
+					put_record(buffer, &written, &key_offset, list_entry->key, list_entry->hash, list_entry->value);
+				}
+			}
+			if (!job->locked) {
+				int error = pthread_mutex_unlock(job->entries[bucket].mutex);
+				if (error != 0) {
+					exit(error);
+				}
+			}
+		}
+	}
+	segment->length = length;
+	segment->entry_count = count;
+	job->buffers[i] = buffer;
+}
+
+/*
+ * small says small_mutex is held, locked that every bucket lock is; delta
+ * leaves out buckets not written after epoch since.
+ */
+static int save_snapshot(struct hash_table_v2 *hash_table,
+                         const char *path,
+                         uint32_t threads,
+                         bool small,
+                         bool locked,
+                         bool delta,
+                         uint64_t since)
+{
+	struct hash_table_snapshot_segment segments[HASH_TABLE_SNAPSHOT_SEGMENTS];
+	void *buffers[HASH_TABLE_SNAPSHOT_SEGMENTS];
+	struct save_job job = {
+		.hash_table = hash_table,
+		.segments = segments,
+		.buffers = buffers,
+		.locked = locked,
+		.delta = delta,
+		.since = since,
+	};
+	if (!small) {
+		job.entries = atomic_load_explicit(&hash_table->entries, memory_order_acquire);
+	}
+	hash_table_parallel(HASH_TABLE_SNAPSHOT_SEGMENTS, threads, save_segment, &job);
+	if (small && !locked) {
+		unlock_small(hash_table);
+	}
+
+	uint64_t entry_count = 0;
+	for (uint32_t i = 0; i < HASH_TABLE_SNAPSHOT_SEGMENTS; ++i) {
+		entry_count += segments[i].entry_count;
+	}
+	int error = hash_table_snapshot_write(path, entry_count, segments, buffers, threads);
+	for (uint32_t i = 0; i < HASH_TABLE_SNAPSHOT_SEGMENTS; ++i) {
+		free(buffers[i]);
+	}
+	return error;
+}
+
+/*
+ * Writes tagged with the old epoch were made under a lock that the save
+ * only takes after the bump, so it sees them; everything later is tagged
+ * past the new checkpointed epoch and goes in the next checkpoint.
+ */
+static int save_epoch(struct hash_table_v2 *hash_table,
+                      const char *path,
+                      uint32_t threads,
+                      bool delta)
+{
+	struct extras *extras = get_extras(hash_table);
+	uint64_t since = extras->checkpointed;
+	uint64_t epoch = atomic_fetch_add(&extras->epoch, 1) + 1;
+	bool small = lock_small(hash_table);
+	int error = save_snapshot(hash_table, path, threads, small, false, delta, since);
+	if (error == 0) {
+		extras->checkpointed = epoch;
+	}
+	return error;
+}
+
+int hash_table_v2_save(struct hash_table_v2 *hash_table,
+                       const char *path,
+                       uint32_t threads)
+{
+	return save_epoch(hash_table, path, threads, false);
+}
+
+int hash_table_v2_checkpoint(struct hash_table_v2 *hash_table,
+                             const char *path,
+                             uint32_t threads)
+{
+	return save_epoch(hash_table, path, threads, true);
+}
+
+static uint64_t nsec_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static long minor_faults(void)
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_minflt;
+}
+
+/*
+ * Returns true with small_mutex held if the table is small, otherwise
+ * with every bucket lock held, taken in order like freeze does.
+ */
+static bool lock_all(struct hash_table_v2 *hash_table)
+{
+	if (lock_small(hash_table)) {
+		return true;
+	}
+	struct hash_table_entry *entries = atomic_load_explicit(&hash_table->entries, memory_order_acquire);
+	for (size_t i = 0; i < HASH_TABLE_CAPACITY; ++i) {
+		int error = pthread_mutex_lock(entries[i].mutex);
+		if (error != 0) {
+			exit(error);
+		}
+	}
+	return false;
+}
+
+static void unlock_all(struct hash_table_v2 *hash_table, bool small)
+{
+	if (small) {
+		unlock_small(hash_table);
+		return;
+	}
+	struct hash_table_entry *entries = atomic_load_explicit(&hash_table->entries, memory_order_acquire);
+	for (size_t i = 0; i < HASH_TABLE_CAPACITY; ++i) {
+		int error = pthread_mutex_unlock(entries[i].mutex);
+		if (error != 0) {
+			exit(error);
+		}
+	}
+}
+
+/*
+ * The table's locks are all held across fork, so the child starts from a
+ * consistent image with no lock left held by a thread it does not have.
+ * It owns those locks and serializes on its own thread without touching
+ * them, then exits without running the parent's atexit handlers.
+ */
+int hash_table_v2_snapshot_async(struct hash_table_v2 *hash_table,
+                                 const char *path,
+                                 struct hash_table_v2_snapshot *snapshot)
+{
+	bool small = lock_all(hash_table);
+	snapshot->start_nsec = nsec_now();
+	snapshot->start_faults = minor_faults();
+	snapshot->pid = fork();
+	if (snapshot->pid == 0) {
+		_exit(save_snapshot(hash_table, path, 1, small, true, false, 0));
+	}
+	int error = snapshot->pid < 0 ? errno : 0;
+	unlock_all(hash_table, small);
+	return error;
+}
+
+int hash_table_v2_snapshot_wait(struct hash_table_v2_snapshot *snapshot)
+{
+	int status = 0;
+	while (waitpid(snapshot->pid, &status, 0) < 0) {
+		if (errno != EINTR) {
+			return errno;
+		}
+	}
+	snapshot->nsec = nsec_now() - snapshot->start_nsec;
+	snapshot->faults = minor_faults() - snapshot->start_faults;
+	if (!WIFEXITED(status)) {
+		return EIO;
+	}
+	return WEXITSTATUS(status);
+}
+
+struct load_job {
+	struct hash_table_v2 *hash_table;
+	struct hash_table_entry *entries;
+	char *contents;
+	const struct hash_table_snapshot_segment *segments;
+	/* Merge into a table others may be using, see hash_table_v2_apply */
+	bool upsert;
+	_Atomic bool corrupt;
+	_Atomic uint64_t inserted;
+};
+
+/* Every record is checked before any is loaded, so a bad file changes nothing */
+static void check_segment(void *context, uint32_t i)
+{
+	struct load_job *job = context;
+	const struct hash_table_snapshot_segment *segment = &job->segments[i];
+	uint32_t step = HASH_TABLE_CAPACITY / HASH_TABLE_SNAPSHOT_SEGMENTS;
+	const char *data = job->contents + segment->offset;
+	if (segment->begin != i * step || segment->end != (i + 1) * step
+	    || segment->entry_count > segment->length / sizeof(struct hash_table_snapshot_record)) {
+		atomic_store(&job->corrupt, true);
+		return;
+	}
+	const struct hash_table_snapshot_record *records = (const void *) data;
+	for (uint32_t j = 0; j < segment->entry_count; ++j) {
+		const struct hash_table_snapshot_record *record = &records[j];
+		uint32_t bucket = record->hash % HASH_TABLE_CAPACITY;
+		if (bucket < segment->begin || bucket >= segment->end
+		    || record->key_offset >= segment->length
+		    || memchr(data + record->key_offset, 0, segment->length - record->key_offset) == NULL) {
+			atomic_store(&job->corrupt, true);
+			return;
+		}
+	}
+}
+
+/*
+ * Segments own disjoint bucket ranges, so a new table can be linked
+ * without locks. Upserts take them, and leave the buckets clean: what
+ * they bring in is already on disk.
+ */
+static void load_segment(void *context, uint32_t i)
+{
+	struct load_job *job = context;
+	const struct hash_table_snapshot_segment *segment = &job->segments[i];
+	char *data = job->contents + segment->offset;
+	const struct hash_table_snapshot_record *records = (const void *) data;
+	uint64_t inserted = 0;
+	for (uint32_t j = 0; j < segment->entry_count; ++j) {
+		const struct hash_table_snapshot_record *record = &records[j];
+		struct hash_table_entry *hash_table_entry = &job->entries[record->hash % HASH_TABLE_CAPACITY];
+		char *key = data + record->key_offset;
+		if (job->upsert) {
+			int error = pthread_mutex_lock(hash_table_entry->mutex);
+			if (error != 0) {
+				exit(error);
+			}
+		}
+		struct list_entry *list_entry = NULL;
+		if (job->upsert) {
+			list_entry = get_list_entry(job->hash_table, key, record->hash, hash_table_entry);
+		}
+		if (list_entry != NULL) {
+			list_entry->value = record->value;
+		}
+		else {
+			list_entry = alloc_list_entry(job->hash_table);
+			list_entry->key = key;
+			list_entry->hash = record->hash;
+			list_entry->value = record->value;
+			link_list_entry(job->hash_table, hash_table_entry, list_entry);
+			++inserted;
+		}
+		if (job->upsert) {
+			atomic_fetch_add_explicit(&hash_table_entry->generation, 1, memory_order_release);
+			int error = pthread_mutex_unlock(hash_table_entry->mutex);
+			if (error != 0) {
+				exit(error);
+			}
+		}
+	}
+	atomic_fetch_add(&job->inserted, inserted);
+}
+
+/* Returns 0 or EBADMSG, the table owns contents from then on only if 0 */
+static int load_contents(struct hash_table_v2 *hash_table,
+                         char *contents,
+                         uint32_t threads,
+                         bool upsert)
+{
+	if (lock_small(hash_table)) {
+		promote(hash_table);
+		unlock_small(hash_table);
+	}
+	const struct hash_table_snapshot_header *header = (const void *) contents;
+	struct load_job job = {
+		.hash_table = hash_table,
+		.entries = atomic_load_explicit(&hash_table->entries, memory_order_acquire),
+		.contents = contents,
+		.segments = (const void *) (header + 1),
+		.upsert = upsert,
+	};
+	hash_table_parallel(HASH_TABLE_SNAPSHOT_SEGMENTS, threads, check_segment, &job);
+	if (atomic_load(&job.corrupt)) {
+		return EBADMSG;
+	}
+	hash_table_parallel(HASH_TABLE_SNAPSHOT_SEGMENTS, threads, load_segment, &job);
+	hash_table_counter_add(hash_table->counter, atomic_load(&job.inserted));
+	return 0;
+}
+
+struct hash_table_v2 *hash_table_v2_load(const char *path,
+                                         uint32_t threads)
+{
+	char *contents = hash_table_snapshot_read(path, threads);
+	if (contents == NULL) {
+		return NULL;
+	}
+	struct hash_table_v2 *hash_table = hash_table_v2_create();
+	int error = load_contents(hash_table, contents, threads, false);
+	if (error != 0) {
+		hash_table_v2_destroy(hash_table);
+		free(contents);
+		errno = error;
+		return NULL;
+	}
+	get_extras(hash_table)->snapshot = contents;
+	return hash_table;
+}
+
+int hash_table_v2_apply(struct hash_table_v2 *hash_table,
+                        const char *path,
+                        uint32_t threads)
+{
+	/* Versions and log records would be skipped */
+	assert(get_mvcc(hash_table) == NULL && get_wal(hash_table) == NULL);
+	char *contents = hash_table_snapshot_read(path, threads);
+	if (contents == NULL) {
+		return errno;
+	}
+	int error = load_contents(hash_table, contents, threads, true);
+	if (error != 0) {
+		free(contents);
+		return error;
+	}
+	struct extras *extras = get_extras(hash_table);
+	extras->deltas = realloc(extras->deltas, (extras->delta_count + 1) * sizeof(char *));
+	assert(extras->deltas != NULL);
+	extras->deltas[extras->delta_count++] = contents;
+	return 0;
+}
+
+int hash_table_v2_merge(const char *base,
+                        const char *const *deltas,
+                        size_t count,
+                        const char *path,
+                        uint32_t threads)
+{
+	struct hash_table_v2 *hash_table = hash_table_v2_load(base, threads);
+	if (hash_table == NULL) {
+		return errno;
+	}
+	int error = 0;
+	for (size_t i = 0; i < count && error == 0; ++i) {
+		error = hash_table_v2_apply(hash_table, deltas[i], threads);
+	}
+	if (error == 0) {
+		error = hash_table_v2_save(hash_table, path, threads);
+	}
+	hash_table_v2_destroy(hash_table);
+	return error;
+}
+
+static void replay_entry(void *context, const char *key, uint32_t value)
+{
+	hash_table_v2_add_entry(context, key, value);
+}
+
+struct hash_table_v2 *hash_table_v2_create_durable(const char *path,
+                                                   uint32_t threads)
+{
+	struct hash_table_v2 *hash_table = hash_table_v2_create();
+	struct extras *extras = get_extras(hash_table);
+	uint64_t next_lsn = 0;
+	extras->snapshot = hash_table_wal_replay(path, threads, replay_entry, hash_table, &next_lsn);
+	if (extras->snapshot == NULL && errno != ENOENT) {
+		int error = errno;
+		hash_table_v2_destroy(hash_table);
+		errno = error;
+		return NULL;
+	}
+	extras->wal = hash_table_wal_open(path, next_lsn);
+	if (extras->wal == NULL) {
+		int error = errno;
+		hash_table_v2_destroy(hash_table);
+		errno = error;
+		return NULL;
+	}
+	return hash_table;
+}
+
+static void destroy_range(void *arg, size_t begin, size_t end)
+{
+	struct hash_table_v2 *hash_table = arg;
+	const struct ht_allocator *allocator = table_allocator(hash_table);
+	struct hash_table_entry *entries = atomic_load_explicit(&hash_table->entries, memory_order_acquire);
+	/* Bulk allocators take everything back at once in release */
+	if (entries == NULL || allocator->bulk_free != NULL) {
+		return;
+	}
+	for (size_t i = begin; i < end; ++i) {
+		struct hash_table_entry *entry = &entries[i];
+		struct list_head *list_head = &entry->list_head;
+		struct list_entry *list_entry = NULL;
+		while (!SLIST_EMPTY(list_head)) {
+			list_entry = SLIST_FIRST(list_head);
+			SLIST_REMOVE_HEAD(list_head, pointers);
+			while (list_entry->versions != NULL) {
+				struct version *next = list_entry->versions->next;
+				hash_table_free(allocator, list_entry->versions, sizeof(struct version));
+				list_entry->versions = next;
+			}
+			if (!in_block(entry, list_entry) && !in_pool(hash_table, list_entry)) {
+				hash_table_free(allocator, list_entry, sizeof(struct list_entry));
+			}
+		}
+		hash_table_free(allocator, entry->block, entry->block_length * sizeof(struct list_entry));
+		hash_table_index_destroy(entry->index);
+		// Destroy and free the mutex
+		int error = pthread_mutex_destroy(entry->mutex);
+		if (error != 0) {
+			exit(error);
+		}
+		hash_table_free(allocator, entry->mutex, sizeof(pthread_mutex_t));
+	}
+}
+
+static void release(void *arg)
+{
+	struct hash_table_v2 *hash_table = arg;
+	struct extras *extras = peek_extras(hash_table);
+	struct ht_allocator allocator = *table_allocator(hash_table);
+	if (extras != NULL && extras->wal != NULL) {
+		hash_table_wal_close(extras->wal);
+	}
+	int error = pthread_mutex_destroy(&hash_table->small_mutex);
+	if (error != 0) {
+		exit(error);
+	}
+	hash_table_counter_destroy(hash_table->counter);
+	if (extras != NULL) {
+		free(extras->mvcc);
+		free(extras->snapshot);
+		for (size_t i = 0; i < extras->delta_count; ++i) {
+			free(extras->deltas[i]);
+		}
+		free(extras->deltas);
+		if (extras->pool != NULL) {
+			munmap(extras->pool, extras->pool_capacity * sizeof(struct list_entry));
+		}
+		if (extras->index_arena != NULL) {
+			munmap(extras->index_arena, extras->index_arena_capacity);
+		}
+		free(extras);
+	}
+	/* Bucket mutexes hold no resources, so a bulk free can skip destroying them */
+	if (allocator.bulk_free != NULL) {
+		allocator.bulk_free(allocator.context);
+		return;
+	}
+	hash_table_free(&allocator, atomic_load_explicit(&hash_table->entries, memory_order_relaxed),
+	                HASH_TABLE_CAPACITY * sizeof(struct hash_table_entry));
+	hash_table_free(&allocator, hash_table, sizeof(struct hash_table_v2));
+}
+
+void hash_table_v2_destroy(struct hash_table_v2 *hash_table)
+{
+	destroy_range(hash_table, 0, HASH_TABLE_CAPACITY);
+	release(hash_table);
+}
+
+void hash_table_v2_destroy_async(struct hash_table_v2 *hash_table,
+                                 uint32_t threads)
+{
+	hash_table_destroy_async(hash_table, threads, destroy_range, release);
+}
@@ -1,16 +1,162 @@
-#pragma once
-
-#include "hash-table-common.h"
-
-#include <stdbool.h>
-
-struct hash_table_v2;
-struct hash_table_v2 *hash_table_v2_create();
-void hash_table_v2_add_entry(struct hash_table_v2 *hash_table,
-                             const char *key,
-                             uint32_t value);
-bool hash_table_v2_contains(struct hash_table_v2 *hash_table,
-                            const char *key);
-uint32_t hash_table_v2_get_value(struct hash_table_v2 *hash_table,
-                                 const char* key);
-void hash_table_v2_destroy(struct hash_table_v2 *hash_table);
+#pragma once
+
+#include "hash-table-common.h"
+#include "hash-table-frozen.h"
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+struct hash_table_v2;
+
+/* Snapshots a versioned table can have open at once */
+#define HASH_TABLE_V2_MAX_READERS 64
+
+/* A registered snapshot, versions older than the oldest one are freed */
+struct hash_table_v2_reader {
+	uint64_t version;
+	uint32_t slot;
+};
+
+/*
+ * A background snapshot in a forked child. The timing and minor fault
+ * counts cover the parent from the fork until the child is reaped; faults
+ * in that window are mostly copy-on-write copies of pages the parent wrote.
+ */
+struct hash_table_v2_snapshot {
+	pid_t pid;
+	uint64_t start_nsec;
+	long start_faults;
+	uint64_t nsec;
+	long faults;
+};
+
+struct hash_table_v2 *hash_table_v2_create();
+struct hash_table_v2 *hash_table_v2_create_with_allocator(const struct ht_allocator *allocator);
+struct hash_table_v2 *hash_table_v2_create_versioned();
+void hash_table_v2_add_entry(struct hash_table_v2 *hash_table,
+                             const char *key,
+                             uint32_t value);
+/* Adds delta to key's value, a new key starts at delta */
+void hash_table_v2_add_count(struct hash_table_v2 *hash_table,
+                             const char *key,
+                             uint32_t delta);
+/*
+ * add_count for every keys[i] and deltas[i], taking each bucket's lock
+ * once for all of its keys in the batch.
+ */
+void hash_table_v2_add_counts(struct hash_table_v2 *hash_table,
+                              const char **keys,
+                              const uint32_t *deltas,
+                              size_t count);
+bool hash_table_v2_contains(struct hash_table_v2 *hash_table,
+                            const char *key);
+uint32_t hash_table_v2_get_value(struct hash_table_v2 *hash_table,
+                                 const char* key);
+uint32_t hash_table_v2_get_value_cached(struct hash_table_v2 *hash_table,
+                                        const char* key);
+size_t hash_table_v2_size(struct hash_table_v2 *hash_table);
+void hash_table_v2_destroy(struct hash_table_v2 *hash_table);
+void hash_table_v2_destroy_async(struct hash_table_v2 *hash_table,
+                                 uint32_t threads);
+/*
+ * Opens a snapshot in one of HASH_TABLE_V2_MAX_READERS reader slots, trying
+ * the calling thread's own slot first. With that many snapshots already
+ * open, it waits until one is closed by end_read.
+ */
+void hash_table_v2_begin_read(struct hash_table_v2 *hash_table,
+                              struct hash_table_v2_reader *reader);
+void hash_table_v2_end_read(struct hash_table_v2 *hash_table,
+                            struct hash_table_v2_reader *reader);
+bool hash_table_v2_get_value_at(struct hash_table_v2 *hash_table,
+                                const char *key,
+                                uint64_t version,
+                                uint32_t *value);
+/*
+ * Relocate the chains of buckets [begin, end) into contiguous memory, one
+ * bucket lock at a time, so it can run alongside other operations. Versioned
+ * tables are left alone.
+ */
+void hash_table_v2_compact(struct hash_table_v2 *hash_table,
+                           size_t begin,
+                           size_t end);
+/*
+ * Prefault nodes for size more entries and set aside room for every bucket
+ * index to grow as if all of them landed in one bucket, so those inserts
+ * make no call to the allocator. Versioned tables still allocate a version
+ * per write. Call once, before the table is shared between threads.
+ */
+void hash_table_v2_reserve(struct hash_table_v2 *hash_table,
+                           size_t size);
+/*
+ * Copy the current contents into an immutable hash_table_frozen. Every bucket
+ * is locked while copying so the result is a consistent snapshot; the table
+ * itself is left as it was and still has to be destroyed.
+ */
+struct hash_table_frozen *hash_table_v2_freeze(struct hash_table_v2 *hash_table);
+/*
+ * Write the table to path in the format of hash-table-snapshot.h, with
+ * threads serializing and writing bucket ranges in parallel. Each range is
+ * consistent on its own; stop writers first for a consistent file. Returns
+ * 0 or an errno value.
+ */
+int hash_table_v2_save(struct hash_table_v2 *hash_table,
+                       const char *path,
+                       uint32_t threads);
+/*
+ * Fork a child that writes the table, as of the fork, to path in the save
+ * format while the caller carries on. Writers only wait while the locks
+ * are taken for the fork. Returns 0 or an errno value.
+ */
+int hash_table_v2_snapshot_async(struct hash_table_v2 *hash_table,
+                                 const char *path,
+                                 struct hash_table_v2_snapshot *snapshot);
+/* Reap the child; returns its save result, 0 or an errno value */
+int hash_table_v2_snapshot_wait(struct hash_table_v2_snapshot *snapshot);
+/*
+ * Build a new (unversioned) table from a file written by
+ * hash_table_v2_save. Returns NULL with errno set if it cannot be read or
+ * fails its checksums (EBADMSG).
+ */
+struct hash_table_v2 *hash_table_v2_load(const char *path,
+                                         uint32_t threads);
+/*
+ * Incremental saves. Every write tags its bucket with the current epoch;
+ * a checkpoint writes, in the save format, only the buckets written since
+ * the last save or checkpoint, so its size follows the write rate rather
+ * than the table. One save or checkpoint at a time.
+ */
+int hash_table_v2_checkpoint(struct hash_table_v2 *hash_table,
+                             const char *path,
+                             uint32_t threads);
+/*
+ * Upsert every entry of a checkpoint into a table loaded from the save it
+ * follows; apply the checkpoints in the order they were written. Leaves the
+ * table unchanged if the file is bad. Not for versioned or durable tables.
+ * Returns 0 or an errno value.
+ */
+int hash_table_v2_apply(struct hash_table_v2 *hash_table,
+                        const char *path,
+                        uint32_t threads);
+/*
+ * Fold count checkpoints into base and write the result to path as a new
+ * base, to be renamed over the old one once written. Returns 0 or an errno
+ * value.
+ */
+int hash_table_v2_merge(const char *base,
+                        const char *const *deltas,
+                        size_t count,
+                        const char *path,
+                        uint32_t threads);
+/*
+ * Open a table whose writes are logged to path (see hash-table-wal.h):
+ * whatever the log already holds is replayed into the new table, in
+ * parallel over threads, and add_entry then returns only once its write is
+ * on disk. Returns NULL with errno set if the log cannot be used.
+ */
+struct hash_table_v2 *hash_table_v2_create_durable(const char *path,
+                                                   uint32_t threads);
+/* Set before the table is shared between threads */
+void hash_table_v2_set_chain_policy(struct hash_table_v2 *hash_table,
+                                    enum hash_table_chain_policy chain_policy);
+size_t hash_table_v2_chain_depth(struct hash_table_v2 *hash_table,
+                                 const char *key);
@@ -0,0 +1,561 @@
+#include "hash-table-vlog.h"
+#include "hash-table-counter.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define CHUNK_BYTES (4 << 20)
+/* A larger record gets a chunk of its own rather than sealing the head early */
+#define LARGE_RECORD_BYTES (CHUNK_BYTES / 4)
+#define MAX_CHUNKS 65536
+#define CACHE_LINE_SIZE 64
+
+/* A log record: this header, the key and its NUL, the value, padded to 8 */
+struct vlog_record {
+	uint32_t key_length;
+	uint32_t value_length;
+};
+
+/*
+ * used and sealed are guarded by log_mutex until the chunk is sealed, then
+ * used is final. writers counts appends that have space in the chunk but
+ * have not linked it yet; a chunk is only collected once it is sealed and
+ * they are done. retired is the epoch it was retired at, 0 while in use.
+ */
+struct chunk {
+	uint32_t id;
+	int fd;
+	char *map;
+	uint32_t size;
+	uint32_t used;
+	bool sealed;
+	_Atomic uint32_t writers;
+	_Atomic uint64_t live;
+	uint64_t retired;
+	struct chunk *next_retired;
+};
+
+/* address is the chunk id in the high half and the record offset in the low */
+struct vlog_entry {
+	const char *key;
+	uint32_t hash;
+	uint32_t length;
+	uint64_t address;
+	struct vlog_entry *next;
+};
+
+struct vlog_bucket {
+	pthread_mutex_t mutex;
+	struct vlog_entry *head;
+};
+
+/* The epoch a reader started at plus one, zero meaning free */
+struct reader_slot {
+	_Atomic uint64_t epoch;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/*
+ * log_mutex guards head, next_id and the chunks slots; collect_mutex allows
+ * one collection at a time and guards the retired list. Lock order is
+ * bucket, then log_mutex.
+ */
+struct hash_table_vlog {
+	char *directory;
+	pthread_mutex_t log_mutex;
+	struct chunk *head;
+	uint32_t next_id;
+	struct chunk *_Atomic chunks[MAX_CHUNKS];
+	pthread_mutex_t collect_mutex;
+	struct chunk *retired;
+	_Atomic uint64_t epoch;
+	struct reader_slot readers[HASH_TABLE_VLOG_MAX_READERS];
+	_Atomic size_t collected;
+	_Atomic size_t moved_bytes;
+	struct hash_table_counter *counter;
+	struct vlog_bucket buckets[HASH_TABLE_CAPACITY];
+};
+
+static void lock(pthread_mutex_t *mutex)
+{
+	int error = pthread_mutex_lock(mutex);
+	if (error != 0) {
+		exit(error);
+	}
+}
+
+static void unlock(pthread_mutex_t *mutex)
+{
+	int error = pthread_mutex_unlock(mutex);
+	if (error != 0) {
+		exit(error);
+	}
+}
+
+static size_t record_bytes(size_t key_length, size_t value_length)
+{
+	size_t bytes = sizeof(struct vlog_record) + key_length + 1 + value_length;
+	return (bytes + 7) & ~(size_t) 7;
+}
+
+static uint64_t make_address(uint32_t id, uint32_t offset)
+{
+	return (uint64_t) id << 32 | offset;
+}
+
+static struct chunk *get_chunk(struct hash_table_vlog *hash_table, uint64_t address)
+{
+	return atomic_load(&hash_table->chunks[(address >> 32) % MAX_CHUNKS]);
+}
+
+/* Anonymous memory, or an unlinked file in directory; NULL with errno set */
+static struct chunk *create_chunk(const char *directory, uint32_t id, uint32_t size)
+{
+	int fd = -1;
+	char *map;
+	if (directory == NULL) {
+		map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	}
+	else {
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), "%s/hash-table-vlog-XXXXXX", directory);
+		fd = mkstemp(path);
+		if (fd < 0) {
+			return NULL;
+		}
+		unlink(path);
+		if (ftruncate(fd, size) != 0) {
+			int error = errno;
+			close(fd);
+			errno = error;
+			return NULL;
+		}
+		map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	if (map == MAP_FAILED) {
+		int error = errno;
+		if (fd >= 0) {
+			close(fd);
+		}
+		errno = error;
+		return NULL;
+	}
+	struct chunk *chunk = calloc(1, sizeof(struct chunk));
+	assert(chunk != NULL);
+	chunk->id = id;
+	chunk->fd = fd;
+	chunk->map = map;
+	chunk->size = size;
+	return chunk;
+}
+
+static void destroy_chunk(struct chunk *chunk)
+{
+	munmap(chunk->map, chunk->size);
+	if (chunk->fd >= 0) {
+		close(chunk->fd);
+	}
+	free(chunk);
+}
+
+/*
+ * Called with log_mutex held: creates a chunk of size bytes under the next
+ * id whose slot is free. Returns NULL with errno set.
+ */
+static struct chunk *add_chunk(struct hash_table_vlog *hash_table, uint32_t size)
+{
+	uint32_t id = hash_table->next_id++;
+	for (uint32_t tried = 0; atomic_load(&hash_table->chunks[id % MAX_CHUNKS]) != NULL; ++tried) {
+		if (tried == MAX_CHUNKS) {
+			errno = ENOSPC;
+			return NULL;
+		}
+		id = hash_table->next_id++;
+	}
+	struct chunk *chunk = create_chunk(hash_table->directory, id, size);
+	if (chunk != NULL) {
+		atomic_store(&hash_table->chunks[id % MAX_CHUNKS], chunk);
+	}
+	return chunk;
+}
+
+/* Called with log_mutex held: seals the head and starts a new one */
+static void next_chunk(struct hash_table_vlog *hash_table)
+{
+	struct chunk *chunk = add_chunk(hash_table, CHUNK_BYTES);
+	if (chunk == NULL) {
+		exit(errno);
+	}
+	hash_table->head->sealed = true;
+	hash_table->head = chunk;
+}
+
+/*
+ * Writes a record to the log and sets *address to it, at the head, or in
+ * a sealed chunk of its own if it is large. The caller links it and then
+ * drops *chunk's writers count. Returns false with errno set if a large
+ * record's chunk cannot be created.
+ */
+static bool append(struct hash_table_vlog *hash_table,
+                   const char *key,
+                   size_t key_length,
+                   const void *value,
+                   uint32_t length,
+                   uint64_t *address,
+                   struct chunk **chunk)
+{
+	size_t bytes = record_bytes(key_length, length);
+	if (bytes > UINT32_MAX) {
+		errno = EFBIG;
+		return false;
+	}
+	lock(&hash_table->log_mutex);
+	if (bytes > LARGE_RECORD_BYTES) {
+		*chunk = add_chunk(hash_table, bytes);
+		if (*chunk == NULL) {
+			int error = errno;
+			unlock(&hash_table->log_mutex);
+			errno = error;
+			return false;
+		}
+		(*chunk)->sealed = true;
+	}
+	else {
+		if (hash_table->head->used + bytes > CHUNK_BYTES) {
+			next_chunk(hash_table);
+		}
+		*chunk = hash_table->head;
+	}
+	uint32_t offset = (*chunk)->used;
+	(*chunk)->used += bytes;
+	atomic_fetch_add(&(*chunk)->writers, 1);
+	atomic_fetch_add(&(*chunk)->live, bytes);
+	unlock(&hash_table->log_mutex);
+
+	char *data = (*chunk)->map + offset;
+	struct vlog_record record = {
+		.key_length = key_length,
+		.value_length = length,
+	};
+	memcpy(data, &record, sizeof(record));
+	memcpy(data + sizeof(record), key, key_length + 1);
+	memcpy(data + sizeof(record) + key_length + 1, value, length);
+	*address = make_address((*chunk)->id, offset);
+	return true;
+}
+
+/* Called with the bucket lock held, the old record becomes garbage */
+static void release(struct hash_table_vlog *hash_table,
+                    struct vlog_entry *entry)
+{
+	struct chunk *chunk = get_chunk(hash_table, entry->address);
+	atomic_fetch_sub(&chunk->live, record_bytes(strlen(entry->key), entry->length));
+}
+
+struct hash_table_vlog *hash_table_vlog_create(const char *directory)
+{
+	struct chunk *chunk = create_chunk(directory, 0, CHUNK_BYTES);
+	if (chunk == NULL) {
+		return NULL;
+	}
+	struct hash_table_vlog *hash_table = calloc(1, sizeof(struct hash_table_vlog));
+	assert(hash_table != NULL);
+	if (directory != NULL) {
+		hash_table->directory = strdup(directory);
+		assert(hash_table->directory != NULL);
+	}
+	atomic_store(&hash_table->chunks[0], chunk);
+	hash_table->head = chunk;
+	hash_table->next_id = 1;
+	atomic_store(&hash_table->epoch, 1);
+	hash_table->counter = hash_table_counter_create();
+	pthread_mutex_init(&hash_table->log_mutex, NULL);
+	pthread_mutex_init(&hash_table->collect_mutex, NULL);
+	for (size_t i = 0; i < HASH_TABLE_CAPACITY; ++i) {
+		int error = pthread_mutex_init(&hash_table->buckets[i].mutex, NULL);
+		if (error != 0) {
+			exit(error);
+		}
+	}
+	return hash_table;
+}
+
+static struct vlog_bucket *get_bucket(struct hash_table_vlog *hash_table,
+                                      uint32_t hash)
+{
+	return &hash_table->buckets[hash % HASH_TABLE_CAPACITY];
+}
+
+static struct vlog_entry *find_entry(struct vlog_bucket *bucket,
+                                     const char *key,
+                                     uint32_t hash)
+{
+	for (struct vlog_entry *entry = bucket->head; entry != NULL; entry = entry->next) {
+		if (entry->hash == hash && strcmp(entry->key, key) == 0) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+bool hash_table_vlog_add_entry(struct hash_table_vlog *hash_table,
+                               const char *key,
+                               const void *value,
+                               uint32_t length)
+{
+	uint32_t hash = bernstein_hash(key);
+	struct chunk *chunk;
+	uint64_t address;
+	if (!append(hash_table, key, strlen(key), value, length, &address, &chunk)) {
+		return false;
+	}
+
+	struct vlog_bucket *bucket = get_bucket(hash_table, hash);
+	lock(&bucket->mutex);
+	struct vlog_entry *entry = find_entry(bucket, key, hash);
+	bool inserted = entry == NULL;
+	if (inserted) {
+		entry = malloc(sizeof(struct vlog_entry));
+		assert(entry != NULL);
+		entry->key = key;
+		entry->hash = hash;
+		entry->next = bucket->head;
+		bucket->head = entry;
+	}
+	else {
+		release(hash_table, entry);
+	}
+	entry->address = address;
+	entry->length = length;
+	unlock(&bucket->mutex);
+	atomic_fetch_sub(&chunk->writers, 1);
+	if (inserted) {
+		hash_table_counter_add(hash_table->counter, 1);
+	}
+	return true;
+}
+
+bool hash_table_vlog_contains(struct hash_table_vlog *hash_table,
+                              const char *key)
+{
+	uint32_t hash = bernstein_hash(key);
+	struct vlog_bucket *bucket = get_bucket(hash_table, hash);
+	lock(&bucket->mutex);
+	bool found = find_entry(bucket, key, hash) != NULL;
+	unlock(&bucket->mutex);
+	return found;
+}
+
+/* Announces the current epoch in a free slot, the calling thread's own first */
+static uint32_t begin_read(struct hash_table_vlog *hash_table)
+{
+	static _Atomic uint32_t next_thread;
+	static _Thread_local int thread_slot = -1;
+
+	if (thread_slot < 0) {
+		thread_slot = atomic_fetch_add(&next_thread, 1) % HASH_TABLE_VLOG_MAX_READERS;
+	}
+	for (uint32_t i = thread_slot, tried = 1; ; i = (i + 1) % HASH_TABLE_VLOG_MAX_READERS, ++tried) {
+		uint64_t expected = 0;
+		uint64_t epoch = atomic_load(&hash_table->epoch);
+		if (atomic_compare_exchange_strong(&hash_table->readers[i].epoch, &expected, epoch + 1)) {
+			return i;
+		}
+		/* Every slot is taken, wait for a read to finish */
+		if (tried % HASH_TABLE_VLOG_MAX_READERS == 0) {
+			sched_yield();
+		}
+	}
+}
+
+static void end_read(struct hash_table_vlog *hash_table, uint32_t slot)
+{
+	atomic_store(&hash_table->readers[slot].epoch, 0);
+}
+
+/*
+ * The address is read under the bucket lock and the value copied after.
+ * A collector repoints the entry under the same lock before it retires the
+ * chunk, so a reader that began before the retirement keeps the chunk
+ * mapped until it ends, and one that began after sees the new address.
+ */
+bool hash_table_vlog_get_value(struct hash_table_vlog *hash_table,
+                               const char *key,
+                               void *buffer,
+                               uint32_t capacity,
+                               uint32_t *length)
+{
+	uint32_t hash = bernstein_hash(key);
+	struct vlog_bucket *bucket = get_bucket(hash_table, hash);
+	uint32_t slot = begin_read(hash_table);
+	lock(&bucket->mutex);
+	struct vlog_entry *entry = find_entry(bucket, key, hash);
+	uint64_t address = 0;
+	if (entry != NULL) {
+		address = entry->address;
+		*length = entry->length;
+	}
+	unlock(&bucket->mutex);
+	if (entry != NULL) {
+		struct chunk *chunk = get_chunk(hash_table, address);
+		const char *data = chunk->map + (uint32_t) address;
+		struct vlog_record record;
+		memcpy(&record, data, sizeof(record));
+		memcpy(buffer, data + sizeof(record) + record.key_length + 1,
+		       record.value_length < capacity ? record.value_length : capacity);
+	}
+	end_read(hash_table, slot);
+	return entry != NULL;
+}
+
+size_t hash_table_vlog_size(struct hash_table_vlog *hash_table)
+{
+	return hash_table_counter_read(hash_table->counter);
+}
+
+/* Called with collect_mutex held: unmaps retired chunks no reader can reach */
+static void free_retired(struct hash_table_vlog *hash_table)
+{
+	uint64_t oldest = UINT64_MAX;
+	for (size_t i = 0; i < HASH_TABLE_VLOG_MAX_READERS; ++i) {
+		uint64_t epoch = atomic_load(&hash_table->readers[i].epoch);
+		if (epoch != 0 && epoch - 1 < oldest) {
+			oldest = epoch - 1;
+		}
+	}
+	struct chunk **link = &hash_table->retired;
+	while (*link != NULL) {
+		struct chunk *chunk = *link;
+		if (chunk->retired >= oldest) {
+			link = &chunk->next_retired;
+			continue;
+		}
+		*link = chunk->next_retired;
+		lock(&hash_table->log_mutex);
+		atomic_store(&hash_table->chunks[chunk->id % MAX_CHUNKS], NULL);
+		unlock(&hash_table->log_mutex);
+		destroy_chunk(chunk);
+	}
+}
+
+/* The sealed chunk with the most garbage, or NULL if none has any */
+static struct chunk *pick_chunk(struct hash_table_vlog *hash_table)
+{
+	struct chunk *best = NULL;
+	uint64_t best_garbage = 0;
+	lock(&hash_table->log_mutex);
+	for (size_t i = 0; i < MAX_CHUNKS; ++i) {
+		struct chunk *chunk = atomic_load(&hash_table->chunks[i]);
+		if (chunk == NULL || !chunk->sealed || chunk->retired != 0
+		    || atomic_load(&chunk->writers) != 0) {
+			continue;
+		}
+		uint64_t garbage = chunk->used - atomic_load(&chunk->live);
+		if (garbage > best_garbage) {
+			best = chunk;
+			best_garbage = garbage;
+		}
+	}
+	unlock(&hash_table->log_mutex);
+	return best;
+}
+
+size_t hash_table_vlog_collect(struct hash_table_vlog *hash_table)
+{
+	lock(&hash_table->collect_mutex);
+	free_retired(hash_table);
+	struct chunk *chunk = pick_chunk(hash_table);
+	if (chunk == NULL) {
+		unlock(&hash_table->collect_mutex);
+		return 0;
+	}
+
+	size_t moved = 0;
+	for (uint32_t offset = 0; offset < chunk->used; ) {
+		struct vlog_record record;
+		memcpy(&record, chunk->map + offset, sizeof(record));
+		const char *key = chunk->map + offset + sizeof(record);
+		uint32_t bytes = record_bytes(record.key_length, record.value_length);
+		uint32_t hash = bernstein_hash(key);
+		struct vlog_bucket *bucket = get_bucket(hash_table, hash);
+		lock(&bucket->mutex);
+		struct vlog_entry *entry = find_entry(bucket, key, hash);
+		if (entry != NULL && entry->address == make_address(chunk->id, offset)) {
+			/* A large record fills its chunk, so it is never live in one being cleaned */
+			struct chunk *head;
+			bool appended = append(hash_table, entry->key, record.key_length,
+			                       key + record.key_length + 1, record.value_length,
+			                       &entry->address, &head);
+			assert(appended);
+			atomic_fetch_sub(&head->writers, 1);
+			atomic_fetch_sub(&chunk->live, bytes);
+			moved += bytes;
+		}
+		unlock(&bucket->mutex);
+		offset += bytes;
+	}
+
+	size_t reclaimed = chunk->used - moved;
+	/* Readers that began before this bump may still be copying out of chunk */
+	lock(&hash_table->log_mutex);
+	chunk->retired = atomic_fetch_add(&hash_table->epoch, 1);
+	unlock(&hash_table->log_mutex);
+	chunk->next_retired = hash_table->retired;
+	hash_table->retired = chunk;
+	free_retired(hash_table);
+	atomic_fetch_add(&hash_table->collected, 1);
+	atomic_fetch_add(&hash_table->moved_bytes, moved);
+	unlock(&hash_table->collect_mutex);
+	return reclaimed;
+}
+
+void hash_table_vlog_stats(struct hash_table_vlog *hash_table,
+                           struct hash_table_vlog_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	lock(&hash_table->log_mutex);
+	for (size_t i = 0; i < MAX_CHUNKS; ++i) {
+		struct chunk *chunk = atomic_load(&hash_table->chunks[i]);
+		if (chunk == NULL) {
+			continue;
+		}
+		stats->live_bytes += atomic_load(&chunk->live);
+		stats->log_bytes += chunk->used;
+		++stats->chunks;
+	}
+	unlock(&hash_table->log_mutex);
+	stats->collected = atomic_load(&hash_table->collected);
+	stats->moved_bytes = atomic_load(&hash_table->moved_bytes);
+}
+
+void hash_table_vlog_destroy(struct hash_table_vlog *hash_table)
+{
+	for (size_t i = 0; i < HASH_TABLE_CAPACITY; ++i) {
+		struct vlog_bucket *bucket = &hash_table->buckets[i];
+		while (bucket->head != NULL) {
+			struct vlog_entry *next = bucket->head->next;
+			free(bucket->head);
+			bucket->head = next;
+		}
+		pthread_mutex_destroy(&bucket->mutex);
+	}
+	for (size_t i = 0; i < MAX_CHUNKS; ++i) {
+		struct chunk *chunk = atomic_load(&hash_table->chunks[i]);
+		if (chunk != NULL) {
+			destroy_chunk(chunk);
+		}
+	}
+	pthread_mutex_destroy(&hash_table->collect_mutex);
+	pthread_mutex_destroy(&hash_table->log_mutex);
+	hash_table_counter_destroy(hash_table->counter);
+	free(hash_table->directory);
+	free(hash_table);
+}
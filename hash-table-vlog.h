@@ -0,0 +1,69 @@
+#pragma once
+
+#include "hash-table-common.h"
+
+#include <stdbool.h>
+
+/*
+ * A table with arbitrary byte values kept out of the chains, WiscKey
+ * style. Values are appended, with a copy of their key, to a value log
+ * made of fixed-size chunks, and a chain node holds only the key, the
+ * value's log address and its length, so nodes stay the same size however
+ * large the values are. Chunks are anonymous memory, or unlinked files in
+ * a directory when one is given. A record over a quarter of a chunk gets a
+ * chunk of its own sized to fit, so a value can be up to 4 GiB less its
+ * key and a few bytes.
+ *
+ * An overwrite leaves the old value in the log as garbage. Each call to
+ * hash_table_vlog_collect cleans the chunk with the most garbage: it moves
+ * the chunk's live values to the head of the log, repointing their nodes
+ * one bucket lock at a time, and retires the chunk. Readers copy a value
+ * out of the log after dropping the bucket lock, so a retired chunk is
+ * only unmapped once every read that started before it was retired is
+ * done; collection never waits for readers.
+ *
+ * Keys are not copied, as in v2.
+ */
+struct hash_table_vlog;
+
+/* Reads that can copy values out of the log at once */
+#define HASH_TABLE_VLOG_MAX_READERS 64
+
+struct hash_table_vlog_stats {
+	size_t live_bytes;
+	size_t log_bytes;
+	size_t chunks;
+	size_t collected;
+	size_t moved_bytes;
+};
+
+/* directory may be NULL for a log in memory; returns NULL with errno set */
+struct hash_table_vlog *hash_table_vlog_create(const char *directory);
+/*
+ * Returns false with errno set, leaving key as it was, if the value is too
+ * large (EFBIG) or its chunk cannot be created.
+ */
+bool hash_table_vlog_add_entry(struct hash_table_vlog *hash_table,
+                               const char *key,
+                               const void *value,
+                               uint32_t length);
+bool hash_table_vlog_contains(struct hash_table_vlog *hash_table,
+                              const char *key);
+/*
+ * Copies up to capacity bytes of key's value into buffer and sets *length
+ * to its full length. Returns false if key is missing. With
+ * HASH_TABLE_VLOG_MAX_READERS reads already in flight, waits for one to
+ * finish.
+ */
+bool hash_table_vlog_get_value(struct hash_table_vlog *hash_table,
+                               const char *key,
+                               void *buffer,
+                               uint32_t capacity,
+                               uint32_t *length);
+size_t hash_table_vlog_size(struct hash_table_vlog *hash_table);
+/* Cleans at most one chunk, returns the bytes of garbage it reclaimed */
+size_t hash_table_vlog_collect(struct hash_table_vlog *hash_table);
+/* log_bytes counts every chunk not yet unmapped, garbage included */
+void hash_table_vlog_stats(struct hash_table_vlog *hash_table,
+                           struct hash_table_vlog_stats *stats);
+void hash_table_vlog_destroy(struct hash_table_vlog *hash_table);
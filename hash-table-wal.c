@@ -0,0 +1,380 @@
+#include "hash-table-wal.h"
+#include "hash-table-snapshot.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define WAL_PARTITIONS 64
+#define SLOT_SHIFT 56
+
+/* Followed by key_length bytes of key and a NUL; crc covers both */
+struct wal_record {
+	uint64_t lsn;
+	uint32_t value;
+	uint32_t key_length;
+	uint32_t crc;
+	uint32_t reserved;
+};
+
+struct wal_slot {
+	pthread_mutex_t mutex;
+	char *buffer;
+	size_t length;
+	size_t capacity;
+	/* Bytes ever appended to this slot, a ticket is this after its record */
+	uint64_t appended;
+} __attribute__((aligned(64)));
+
+/* durable[i] is how much of slot i's appended bytes are synced, under mutex */
+struct hash_table_wal {
+	int fd;
+	_Atomic uint64_t next_lsn;
+	struct wal_slot slots[HASH_TABLE_WAL_SLOTS];
+	pthread_mutex_t mutex;
+	pthread_cond_t pending_cond;
+	pthread_cond_t durable_cond;
+	bool pending;
+	bool closing;
+	uint64_t durable[HASH_TABLE_WAL_SLOTS];
+	pthread_t committer;
+	char *batch;
+	size_t batch_capacity;
+};
+
+static _Atomic uint32_t next_slot;
+static _Thread_local int thread_slot = -1;
+
+static void lock(pthread_mutex_t *mutex)
+{
+	int error = pthread_mutex_lock(mutex);
+	if (error != 0) {
+		exit(error);
+	}
+}
+
+static void unlock(pthread_mutex_t *mutex)
+{
+	int error = pthread_mutex_unlock(mutex);
+	if (error != 0) {
+		exit(error);
+	}
+}
+
+static void reserve_bytes(char **buffer, size_t *capacity, size_t length)
+{
+	if (length <= *capacity) {
+		return;
+	}
+	size_t new_capacity = *capacity == 0 ? 4096 : *capacity;
+	while (new_capacity < length) {
+		new_capacity *= 2;
+	}
+	*buffer = realloc(*buffer, new_capacity);
+	assert(*buffer != NULL);
+	*capacity = new_capacity;
+}
+
+static uint32_t get_record_crc(const struct wal_record *record, const char *key)
+{
+	uint32_t crc = hash_table_crc32c(0, record, offsetof(struct wal_record, crc));
+	return hash_table_crc32c(crc, key, record->key_length + 1);
+}
+
+/* Gathers every slot into one write, syncs it, then wakes the writers covered */
+static void *run_committer(void *arg)
+{
+	struct hash_table_wal *wal = arg;
+	uint64_t taken[HASH_TABLE_WAL_SLOTS];
+	while (true) {
+		lock(&wal->mutex);
+		while (!wal->pending && !wal->closing) {
+			pthread_cond_wait(&wal->pending_cond, &wal->mutex);
+		}
+		if (!wal->pending) {
+			unlock(&wal->mutex);
+			return NULL;
+		}
+		wal->pending = false;
+		unlock(&wal->mutex);
+
+		size_t length = 0;
+		for (uint32_t i = 0; i < HASH_TABLE_WAL_SLOTS; ++i) {
+			struct wal_slot *slot = &wal->slots[i];
+			lock(&slot->mutex);
+			if (slot->length > 0) {
+				reserve_bytes(&wal->batch, &wal->batch_capacity, length + slot->length);
+				memcpy(wal->batch + length, slot->buffer, slot->length);
+				length += slot->length;
+				slot->length = 0;
+			}
+			taken[i] = slot->appended;
+			unlock(&slot->mutex);
+		}
+
+		for (size_t written = 0; written < length;) {
+			ssize_t result = write(wal->fd, wal->batch + written, length - written);
+			if (result < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				exit(errno);
+			}
+			written += result;
+		}
+		if (length > 0 && fdatasync(wal->fd) != 0) {
+			exit(errno);
+		}
+
+		lock(&wal->mutex);
+		memcpy(wal->durable, taken, sizeof(taken));
+		pthread_cond_broadcast(&wal->durable_cond);
+		unlock(&wal->mutex);
+	}
+}
+
+struct hash_table_wal *hash_table_wal_open(const char *path, uint64_t next_lsn)
+{
+	/* Only a log this call created needs its directory synced */
+	int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0644);
+	bool created = fd >= 0;
+	if (fd < 0 && errno == EEXIST) {
+		fd = open(path, O_WRONLY | O_APPEND);
+	}
+	if (fd < 0) {
+		return NULL;
+	}
+	if (created) {
+		int error = hash_table_sync_directory(path);
+		if (error != 0) {
+			close(fd);
+			errno = error;
+			return NULL;
+		}
+	}
+	struct hash_table_wal *wal = aligned_alloc(64, sizeof(struct hash_table_wal));
+	assert(wal != NULL);
+	memset(wal, 0, sizeof(struct hash_table_wal));
+	wal->fd = fd;
+	atomic_init(&wal->next_lsn, next_lsn);
+	for (uint32_t i = 0; i < HASH_TABLE_WAL_SLOTS; ++i) {
+		int error = pthread_mutex_init(&wal->slots[i].mutex, NULL);
+		if (error != 0) {
+			exit(error);
+		}
+	}
+	int error = pthread_mutex_init(&wal->mutex, NULL);
+	if (error == 0) {
+		error = pthread_cond_init(&wal->pending_cond, NULL);
+	}
+	if (error == 0) {
+		error = pthread_cond_init(&wal->durable_cond, NULL);
+	}
+	if (error == 0) {
+		error = pthread_create(&wal->committer, NULL, run_committer, wal);
+	}
+	if (error != 0) {
+		exit(error);
+	}
+	return wal;
+}
+
+uint64_t hash_table_wal_append(struct hash_table_wal *wal,
+                               const char *key,
+                               uint32_t value)
+{
+	if (thread_slot < 0) {
+		thread_slot = atomic_fetch_add(&next_slot, 1) % HASH_TABLE_WAL_SLOTS;
+	}
+	struct wal_slot *slot = &wal->slots[thread_slot];
+	struct wal_record record = {
+		.value = value,
+		.key_length = strlen(key),
+	};
+	size_t size = sizeof(record) + record.key_length + 1;
+
+	lock(&slot->mutex);
+	record.lsn = atomic_fetch_add(&wal->next_lsn, 1);
+	record.crc = get_record_crc(&record, key);
+	reserve_bytes(&slot->buffer, &slot->capacity, slot->length + size);
+	memcpy(slot->buffer + slot->length, &record, sizeof(record));
+	memcpy(slot->buffer + slot->length + sizeof(record), key, record.key_length + 1);
+	slot->length += size;
+	slot->appended += size;
+	uint64_t ticket = ((uint64_t) thread_slot << SLOT_SHIFT) | slot->appended;
+	unlock(&slot->mutex);
+
+	lock(&wal->mutex);
+	if (!wal->pending) {
+		wal->pending = true;
+		pthread_cond_signal(&wal->pending_cond);
+	}
+	unlock(&wal->mutex);
+	return ticket;
+}
+
+void hash_table_wal_wait(struct hash_table_wal *wal, uint64_t ticket)
+{
+	uint32_t slot = ticket >> SLOT_SHIFT;
+	uint64_t position = ticket & ((1ULL << SLOT_SHIFT) - 1);
+	lock(&wal->mutex);
+	while (wal->durable[slot] < position) {
+		pthread_cond_wait(&wal->durable_cond, &wal->mutex);
+	}
+	unlock(&wal->mutex);
+}
+
+void hash_table_wal_close(struct hash_table_wal *wal)
+{
+	lock(&wal->mutex);
+	wal->closing = true;
+	wal->pending = true;
+	pthread_cond_signal(&wal->pending_cond);
+	unlock(&wal->mutex);
+	int error = pthread_join(wal->committer, NULL);
+	if (error != 0) {
+		exit(error);
+	}
+	close(wal->fd);
+	for (uint32_t i = 0; i < HASH_TABLE_WAL_SLOTS; ++i) {
+		pthread_mutex_destroy(&wal->slots[i].mutex);
+		free(wal->slots[i].buffer);
+	}
+	pthread_mutex_destroy(&wal->mutex);
+	pthread_cond_destroy(&wal->pending_cond);
+	pthread_cond_destroy(&wal->durable_cond);
+	free(wal->batch);
+	free(wal);
+}
+
+struct replay_entry {
+	uint64_t lsn;
+	const char *key;
+	uint32_t value;
+};
+
+struct replay_job {
+	struct replay_entry *entries;
+	/* Partition i is entries [starts[i], starts[i + 1]) */
+	size_t starts[WAL_PARTITIONS + 1];
+	void (*apply)(void *context, const char *key, uint32_t value);
+	void *context;
+};
+
+static int compare_lsn(const void *a, const void *b)
+{
+	const struct replay_entry *x = a;
+	const struct replay_entry *y = b;
+	return (x->lsn > y->lsn) - (x->lsn < y->lsn);
+}
+
+static void replay_partition(void *context, uint32_t i)
+{
+	struct replay_job *job = context;
+	struct replay_entry *entries = &job->entries[job->starts[i]];
+	size_t count = job->starts[i + 1] - job->starts[i];
+	/* Batches interleave the slots, so file order is not log order */
+	qsort(entries, count, sizeof(struct replay_entry), compare_lsn);
+	for (size_t j = 0; j < count; ++j) {
+		job->apply(job->context, entries[j].key, entries[j].value);
+	}
+}
+
+static uint32_t get_partition(const char *key)
+{
+	return (bernstein_hash(key) % HASH_TABLE_CAPACITY) / (HASH_TABLE_CAPACITY / WAL_PARTITIONS);
+}
+
+char *hash_table_wal_replay(const char *path,
+                            uint32_t threads,
+                            void (*apply)(void *context, const char *key, uint32_t value),
+                            void *context,
+                            uint64_t *next_lsn)
+{
+	int fd = open(path, O_RDWR);
+	if (fd < 0) {
+		return NULL;
+	}
+	struct stat status;
+	if (fstat(fd, &status) != 0) {
+		int error = errno;
+		close(fd);
+		errno = error;
+		return NULL;
+	}
+	size_t length = status.st_size;
+	char *contents = malloc(length + 1);
+	assert(contents != NULL);
+	for (size_t done = 0; done < length;) {
+		ssize_t result = pread(fd, contents + done, length - done, done);
+		if (result <= 0) {
+			int error = result < 0 ? errno : EIO;
+			if (error == EINTR) {
+				continue;
+			}
+			free(contents);
+			close(fd);
+			errno = error;
+			return NULL;
+		}
+		done += result;
+	}
+
+	/* First pass finds the valid prefix and sizes the partitions */
+	struct replay_job job = { .apply = apply, .context = context };
+	size_t counts[WAL_PARTITIONS] = { 0 };
+	size_t count = 0;
+	size_t offset = 0;
+	*next_lsn = 0;
+	while (length - offset >= sizeof(struct wal_record)) {
+		struct wal_record record;
+		memcpy(&record, contents + offset, sizeof(record));
+		const char *key = contents + offset + sizeof(record);
+		if (record.key_length >= length - offset - sizeof(record)
+		    || key[record.key_length] != '\0'
+		    || get_record_crc(&record, key) != record.crc) {
+			break;
+		}
+		++counts[get_partition(key)];
+		++count;
+		if (record.lsn >= *next_lsn) {
+			*next_lsn = record.lsn + 1;
+		}
+		offset += sizeof(record) + record.key_length + 1;
+	}
+	if (offset < length && ftruncate(fd, offset) != 0) {
+		int error = errno;
+		free(contents);
+		close(fd);
+		errno = error;
+		return NULL;
+	}
+	close(fd);
+
+	job.entries = malloc(count * sizeof(struct replay_entry) + 1);
+	assert(job.entries != NULL);
+	for (uint32_t i = 0; i < WAL_PARTITIONS; ++i) {
+		job.starts[i + 1] = job.starts[i] + counts[i];
+		counts[i] = job.starts[i];
+	}
+	for (size_t position = 0; position < offset;) {
+		struct wal_record record;
+		memcpy(&record, contents + position, sizeof(record));
+		const char *key = contents + position + sizeof(record);
+		struct replay_entry *entry = &job.entries[counts[get_partition(key)]++];
+		entry->lsn = record.lsn;
+		entry->key = key;
+		entry->value = record.value;
+		position += sizeof(record) + record.key_length + 1;
+	}
+	hash_table_parallel(WAL_PARTITIONS, threads, replay_partition, &job);
+	free(job.entries);
+	return contents;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "hash-table-common.h"
+
+/*
+ * Write-ahead log with group commit. Writers append records to one of
+ * HASH_TABLE_WAL_SLOTS per-thread buffers; a committer thread gathers
+ * every buffer into a single write followed by one fdatasync, so all the
+ * writers waiting meanwhile share the cost of that sync.
+ */
+#define HASH_TABLE_WAL_SLOTS 64
+
+struct hash_table_wal;
+
+/*
+ * Appends to path, numbering records from next_lsn. If path has to be
+ * created, its directory is synced before this returns, so the first
+ * commit cannot be lost with the directory entry. NULL with errno set on
+ * failure.
+ */
+struct hash_table_wal *hash_table_wal_open(const char *path, uint64_t next_lsn);
+/*
+ * Buffers a record and returns a ticket for hash_table_wal_wait. Records
+ * for the same key must be appended in the order they are applied, e.g.
+ * under the bucket lock, since replay orders them by sequence number.
+ */
+uint64_t hash_table_wal_append(struct hash_table_wal *wal,
+                               const char *key,
+                               uint32_t value);
+/* Blocks until the record behind ticket is on disk */
+void hash_table_wal_wait(struct hash_table_wal *wal, uint64_t ticket);
+/* Syncs whatever is still buffered, then closes the log */
+void hash_table_wal_close(struct hash_table_wal *wal);
+
+/*
+ * Reads the log at path and calls apply for every record. Records are
+ * split by bucket range and each range is replayed, in log order, on its
+ * own thread, so apply is called concurrently but never for two keys in
+ * the same bucket at once. A torn record at the tail ends the log and is
+ * cut off the file. Returns the file contents, which the keys passed to
+ * apply point into, or NULL with errno set (ENOENT if there is no log).
+ */
+char *hash_table_wal_replay(const char *path,
+                            uint32_t threads,
+                            void (*apply)(void *context, const char *key, uint32_t value),
+                            void *context,
+                            uint64_t *next_lsn);
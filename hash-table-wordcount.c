@@ -0,0 +1,342 @@
+#include "hash-table-common.h"
+#include "hash-table-v2.h"
+
+#include <argp.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <locale.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/*
+ * Counts the whitespace separated tokens of a file into a v2 table. The
+ * file is mapped once and cut into newline aligned chunks, one per thread.
+ * A thread counts its chunk into a private open-addressed table whose
+ * words point into the mapping, then merges its distinct words into the
+ * shared table with hash_table_v2_add_counts, a bucket lock per batch
+ * rather than per token.
+ *
+ * Keys in the shared table point into the mapping too. The mapping is
+ * private and writable so a word can be terminated by overwriting the
+ * delimiter after its first occurrence with a NUL; only pages holding a
+ * first occurrence are ever copied. A word that ends the file has no
+ * delimiter to overwrite and is the one key that gets copied.
+ */
+
+#define MERGE_BATCH 4096
+
+struct arguments {
+	uint32_t threads;
+	const char *path;
+	char **words;
+	int word_count;
+};
+
+static struct argp_option options[] = {
+	{ "threads", 't', "NUM", 0, "Number of threads."},
+	{ 0 }
+};
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state) {
+	struct arguments *arguments = state->input;
+	switch (key) {
+	case 't':
+		arguments->threads = strtoul(arg, NULL, 10);
+		if (arguments->threads == 0) {
+			argp_error(state, "need at least one thread");
+		}
+		break;
+	case ARGP_KEY_ARGS:
+		arguments->path = state->argv[state->next];
+		arguments->words = &state->argv[state->next + 1];
+		arguments->word_count = state->argc - state->next - 1;
+		break;
+	case ARGP_KEY_NO_ARGS:
+		argp_usage(state);
+		break;
+	default:
+		return ARGP_ERR_UNKNOWN;
+	}
+	return 0;
+}
+
+struct local_word {
+	char *start;
+	uint32_t length;
+	uint32_t hash;
+	uint32_t count;
+};
+
+/* A chunk of the mapping and the words counted in it */
+struct chunk {
+	char *begin;
+	char *end;
+	struct local_word *words;
+	size_t mask;
+	size_t distinct;
+	size_t tokens;
+	char **copies;
+	size_t copy_count;
+	unsigned long tokenize_usec;
+	unsigned long merge_usec;
+};
+
+static struct hash_table_v2 *hash_table;
+static char *map_end;
+
+static unsigned long usec_diff(struct timeval *a, struct timeval *b)
+{
+	unsigned long usec;
+	usec = (b->tv_sec - a->tv_sec)*1000000;
+	usec += b->tv_usec - a->tv_usec;
+	return usec;
+}
+
+/* NUL is a delimiter too, a key cannot hold one */
+static bool is_delimiter(char c)
+{
+	return c == ' ' || c == '\n' || c == '\t' || c == '\r'
+	       || c == '\v' || c == '\f' || c == '\0';
+}
+
+static void grow_words(struct chunk *chunk)
+{
+	size_t capacity = 2 * (chunk->mask + 1);
+	struct local_word *words = calloc(capacity, sizeof(struct local_word));
+	assert(words != NULL);
+	for (size_t i = 0; i <= chunk->mask; ++i) {
+		struct local_word *word = &chunk->words[i];
+		if (word->start == NULL) {
+			continue;
+		}
+		size_t j = hash_table_mix(word->hash) & (capacity - 1);
+		while (words[j].start != NULL) {
+			j = (j + 1) & (capacity - 1);
+		}
+		words[j] = *word;
+	}
+	free(chunk->words);
+	chunk->words = words;
+	chunk->mask = capacity - 1;
+}
+
+static void count_word(struct chunk *chunk,
+                       char *start,
+                       uint32_t length,
+                       uint32_t hash)
+{
+	size_t i = hash_table_mix(hash) & chunk->mask;
+	for (;; i = (i + 1) & chunk->mask) {
+		struct local_word *word = &chunk->words[i];
+		if (word->start == NULL) {
+			break;
+		}
+		if (word->hash == hash && word->length == length
+		    && memcmp(word->start, start, length) == 0) {
+			++word->count;
+			return;
+		}
+	}
+	chunk->words[i] = (struct local_word) {
+		.start = start,
+		.length = length,
+		.hash = hash,
+		.count = 1,
+	};
+	if (++chunk->distinct * 2 > chunk->mask + 1) {
+		grow_words(chunk);
+	}
+}
+
+static void tokenize(struct chunk *chunk)
+{
+	chunk->mask = 1023;
+	chunk->words = calloc(chunk->mask + 1, sizeof(struct local_word));
+	assert(chunk->words != NULL);
+	char *c = chunk->begin;
+	while (c < chunk->end) {
+		while (c < chunk->end && is_delimiter(*c)) {
+			++c;
+		}
+		if (c == chunk->end) {
+			break;
+		}
+		char *start = c;
+		uint32_t hash = 5381;
+		for (; c < chunk->end && !is_delimiter(*c); ++c) {
+			hash = hash * 33 + (unsigned char) *c;
+		}
+		count_word(chunk, start, c - start, hash);
+		++chunk->tokens;
+	}
+}
+
+/* Terminates a word in place, or copies it if it runs to the end of the file */
+static const char *make_key(struct chunk *chunk, struct local_word *word)
+{
+	if (word->start + word->length < map_end) {
+		word->start[word->length] = '\0';
+		return word->start;
+	}
+	char *copy = strndup(word->start, word->length);
+	assert(copy != NULL);
+	chunk->copies = realloc(chunk->copies, (chunk->copy_count + 1) * sizeof(char *));
+	assert(chunk->copies != NULL);
+	chunk->copies[chunk->copy_count++] = copy;
+	return copy;
+}
+
+static void merge(struct chunk *chunk)
+{
+	const char *keys[MERGE_BATCH];
+	uint32_t deltas[MERGE_BATCH];
+	size_t count = 0;
+	for (size_t i = 0; i <= chunk->mask; ++i) {
+		struct local_word *word = &chunk->words[i];
+		if (word->start == NULL) {
+			continue;
+		}
+		keys[count] = make_key(chunk, word);
+		deltas[count] = word->count;
+		if (++count == MERGE_BATCH) {
+			hash_table_v2_add_counts(hash_table, keys, deltas, count);
+			count = 0;
+		}
+	}
+	hash_table_v2_add_counts(hash_table, keys, deltas, count);
+}
+
+void *run_chunk(void *arg) {
+	struct chunk *chunk = arg;
+	struct timeval start, middle, end;
+	gettimeofday(&start, NULL);
+	tokenize(chunk);
+	gettimeofday(&middle, NULL);
+	merge(chunk);
+	gettimeofday(&end, NULL);
+	chunk->tokenize_usec = usec_diff(&start, &middle);
+	chunk->merge_usec = usec_diff(&middle, &end);
+	return NULL;
+}
+
+/* Moves position to just past the next newline, or to the end */
+static char *align_chunk(char *position, char *end)
+{
+	if (position == end) {
+		return end;
+	}
+	char *newline = memchr(position, '\n', end - position);
+	return newline == NULL ? end : newline + 1;
+}
+
+int main(int argc, char *argv[])
+{
+	struct arguments arguments = { .threads = 4 };
+	static struct argp argp = { options, parse_opt, "FILE [WORD...]",
+		"Count the tokens in FILE, then print the count of each WORD." };
+	argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+	setlocale(LC_ALL, "en_US.UTF-8");
+
+	int fd = open(arguments.path, O_RDONLY);
+	if (fd < 0) {
+		perror(arguments.path);
+		return errno;
+	}
+	struct stat status;
+	if (fstat(fd, &status) != 0) {
+		perror(arguments.path);
+		return errno;
+	}
+	size_t length = status.st_size;
+	char *map = NULL;
+	if (length > 0) {
+		map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			perror(arguments.path);
+			return errno;
+		}
+		madvise(map, length, MADV_SEQUENTIAL);
+	}
+	close(fd);
+	map_end = map + length;
+
+	struct chunk *chunks = calloc(arguments.threads, sizeof(struct chunk));
+	pthread_t *threads = calloc(arguments.threads, sizeof(pthread_t));
+	assert(chunks != NULL && threads != NULL);
+	char *position = map;
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		chunks[i].begin = position;
+		if (i + 1 < arguments.threads) {
+			char *target = map + length / arguments.threads * (i + 1);
+			position = align_chunk(target > position ? target : position, map_end);
+		}
+		else {
+			position = map_end;
+		}
+		chunks[i].end = position;
+	}
+
+	struct timeval start, end;
+	hash_table = hash_table_v2_create();
+	gettimeofday(&start, NULL);
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		int err = pthread_create(&threads[i], NULL, run_chunk, &chunks[i]);
+		if (err != 0) {
+			printf("pthread_create returned %d\n", err);
+			return err;
+		}
+	}
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		int err = pthread_join(threads[i], NULL);
+		if (err != 0) {
+			printf("pthread_join returned %d\n", err);
+			return err;
+		}
+	}
+	gettimeofday(&end, NULL);
+
+	unsigned long usec = usec_diff(&start, &end);
+	size_t tokens = 0;
+	unsigned long tokenize_usec = 0, merge_usec = 0;
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		tokens += chunks[i].tokens;
+		if (chunks[i].tokenize_usec > tokenize_usec) {
+			tokenize_usec = chunks[i].tokenize_usec;
+		}
+		if (chunks[i].merge_usec > merge_usec) {
+			merge_usec = chunks[i].merge_usec;
+		}
+	}
+	double seconds = usec > 0 ? usec / 1e6 : 1e-6;
+	printf("Word count: %'lu usec (%'zu bytes, %.2f GB/s)\n", usec, length, length / seconds / 1e9);
+	printf("  - %'zu tokens (%'.0f tokens/s), %'zu distinct\n", tokens, tokens / seconds, hash_table_v2_size(hash_table));
+	printf("  - %'lu usec tokenize, %'lu usec merge (slowest thread)\n", tokenize_usec, merge_usec);
+	for (int i = 0; i < arguments.word_count; ++i) {
+		const char *word = arguments.words[i];
+		uint32_t count = hash_table_v2_contains(hash_table, word) ? hash_table_v2_get_value(hash_table, word) : 0;
+		printf("%s: %'u\n", word, count);
+	}
+
+	hash_table_v2_destroy(hash_table);
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		for (size_t j = 0; j < chunks[i].copy_count; ++j) {
+			free(chunks[i].copies[j]);
+		}
+		free(chunks[i].copies);
+		free(chunks[i].words);
+	}
+	free(threads);
+	free(chunks);
+	if (map != NULL) {
+		munmap(map, length);
+	}
+	return 0;
+}